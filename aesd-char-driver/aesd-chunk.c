@@ -0,0 +1,298 @@
+/**
+ * @file aesd-chunk.c
+ * @brief Chunked byte logs holding the writes to an aesd char device
+ *
+ * Each open file appends to its own log under its own lock, and each device copies short
+ * stored writes to its own log under the device lock.  Readers walk a stored write's
+ * chunks without either, inside an SRCU read section: chunk links are set before the write
+ * is published and a chunk is only freed a grace period after its last reference, from the
+ * log or from a write in the ring, is put.
+ *
+ * @author Chris Choi
+ * @date 2021-10-19
+ *
+ */
+
+#include <linux/atomic.h>
+#include <linux/compiler.h>
+#include <linux/errno.h>
+#include <linux/slab.h>
+#include <linux/srcu.h>
+#include <linux/string.h>
+#include <linux/uio.h>
+
+#include "aesd-chunk.h"
+
+static struct kmem_cache *aesd_chunk_cache;
+static atomic_long_t aesd_chunk_count = ATOMIC_LONG_INIT(0);
+
+/**
+ * Creates the cache every device's chunks come from, aligned to the chunk size for aesd_chunk_of
+ * @return 0 or -ENOMEM
+ */
+int aesd_chunk_cache_create(void)
+{
+	aesd_chunk_cache = kmem_cache_create("aesd_chunk", AESD_CHUNK_SIZE, AESD_CHUNK_SIZE, 0, NULL);
+	return aesd_chunk_cache == NULL ? -ENOMEM : 0;
+}
+
+/**
+ * Every chunk must have been freed, including those waiting for a grace period
+ */
+void aesd_chunk_cache_destroy(void)
+{
+	kmem_cache_destroy(aesd_chunk_cache);
+}
+
+void aesd_chunk_log_init(struct aesd_chunk_log *log)
+{
+	memset(log, 0, sizeof(*log));
+}
+
+static void aesd_chunk_free_rcu(struct rcu_head *rcu)
+{
+	kmem_cache_free(aesd_chunk_cache, container_of(rcu, struct aesd_chunk, rcu));
+	atomic_long_dec(&aesd_chunk_count);
+}
+
+static void aesd_chunk_put(struct aesd_chunk *chunk, struct srcu_struct *srcu)
+{
+	if(refcount_dec_and_test(&chunk->ref))
+		call_srcu(srcu, &chunk->rcu, aesd_chunk_free_rcu);
+}
+
+/**
+ * Puts every reference @param log holds, dropping whatever it staged.  Chunks still used by
+ * stored writes stay until those leave the ring.
+ */
+void aesd_chunk_log_destroy(struct aesd_chunk_log *log, struct srcu_struct *srcu)
+{
+	struct aesd_chunk *chunk;
+
+	while(log->head != NULL)
+	{
+		chunk = log->head;
+		log->head = chunk->next;
+		aesd_chunk_put(chunk, srcu);
+	}
+	aesd_chunk_log_init(log);
+}
+
+static struct aesd_chunk *aesd_chunk_alloc(void)
+{
+	struct aesd_chunk *chunk = kmem_cache_alloc(aesd_chunk_cache, GFP_KERNEL);
+
+	if(chunk == NULL)
+		return NULL;
+	chunk->next = NULL;
+	refcount_set(&chunk->ref, 1);
+	atomic_long_inc(&aesd_chunk_count);
+	return chunk;
+}
+
+/**
+ * Makes @param chunk, from aesd_chunk_alloc, the empty tail of @param log
+ */
+static void aesd_chunk_log_link(struct aesd_chunk_log *log, struct aesd_chunk *chunk)
+{
+	//readers only follow the link once a write using it is published
+	if(log->tail != NULL)
+		WRITE_ONCE(log->tail->next, chunk);
+	else
+		log->head = chunk;
+	log->tail = chunk;
+	log->tail_used = 0;
+}
+
+/**
+ * Copies up to @param max bytes from @param from to the end of @param log, within one chunk and
+ * taking a new one when the tail is full.  Any necessary locking must be performed by the caller.
+ * @param dst set to where the copied bytes start
+ * @return bytes copied, or -ENOMEM or -EFAULT if none could be
+ */
+ssize_t aesd_chunk_log_append_from_iter(struct aesd_chunk_log *log, struct iov_iter *from,
+			size_t max, char **dst)
+{
+	struct aesd_chunk *chunk;
+	size_t bytes;
+
+	if(log->tail == NULL || log->tail_used == AESD_CHUNK_DATA_SIZE)
+	{
+		chunk = aesd_chunk_alloc();
+		if(chunk == NULL)
+			return -ENOMEM;
+		aesd_chunk_log_link(log, chunk);
+	}
+
+	*dst = &log->tail->data[log->tail_used];
+	bytes = copy_from_iter(*dst, min(max, AESD_CHUNK_DATA_SIZE - log->tail_used), from);
+	if(bytes == 0)
+		return -EFAULT;
+	log->tail_used += bytes;
+	return bytes;
+}
+
+/**
+ * Copies @param bytes bytes starting at @param ptr, in another log, to the end of @param log,
+ * packed right after what it holds and continuing in at most one new chunk.  @param bytes must
+ * be at most AESD_CHUNK_DATA_SIZE.  Any necessary locking must be performed by the caller.
+ * @param dst set to where the copy starts
+ * @return 0, or -ENOMEM with nothing appended
+ */
+int aesd_chunk_log_append_copy(struct aesd_chunk_log *log, const char *ptr, size_t bytes, char **dst)
+{
+	size_t room = log->tail != NULL ? AESD_CHUNK_DATA_SIZE - log->tail_used : 0;
+	size_t length = min(bytes, room);
+	struct aesd_chunk *chunk = NULL;
+
+	//the new chunk is taken first, so a failed allocation leaves the log as it was
+	if(bytes > room)
+	{
+		chunk = aesd_chunk_alloc();
+		if(chunk == NULL)
+			return -ENOMEM;
+	}
+
+	if(length > 0)
+	{
+		*dst = &log->tail->data[log->tail_used];
+		aesd_chunk_copy(*dst, ptr, length);
+		log->tail_used += length;
+	}
+	if(chunk != NULL)
+	{
+		aesd_chunk_log_link(log, chunk);
+		if(length == 0)
+			*dst = chunk->data;
+		aesd_chunk_copy(chunk->data, aesd_chunk_seek(ptr, length), bytes - length);
+		log->tail_used = bytes - length;
+	}
+	return 0;
+}
+
+/**
+ * Takes back the last @param bytes bytes appended to @param log, which must all be in its tail,
+ * as from the last aesd_chunk_log_append_from_iter
+ */
+void aesd_chunk_log_trim(struct aesd_chunk_log *log, size_t bytes)
+{
+	log->tail_used -= bytes;
+}
+
+/**
+ * Puts the references @param log holds on its chunks before the one holding @param oldest, its
+ * first staged byte.  NULL keeps only the tail.  Any necessary locking must be performed by the caller.
+ */
+void aesd_chunk_log_release(struct aesd_chunk_log *log, const char *oldest, struct srcu_struct *srcu)
+{
+	struct aesd_chunk *keep = oldest != NULL ? aesd_chunk_of(oldest) : log->tail;
+	struct aesd_chunk *chunk;
+
+	while(log->head != keep)
+	{
+		chunk = log->head;
+		log->head = chunk->next;
+		aesd_chunk_put(chunk, srcu);
+	}
+}
+
+/**
+ * Takes a reference on every chunk holding one of the @param bytes bytes from @param ptr,
+ * for a write about to be stored.  The chunks must already be referenced.
+ */
+void aesd_chunk_get_range(const char *ptr, size_t bytes)
+{
+	struct aesd_chunk *chunk = aesd_chunk_of(ptr);
+
+	refcount_inc(&chunk->ref);
+	while(bytes > aesd_chunk_room(ptr))
+	{
+		bytes -= aesd_chunk_room(ptr);
+		chunk = chunk->next;
+		ptr = chunk->data;
+		refcount_inc(&chunk->ref);
+	}
+}
+
+/**
+ * Puts the references aesd_chunk_get_range took, freeing chunks after an @param srcu grace period
+ */
+void aesd_chunk_put_range(const char *ptr, size_t bytes, struct srcu_struct *srcu)
+{
+	struct aesd_chunk *chunk = aesd_chunk_of(ptr);
+	struct aesd_chunk *next;
+
+	for(;;)
+	{
+		//the link must be read before the put can free the chunk
+		next = bytes > aesd_chunk_room(ptr) ? chunk->next : NULL;
+		if(next != NULL)
+			bytes -= aesd_chunk_room(ptr);
+		aesd_chunk_put(chunk, srcu);
+		if(next == NULL)
+			return;
+		chunk = next;
+		ptr = chunk->data;
+	}
+}
+
+/**
+ * @return memory held by every device's chunks, including those waiting for a grace period
+ */
+size_t aesd_chunk_bytes(void)
+{
+	return atomic_long_read(&aesd_chunk_count) * AESD_CHUNK_SIZE;
+}
+
+/**
+ * @return the address of the byte @param offset bytes after @param ptr, following chunk links
+ */
+const char *aesd_chunk_seek(const char *ptr, size_t offset)
+{
+	while(offset >= aesd_chunk_room(ptr))
+	{
+		offset -= aesd_chunk_room(ptr);
+		ptr = READ_ONCE(aesd_chunk_of(ptr)->next)->data;
+	}
+	return ptr + offset;
+}
+
+/**
+ * Copies @param bytes bytes starting at @param ptr to @param to
+ * @return bytes copied, short if the destination faulted
+ */
+size_t aesd_chunk_copy_to_iter(const char *ptr, size_t bytes, struct iov_iter *to)
+{
+	size_t copied = 0;
+	size_t length;
+	size_t done;
+
+	for(;;)
+	{
+		length = min(bytes - copied, aesd_chunk_room(ptr));
+		done = copy_to_iter(ptr, length, to);
+		copied += done;
+		if(done < length || copied == bytes)
+			return copied;
+		ptr = READ_ONCE(aesd_chunk_of(ptr)->next)->data;
+	}
+}
+
+/**
+ * Copies @param bytes bytes starting at @param ptr to the kernel buffer @param dst
+ */
+void aesd_chunk_copy(char *dst, const char *ptr, size_t bytes)
+{
+	size_t length;
+
+	for(;;)
+	{
+		length = min(bytes, aesd_chunk_room(ptr));
+		memcpy(dst, ptr, length);
+		dst += length;
+		bytes -= length;
+		if(bytes == 0)
+			return;
+		ptr = READ_ONCE(aesd_chunk_of(ptr)->next)->data;
+	}
+}
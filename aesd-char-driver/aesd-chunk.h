@@ -0,0 +1,106 @@
+/*
+ * aesd-chunk.h
+ *
+ * Append only byte logs made of fixed size chunks from one kmem_cache, one per open file of an
+ * aesd char device.  Consecutive writes share chunks, so a short write costs no allocation of
+ * its own and a command assembled from many partial writes is never copied: its circular
+ * buffer entry points at its first byte and its bytes continue chunk to chunk.  Chunks are
+ * aligned to their size, so the chunk holding any byte is found by masking the byte's address.
+ *
+ * A stored command shorter than a chunk is copied once more, to its device's own log, so
+ * short commands through many files share chunks instead of each keeping its file's alive.
+ *
+ * A chunk is referenced by the log while it holds staged bytes or is the tail, and by every
+ * stored entry with bytes in it; it is freed a grace period after the last reference is put.
+ *
+ *  Created on: October 19, 2021
+ *      Author: Chris Choi
+ */
+
+#ifndef AESD_CHUNK_H
+#define AESD_CHUNK_H
+
+#include <linux/types.h>
+#include <linux/mm.h>
+#include <linux/rcupdate.h>
+#include <linux/refcount.h>
+
+#define AESD_CHUNK_SIZE PAGE_SIZE
+
+struct srcu_struct;
+struct iov_iter;
+
+struct aesd_chunk
+{
+	/**
+	 * Frees the chunk a grace period after no stored write uses it any more
+	 */
+	struct rcu_head rcu;
+	/**
+	 * The next chunk of the log, NULL for the tail
+	 */
+	struct aesd_chunk *next;
+	refcount_t ref;
+	char data[];
+};
+
+#define AESD_CHUNK_DATA_SIZE (AESD_CHUNK_SIZE - offsetof(struct aesd_chunk, data))
+
+struct aesd_chunk_log
+{
+	/**
+	 * Oldest chunk the log references, the one holding the first staged byte or the tail
+	 */
+	struct aesd_chunk *head;
+	/**
+	 * Chunk appended to, tail_used bytes of it are taken
+	 */
+	struct aesd_chunk *tail;
+	size_t tail_used;
+};
+
+static inline struct aesd_chunk *aesd_chunk_of(const char *ptr)
+{
+	return (struct aesd_chunk *)((unsigned long)ptr & ~(AESD_CHUNK_SIZE - 1));
+}
+
+/**
+ * @return bytes from @param ptr to the end of its chunk
+ */
+static inline size_t aesd_chunk_room(const char *ptr)
+{
+	return (const char *)aesd_chunk_of(ptr) + AESD_CHUNK_SIZE - ptr;
+}
+
+extern int aesd_chunk_cache_create(void);
+
+extern void aesd_chunk_cache_destroy(void);
+
+extern void aesd_chunk_log_init(struct aesd_chunk_log *log);
+
+extern void aesd_chunk_log_destroy(struct aesd_chunk_log *log, struct srcu_struct *srcu);
+
+extern ssize_t aesd_chunk_log_append_from_iter(struct aesd_chunk_log *log, struct iov_iter *from,
+			size_t max, char **dst);
+
+extern int aesd_chunk_log_append_copy(struct aesd_chunk_log *log, const char *ptr, size_t bytes,
+			char **dst);
+
+extern void aesd_chunk_log_trim(struct aesd_chunk_log *log, size_t bytes);
+
+extern void aesd_chunk_log_release(struct aesd_chunk_log *log, const char *oldest,
+			struct srcu_struct *srcu);
+
+extern void aesd_chunk_get_range(const char *ptr, size_t bytes);
+
+extern void aesd_chunk_put_range(const char *ptr, size_t bytes, struct srcu_struct *srcu);
+
+extern size_t aesd_chunk_bytes(void);
+
+extern const char *aesd_chunk_seek(const char *ptr, size_t offset);
+
+extern size_t aesd_chunk_copy_to_iter(const char *ptr, size_t bytes, struct iov_iter *to);
+
+extern void aesd_chunk_copy(char *dst, const char *ptr, size_t bytes);
+
+#endif /* AESD_CHUNK_H */
@@ -0,0 +1,388 @@
+/**
+ * @file aesd-circular-buffer-bench.c
+ * @brief Userspace benchmark of the aesd circular buffer, reported as JSON
+ *
+ * For every capacity and entry size it times aesd_circular_buffer_add_entry on a full ring
+ * and aesd_circular_buffer_find_entry_offset_for_fpos reading the buffer front to back the
+ * way aesd_read does and at random offsets, against a linear walk from out_offs like the lookup
+ * used before the offsets index.  It then times threads sharing one ring behind a mutex, mostly
+ * looking up with an add every AESD_BENCH_ADD_EVERY operations, like readers and a writer of
+ * the device.  Single threaded results include the slot array's size and, where perf events are
+ * allowed, last level cache misses per operation.
+ *
+ * Build with make bench or the aesd-circular-buffer-bench CMake target.
+ * usage: aesd-circular-buffer-bench [-m milliseconds per measurement] [-t max threads]
+ *
+ * @author Chris Choi
+ * @date 2021-10-19
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "aesd-circular-buffer.h"
+
+#define AESD_BENCH_ADD_EVERY 8
+#define AESD_BENCH_LINEAR_MAX 10000
+
+static const uint32_t capacities[] = { 10, 100, 1000, 10000, 100000 };
+static const size_t entry_sizes[] = { 16, 256, 4096 };
+
+static uint64_t min_ns = 50000000ull;
+static unsigned int max_threads = 8;
+static bool first_result = true;
+static int cache_miss_fd = -1;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * Opens a last level cache miss counter for this thread, left at -1 where perf events are not allowed
+ */
+static void cache_miss_open(void)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.config = PERF_COUNT_HW_CACHE_MISSES;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	cache_miss_fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void cache_miss_start(void)
+{
+	if(cache_miss_fd < 0)
+		return;
+	ioctl(cache_miss_fd, PERF_EVENT_IOC_RESET, 0);
+	ioctl(cache_miss_fd, PERF_EVENT_IOC_ENABLE, 0);
+}
+
+/**
+ * @return misses since cache_miss_start, or -1 without a counter
+ */
+static int64_t cache_miss_stop(void)
+{
+	uint64_t misses;
+
+	if(cache_miss_fd < 0)
+		return -1;
+	ioctl(cache_miss_fd, PERF_EVENT_IOC_DISABLE, 0);
+	if(read(cache_miss_fd, &misses, sizeof(misses)) != sizeof(misses))
+		return -1;
+	return misses;
+}
+
+struct measurement
+{
+	uint64_t ns;
+	uint64_t ops;
+	int64_t cache_misses;
+};
+
+static void report(const char *op, const struct aesd_circular_buffer *buffer, size_t entry_size,
+			unsigned int threads, const struct measurement *m)
+{
+	printf("%s\n    {\"op\": \"%s\", \"capacity\": %u, \"entry_size\": %zu, \"threads\": %u, "
+			"\"ns_per_op\": %.2f, \"working_set_bytes\": %zu, \"cache_misses_per_op\": ",
+			first_result ? "" : ",", op, buffer->capacity, entry_size, threads,
+			(double)m->ns / m->ops, (size_t)(buffer->slot_mask + 1) * sizeof(struct aesd_buffer_entry));
+	if(m->cache_misses < 0)
+		printf("null}");
+	else
+		printf("%.4f}", (double)m->cache_misses / m->ops);
+	first_result = false;
+}
+
+/**
+ * The lookup before cumulative offsets were kept, summing sizes from the oldest entry
+ */
+static struct aesd_buffer_entry *linear_find(struct aesd_circular_buffer *buffer,
+			size_t char_offset, size_t *entry_offset_byte_rtn)
+{
+	uint32_t index;
+	uint32_t slot;
+
+	for(index = 0; index < buffer->count; index++)
+	{
+		slot = (buffer->out_offs + index) & buffer->slot_mask;
+		if(char_offset < buffer->entry[slot].size)
+		{
+			*entry_offset_byte_rtn = char_offset;
+			return &buffer->entry[slot];
+		}
+		char_offset -= buffer->entry[slot].size;
+	}
+	return NULL;
+}
+
+typedef struct aesd_buffer_entry *(*find_fn)(struct aesd_circular_buffer *, size_t, size_t *);
+
+/**
+ * Adds entries to a full ring, so each add also evicts
+ */
+static void bench_add(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *entry,
+			struct measurement *m)
+{
+	uint64_t start = now_ns();
+	uint32_t index;
+
+	m->ops = 0;
+	cache_miss_start();
+	do
+	{
+		for(index = 0; index < 1024; index++)
+			aesd_circular_buffer_add_entry(buffer, entry);
+		m->ops += 1024;
+	} while(now_ns() - start < min_ns);
+	m->cache_misses = cache_miss_stop();
+	m->ns = now_ns() - start;
+}
+
+/**
+ * Reads the buffer front to back, one lookup per entry, repeated for at least min_ns or once when
+ * a single pass takes longer
+ */
+static void bench_sequential(struct aesd_circular_buffer *buffer, find_fn find, struct measurement *m)
+{
+	struct aesd_buffer_entry *entry;
+	uint64_t start = now_ns();
+	size_t offset;
+	size_t entry_offset;
+
+	m->ops = 0;
+	cache_miss_start();
+	do
+	{
+		offset = 0;
+		while((entry = find(buffer, offset, &entry_offset)) != NULL)
+		{
+			offset += entry->size - entry_offset;
+			m->ops++;
+		}
+	} while(now_ns() - start < min_ns);
+	m->cache_misses = cache_miss_stop();
+	m->ns = now_ns() - start;
+}
+
+static void bench_random(struct aesd_circular_buffer *buffer, find_fn find, struct measurement *m)
+{
+	volatile size_t sink = 0;
+	uint64_t start = now_ns();
+	uint32_t seed = 1;
+	uint32_t index;
+	size_t entry_offset;
+
+	m->ops = 0;
+	cache_miss_start();
+	do
+	{
+		for(index = 0; index < 256; index++)
+		{
+			seed = seed * 1103515245u + 12345u;
+			if(find(buffer, seed % buffer->total_size, &entry_offset) != NULL)
+				sink += entry_offset;
+		}
+		m->ops += 256;
+	} while(now_ns() - start < min_ns);
+	m->cache_misses = cache_miss_stop();
+	m->ns = now_ns() - start;
+	(void)sink;
+}
+
+struct shared_ring
+{
+	pthread_mutex_t lock;
+	pthread_barrier_t barrier;
+	struct aesd_circular_buffer *buffer;
+	const struct aesd_buffer_entry *entry;
+	volatile bool stop;
+};
+
+struct worker
+{
+	pthread_t thread;
+	struct shared_ring *ring;
+	uint32_t seed;
+	uint64_t ops;
+};
+
+static void *bench_worker(void *arg)
+{
+	struct worker *worker = arg;
+	struct shared_ring *ring = worker->ring;
+	volatile size_t sink = 0;
+	size_t entry_offset;
+	uint64_t ops = 0;
+
+	pthread_barrier_wait(&ring->barrier);
+	while(!ring->stop)
+	{
+		worker->seed = worker->seed * 1103515245u + 12345u;
+		pthread_mutex_lock(&ring->lock);
+		if(ops % AESD_BENCH_ADD_EVERY == 0)
+			aesd_circular_buffer_add_entry(ring->buffer, ring->entry);
+		else if(aesd_circular_buffer_find_entry_offset_for_fpos(ring->buffer,
+				worker->seed % ring->buffer->total_size, &entry_offset) != NULL)
+			sink += entry_offset;
+		pthread_mutex_unlock(&ring->lock);
+		ops++;
+	}
+	worker->ops = ops;
+	(void)sink;
+	return NULL;
+}
+
+/**
+ * @return 0, or -1 if the threads could not be started
+ */
+static int bench_threads(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *entry,
+			unsigned int threads, struct measurement *m)
+{
+	struct shared_ring ring;
+	struct worker *workers;
+	uint64_t start;
+	unsigned int index;
+
+	workers = calloc(threads, sizeof(*workers));
+	if(workers == NULL)
+		return -1;
+	memset(&ring, 0, sizeof(ring));
+	ring.buffer = buffer;
+	ring.entry = entry;
+	pthread_mutex_init(&ring.lock, NULL);
+	pthread_barrier_init(&ring.barrier, NULL, threads + 1);
+
+	for(index = 0; index < threads; index++)
+	{
+		workers[index].ring = &ring;
+		workers[index].seed = index + 1;
+		if(pthread_create(&workers[index].thread, NULL, bench_worker, &workers[index]) != 0)
+		{
+			fprintf(stderr, "pthread_create failed\n");
+			exit(1);
+		}
+	}
+
+	pthread_barrier_wait(&ring.barrier);
+	start = now_ns();
+	while(now_ns() - start < min_ns)
+		usleep(1000);
+	ring.stop = true;
+
+	m->ops = 0;
+	for(index = 0; index < threads; index++)
+	{
+		pthread_join(workers[index].thread, NULL);
+		m->ops += workers[index].ops;
+	}
+	m->ns = now_ns() - start;
+	m->cache_misses = -1;
+
+	pthread_barrier_destroy(&ring.barrier);
+	pthread_mutex_destroy(&ring.lock);
+	free(workers);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct aesd_circular_buffer buffer;
+	struct aesd_buffer_entry entry;
+	struct measurement m;
+	char *data;
+	unsigned int threads;
+	uint32_t capacity_index;
+	uint32_t size_index;
+	uint32_t added;
+	int opt;
+
+	while((opt = getopt(argc, argv, "m:t:")) != -1)
+	{
+		switch(opt)
+		{
+		case 'm':
+			min_ns = strtoull(optarg, NULL, 0) * 1000000ull;
+			break;
+		case 't':
+			max_threads = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-m milliseconds per measurement] [-t max threads]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	data = malloc(entry_sizes[sizeof(entry_sizes) / sizeof(entry_sizes[0]) - 1]);
+	if(data == NULL)
+		return 1;
+	cache_miss_open();
+
+	printf("{\n  \"benchmark\": \"aesd-circular-buffer\",\n  \"results\": [");
+	for(capacity_index = 0; capacity_index < sizeof(capacities) / sizeof(capacities[0]); capacity_index++)
+	{
+		for(size_index = 0; size_index < sizeof(entry_sizes) / sizeof(entry_sizes[0]); size_index++)
+		{
+			if(aesd_circular_buffer_init_capacity(&buffer, capacities[capacity_index]) != 0)
+				return 1;
+
+			memset(data, 'a', entry_sizes[size_index]);
+			data[entry_sizes[size_index] - 1] = '\n';
+			entry.buffptr = data;
+			entry.size = entry_sizes[size_index];
+
+			//wrap the ring once so out_offs is not 0
+			for(added = 0; added < capacities[capacity_index] + capacities[capacity_index] / 2; added++)
+				aesd_circular_buffer_add_entry(&buffer, &entry);
+
+			bench_add(&buffer, &entry, &m);
+			report("add_entry", &buffer, entry.size, 1, &m);
+			bench_sequential(&buffer, aesd_circular_buffer_find_entry_offset_for_fpos, &m);
+			report("sequential_find", &buffer, entry.size, 1, &m);
+			bench_random(&buffer, aesd_circular_buffer_find_entry_offset_for_fpos, &m);
+			report("random_find", &buffer, entry.size, 1, &m);
+
+			//a full read with the linear walk is quadratic, leave out the big rings
+			if(capacities[capacity_index] <= AESD_BENCH_LINEAR_MAX)
+			{
+				bench_sequential(&buffer, linear_find, &m);
+				report("linear_sequential_find", &buffer, entry.size, 1, &m);
+				bench_random(&buffer, linear_find, &m);
+				report("linear_random_find", &buffer, entry.size, 1, &m);
+			}
+
+			for(threads = 1; threads <= max_threads; threads *= 2)
+			{
+				if(bench_threads(&buffer, &entry, threads, &m) != 0)
+					return 1;
+				report("locked_mixed", &buffer, entry.size, threads, &m);
+			}
+
+			aesd_circular_buffer_cleanup(&buffer);
+		}
+	}
+	printf("\n  ]\n}\n");
+
+	if(cache_miss_fd >= 0)
+		close(cache_miss_fd);
+	free(data);
+	return 0;
+}
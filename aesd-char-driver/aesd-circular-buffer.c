@@ -11,9 +11,13 @@
 #ifdef __KERNEL__
 #include <linux/string.h>
 #include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/errno.h>
 #else
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
 #endif
 
 #include "aesd-circular-buffer.h"
@@ -31,35 +35,111 @@
 struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
 			size_t char_offset, size_t *entry_offset_byte_rtn )
 {
-
     if(buffer == NULL) //check null
        return NULL;
-    
-
-    size_t buffer_size = (buffer->entry[buffer->out_offs]).size;
-    size_t last_entry = 0;
 
-    int count  = buffer->out_offs;
+    return aesd_circular_buffer_find_entry_hint(buffer, char_offset, entry_offset_byte_rtn, &buffer->hint);
+}
 
-    while(char_offset > (buffer_size - 1))
-    { 
-        last_entry     = buffer_size; 
-        count = (count + 1) % (AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED);   
+/**
+* Same as aesd_circular_buffer_find_entry_offset_for_fpos, with the cursor hint kept by the caller.
+* Only reads @param buffer, so it may race with a writer as long as the caller discards the result
+* of a racing lookup; every slot it touches is masked and every loop is bounded.
+* @param hint slot of the caller's previous lookup, updated on success; NULL to always binary search
+*/
+struct aesd_buffer_entry *aesd_circular_buffer_find_entry_hint(struct aesd_circular_buffer *buffer,
+			size_t char_offset, size_t *entry_offset_byte_rtn, uint32_t *hint)
+{
+    struct aesd_buffer_entry *entry;
+    size_t base;
+    size_t position;
+    uint32_t index;
+    uint32_t low;
+    uint32_t high;
+    uint32_t middle;
+    uint32_t slot;
+
+    if(char_offset >= buffer->total_size)
+       return NULL;
 
-        if(count == buffer->out_offs)
-            return NULL;
+    //stream position of the oldest entry, offsets are compared relative to it so they may wrap
+    base = buffer->end_offset - buffer->total_size;
+    position = base + char_offset;
 
-        buffer_size  += (buffer->entry[count]).size;
-    }
-    
-    if(char_offset <= (buffer_size - 1))
+    //sequential readers land in the same entry as last time or the one after it
+    index = hint != NULL ? (*hint - buffer->out_offs) & buffer->slot_mask : 0;
+    for(high = index + 2; hint != NULL && index < buffer->count && index < high; index++)
     {
-        *entry_offset_byte_rtn = char_offset - last_entry;
+        entry = &buffer->entry[(buffer->out_offs + index) & buffer->slot_mask];
+        if(position - entry->offset < entry->size)
+        {
+            *hint = (buffer->out_offs + index) & buffer->slot_mask;
+            *entry_offset_byte_rtn = position - entry->offset;
+            return entry;
+        }
+    }
 
-        return &buffer->entry[count];
+    //otherwise binary search for the last entry starting at or before char_offset
+    low = 0;
+    high = buffer->count;
+    while(high - low > 1)
+    {
+        middle = low + (high - low) / 2;
+        slot = (buffer->out_offs + middle) & buffer->slot_mask;
+        if(buffer->entry[slot].offset - base <= char_offset)
+            low = middle;
+        else
+            high = middle;
     }
 
-    return NULL;
+    slot = (buffer->out_offs + low) & buffer->slot_mask;
+    if(hint != NULL)
+        *hint = slot;
+    *entry_offset_byte_rtn = position - buffer->entry[slot].offset;
+    return &buffer->entry[slot];
+}
+
+/**
+* Finds where byte @param entry_offset of the entry @param entry_index places after the oldest one sits
+* in the concatenated contents of @param buffer, in constant time.  Any necessary locking must be
+* performed by the caller.
+* @param char_offset_rtn set to that position on success
+* @return 0, or -EINVAL if that entry or byte is not stored
+*/
+int aesd_circular_buffer_fpos_for_entry(struct aesd_circular_buffer *buffer, uint32_t entry_index,
+			size_t entry_offset, size_t *char_offset_rtn)
+{
+    struct aesd_buffer_entry *entry;
+
+    if(buffer == NULL || entry_index >= buffer->count)
+        return -EINVAL;
+
+    entry = &buffer->entry[(buffer->out_offs + entry_index) & buffer->slot_mask];
+    if(entry_offset >= entry->size)
+        return -EINVAL;
+
+    *char_offset_rtn = entry->offset - (buffer->end_offset - buffer->total_size) + entry_offset;
+    return 0;
+}
+
+/**
+* Removes the oldest entry of @param buffer, for callers that evict by something other than count.
+* Any necessary locking must be handled by the caller
+* @return the removed entry, valid until its slot is reused, or NULL if @param buffer is empty
+*/
+struct aesd_buffer_entry *aesd_circular_buffer_remove_oldest(struct aesd_circular_buffer *buffer)
+{
+    struct aesd_buffer_entry *entry;
+
+    if(buffer == NULL || buffer->count == 0)
+        return NULL;
+
+    entry = &buffer->entry[buffer->out_offs];
+    buffer->total_size -= entry->size;
+    buffer->out_offs = (buffer->out_offs + 1) & buffer->slot_mask;
+    buffer->count--;
+    buffer->full = false;
+    return entry;
 }
 
 /**
@@ -74,40 +154,79 @@ void aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const s
     if(buffer == NULL || add_entry->buffptr == NULL || add_entry->size == 0) 
        return; 
 
+    if(buffer->count == buffer->capacity)    //check if full
+         aesd_circular_buffer_remove_oldest(buffer);
+
     buffer->entry[buffer->in_offs]  = *add_entry;  
-    buffer->in_offs = (buffer->in_offs + 1) % (AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED);
-        
-    if(buffer->full)    //check if full
-         buffer->out_offs = (buffer->out_offs + 1) % (AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED);
+    buffer->entry[buffer->in_offs].offset = buffer->end_offset;
+    buffer->end_offset += add_entry->size;
+    buffer->total_size += add_entry->size;
+    buffer->in_offs = (buffer->in_offs + 1) & buffer->slot_mask;
+    buffer->count++;
 
-    if(buffer->in_offs == buffer->out_offs)
-        buffer->full     = true;
+    buffer->full = (buffer->count == buffer->capacity);
 }
 
 /**
-* Initializes the circular buffer described by @param buffer to an empty struct
+* Initializes the circular buffer described by @param buffer to an empty struct holding
+* AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED entries
 */
 void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer)
 {
     memset(buffer,0,sizeof(struct aesd_circular_buffer));
+    buffer->entry = buffer->embedded_entry;
+    buffer->slot_mask = AESDCHAR_EMBEDDED_ENTRIES - 1;
+    buffer->capacity = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
 }
 
-
-void aesd_circular_buffer_cleanup(struct aesd_circular_buffer *buffer)
+/**
+* Initializes @param buffer to hold @param capacity entries.  The slot array is rounded up to a
+* power of two and allocated unless it fits in the embedded one.
+* @return 0, -EINVAL for a capacity of 0 or above AESDCHAR_MAX_CAPACITY, or -ENOMEM
+*/
+int aesd_circular_buffer_init_capacity(struct aesd_circular_buffer *buffer, uint32_t capacity)
 {
-	uint8_t index;
-	struct aesd_buffer_entry *entry;
+    uint32_t slots = AESDCHAR_EMBEDDED_ENTRIES;
 
-	AESD_CIRCULAR_BUFFER_FOREACH(entry,buffer,index) 
-	{
-		if (entry->buffptr == NULL) continue;
-		
+    if(capacity == 0 || capacity > AESDCHAR_MAX_CAPACITY)
+        return -EINVAL;
+
+    aesd_circular_buffer_init(buffer);
+    buffer->capacity = capacity;
+    if(capacity <= AESDCHAR_EMBEDDED_ENTRIES)
+        return 0;
+
+    while(slots < capacity)
+        slots <<= 1;
 
 #ifdef __KERNEL__
-		kfree(entry->buffptr);
+    buffer->entry = kvcalloc(slots, sizeof(struct aesd_buffer_entry), GFP_KERNEL);
 #else
-		//free(entry->buffptr);	
+    buffer->entry = calloc(slots, sizeof(struct aesd_buffer_entry));
 #endif
+    if(buffer->entry == NULL)
+    {
+        buffer->entry = buffer->embedded_entry;
+        return -ENOMEM;
+    }
+    buffer->slot_mask = slots - 1;
+    return 0;
+}
+
 
+/**
+ * Frees the slots allocated by aesd_circular_buffer_init_capacity.  The buffer never owns what
+ * its entries point to, the caller releases that first.
+ */
+void aesd_circular_buffer_cleanup(struct aesd_circular_buffer *buffer)
+{
+	if(buffer->entry != buffer->embedded_entry)
+	{
+#ifdef __KERNEL__
+		kvfree(buffer->entry);
+#else
+		free(buffer->entry);
+#endif
+		buffer->entry = buffer->embedded_entry;
 	}
 }
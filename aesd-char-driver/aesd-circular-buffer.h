@@ -17,6 +17,14 @@
 #endif
 
 #define AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED 10
+/**
+ * Slots embedded in the buffer, the smallest power of two that holds the default capacity
+ */
+#define AESDCHAR_EMBEDDED_ENTRIES 16
+/**
+ * Largest capacity aesd_circular_buffer_init_capacity accepts
+ */
+#define AESDCHAR_MAX_CAPACITY (1u << 20)
 
 struct aesd_buffer_entry
 {
@@ -28,23 +36,55 @@ struct aesd_buffer_entry
 	 * Number of bytes stored in buffptr
 	 */
 	size_t size;
+	/**
+	 * Position of buffptr[0] in the stream of every byte added to the buffer,
+	 * set by aesd_circular_buffer_add_entry.  Free running, compare differences only.
+	 */
+	size_t offset;
 };
 
 struct aesd_circular_buffer
 {
 	/**
-	 * An array of pointers to memory allocated for the most recent write operations
+	 * An array of pointers to memory allocated for the most recent write operations,
+	 * slot_mask + 1 entries.  Points at embedded_entry unless a larger ring was allocated.
 	 */
-	struct aesd_buffer_entry  entry[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+	struct aesd_buffer_entry *entry;
+	struct aesd_buffer_entry embedded_entry[AESDCHAR_EMBEDDED_ENTRIES];
 	/**
 	 * The current location in the entry structure where the next write should
 	 * be stored.
 	 */
-	uint8_t in_offs;
+	uint32_t in_offs;
 	/**
 	 * The first location in the entry structure to read from
 	 */
-	uint8_t out_offs;
+	uint32_t out_offs;
+	/**
+	 * Number of slots minus one; the slot count is a power of two so offsets wrap with a mask
+	 */
+	uint32_t slot_mask;
+	/**
+	 * Most entries kept before the oldest is overwritten, at most slot_mask + 1
+	 */
+	uint32_t capacity;
+	/**
+	 * Number of entries currently stored
+	 */
+	uint32_t count;
+	/**
+	 * Slot returned by the last aesd_circular_buffer_find_entry_offset_for_fpos, tried first
+	 * since readers usually move forward
+	 */
+	uint32_t hint;
+	/**
+	 * Total bytes in the stored entries
+	 */
+	size_t total_size;
+	/**
+	 * Stream position just past the newest entry, the offset the next entry gets
+	 */
+	size_t end_offset;
 	/**
 	 * set to true when the buffer entry structure is full
 	 */
@@ -54,10 +94,20 @@ struct aesd_circular_buffer
 extern struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
 			size_t char_offset, size_t *entry_offset_byte_rtn );
 
+extern struct aesd_buffer_entry *aesd_circular_buffer_find_entry_hint(struct aesd_circular_buffer *buffer,
+			size_t char_offset, size_t *entry_offset_byte_rtn, uint32_t *hint);
+
+extern int aesd_circular_buffer_fpos_for_entry(struct aesd_circular_buffer *buffer, uint32_t entry_index,
+			size_t entry_offset, size_t *char_offset_rtn);
+
+extern struct aesd_buffer_entry *aesd_circular_buffer_remove_oldest(struct aesd_circular_buffer *buffer);
+
 extern void aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry);
 
 extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
 
+extern int aesd_circular_buffer_init_capacity(struct aesd_circular_buffer *buffer, uint32_t capacity);
+
 extern void aesd_circular_buffer_cleanup(struct aesd_circular_buffer *buffer);
 
 /**
@@ -65,9 +115,9 @@ extern void aesd_circular_buffer_cleanup(struct aesd_circular_buffer *buffer);
  * Useful when you've allocated memory for circular buffer entries and need to free it
  * @param entryptr is a struct aesd_buffer_entry* to set with the current entry
  * @param buffer is the struct aesd_buffer * describing the buffer
- * @param index is a uint8_t stack allocated value used by this macro for an index
+ * @param index is a uint32_t stack allocated value used by this macro for an index
  * Example usage:
- * uint8_t index;
+ * uint32_t index;
  * struct aesd_circular_buffer buffer;
  * struct aesd_buffer_entry *entry;
  * AESD_CIRCULAR_BUFFER_FOREACH(entry,&buffer,index) {
@@ -76,7 +126,7 @@ extern void aesd_circular_buffer_cleanup(struct aesd_circular_buffer *buffer);
  */
 #define AESD_CIRCULAR_BUFFER_FOREACH(entryptr,buffer,index) \
 	for(index=0, entryptr=&((buffer)->entry[index]); \
-			index<AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; \
+			index<=(buffer)->slot_mask; \
 			index++, entryptr=&((buffer)->entry[index]))
 
 
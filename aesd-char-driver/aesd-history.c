@@ -0,0 +1,181 @@
+/**
+ * @file aesd-history.c
+ * @brief Page backed write history of an aesd char device, mappable read only
+ *
+ * With a history the device's circular buffer entries point into these pages instead of
+ * the chunk log, so the ring and the mapping are the same bytes.  See aesd-history.h
+ * for the layout and the reader protocol.
+ *
+ * @author Chris Choi
+ * @date 2021-10-19
+ *
+ */
+
+#include <linux/compiler.h>
+#include <linux/errno.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/version.h>
+#include <linux/vmalloc.h>
+#include <asm/barrier.h>
+
+#include "aesd-history.h"
+
+/**
+ * Allocates @param history with at least @param data_pages pages of data, rounded up to a power
+ * of two, and a header with room for @param slots circular buffer slots
+ * @return 0 or -ENOMEM
+ */
+int aesd_history_init(struct aesd_history *history, unsigned int data_pages, uint32_t slots)
+{
+	struct aesd_history_header *header;
+	unsigned int header_pages;
+	unsigned int pages = 1;
+	unsigned int index;
+
+	memset(history, 0, sizeof(*history));
+
+	while(pages < data_pages)
+		pages <<= 1;
+	header_pages = DIV_ROUND_UP(sizeof(struct aesd_history_header) +
+			(size_t)slots * sizeof(struct aesd_history_entry), PAGE_SIZE);
+
+	history->page_count = header_pages + 2 * pages;
+	history->owned_pages = header_pages + pages;
+	history->pages = kvcalloc(history->page_count, sizeof(struct page *), GFP_KERNEL);
+	if(history->pages == NULL)
+		return -ENOMEM;
+
+	for(index = 0; index < history->owned_pages; index++)
+	{
+		history->pages[index] = alloc_page(GFP_KERNEL | __GFP_ZERO);
+		if(history->pages[index] == NULL)
+			goto fail;
+	}
+	//the second copy of the data makes every write contiguous, in the kernel and in userspace
+	for(index = 0; index < pages; index++)
+		history->pages[header_pages + pages + index] = history->pages[header_pages + index];
+
+	header = vmap(history->pages, history->page_count, VM_MAP, PAGE_KERNEL);
+	if(header == NULL)
+		goto fail;
+
+	history->header = header;
+	history->data = (char *)header + header_pages * PAGE_SIZE;
+	history->data_size = (size_t)pages * PAGE_SIZE;
+
+	header->magic = AESD_HISTORY_MAGIC;
+	header->version = AESD_HISTORY_VERSION;
+	header->data_offset = header_pages * PAGE_SIZE;
+	header->data_size = history->data_size;
+	header->slot_mask = slots - 1;
+	return 0;
+
+fail:
+	aesd_history_destroy(history);
+	return -ENOMEM;
+}
+
+void aesd_history_destroy(struct aesd_history *history)
+{
+	unsigned int index;
+
+	if(history->pages == NULL)
+		return;
+
+	if(history->header != NULL)
+		vunmap(history->header);
+
+	//the mirrored data pages at the end are the same pages again, even before vmap succeeded
+	for(index = 0; index < history->owned_pages; index++)
+	{
+		if(history->pages[index] != NULL)
+			__free_page(history->pages[index]);
+	}
+	kvfree(history->pages);
+	memset(history, 0, sizeof(*history));
+}
+
+/**
+ * Starts adding a write of @param size bytes to the history: evicts the oldest entries of
+ * @param buffer whose bytes it will overwrite and marks the history as changing.  The caller
+ * copies the write to the returned address, then calls aesd_history_publish.  Any necessary
+ * locking must be performed by the caller.
+ * @return where the write goes, or NULL if it is larger than the whole history
+ */
+char *aesd_history_reserve(struct aesd_history *history, struct aesd_circular_buffer *buffer, size_t size)
+{
+	struct aesd_history_header *header = history->header;
+
+	if(size > history->data_size)
+		return NULL;
+
+	WRITE_ONCE(header->sequence, header->sequence + 1);
+	smp_wmb();
+
+	while(buffer->total_size + size > history->data_size)
+		aesd_circular_buffer_remove_oldest(buffer);
+
+	return history->data + (buffer->end_offset & (history->data_size - 1));
+}
+
+/**
+ * Adds the write copied to the address aesd_history_reserve returned to @param buffer and
+ * publishes the new state in the header
+ */
+void aesd_history_publish(struct aesd_history *history, struct aesd_circular_buffer *buffer, size_t size)
+{
+	struct aesd_history_header *header = history->header;
+	struct aesd_buffer_entry entry;
+	uint32_t slot;
+
+	entry.buffptr = history->data + (buffer->end_offset & (history->data_size - 1));
+	entry.size = size;
+
+	slot = buffer->in_offs;
+	aesd_circular_buffer_add_entry(buffer, &entry);
+
+	header->entry[slot].offset = buffer->entry[slot].offset;
+	header->entry[slot].size = size;
+	header->start = buffer->end_offset - buffer->total_size;
+	header->end = buffer->end_offset;
+	header->out_offs = buffer->out_offs;
+	header->count = buffer->count;
+
+	smp_wmb();
+	WRITE_ONCE(header->sequence, header->sequence + 1);
+}
+
+/**
+ * Maps the history read only into @param vma, which must start at offset 0 and may cover
+ * any prefix of it
+ * @return 0, -ENODEV without a history, -EINVAL for a bad range or -EPERM for a writable mapping
+ */
+int aesd_history_mmap(struct aesd_history *history, struct vm_area_struct *vma)
+{
+	unsigned long pages = vma_pages(vma);
+	unsigned long index;
+	int retval;
+
+	if(history->pages == NULL)
+		return -ENODEV;
+	if(vma->vm_pgoff != 0 || pages > history->page_count)
+		return -EINVAL;
+	if(vma->vm_flags & VM_WRITE)
+		return -EPERM;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+	vm_flags_clear(vma, VM_MAYWRITE);
+#else
+	vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+
+	for(index = 0; index < pages; index++)
+	{
+		retval = vm_insert_page(vma, vma->vm_start + index * PAGE_SIZE, history->pages[index]);
+		if(retval)
+			return retval;
+	}
+	return 0;
+}
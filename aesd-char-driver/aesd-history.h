@@ -0,0 +1,110 @@
+/*
+ * aesd-history.h
+ *
+ * Page backed write history of an aesd char device, which readers can mmap read only.
+ * The mapping starts with a header (struct aesd_history_header) followed by the data
+ * ring, whose pages are mapped twice back to back so a write that wraps around the end
+ * of the ring is still contiguous.  Byte p of the stream of writes is at
+ * data_offset + (p & (data_size - 1)) for start <= p < end.
+ *
+ * The writer makes sequence odd before it evicts or copies anything and even again once
+ * the header describes the new state.  A reader copies what it needs between two reads
+ * of an even, unchanged sequence, and retries otherwise.
+ *
+ *  Created on: October 19, 2021
+ *      Author: Chris Choi
+ */
+
+#ifndef AESD_HISTORY_H
+#define AESD_HISTORY_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#else
+#include <stdint.h>
+#endif
+
+#define AESD_HISTORY_MAGIC 0x61657368
+#define AESD_HISTORY_VERSION 1
+
+struct aesd_history_entry
+{
+	/**
+	 * Stream position of the write's first byte
+	 */
+	uint64_t offset;
+	uint64_t size;
+};
+
+struct aesd_history_header
+{
+	uint32_t magic;
+	uint32_t version;
+	/**
+	 * Bytes from the start of the mapping to the data ring, a multiple of the page size
+	 */
+	uint32_t data_offset;
+	/**
+	 * Size of the data ring in bytes, a power of two
+	 */
+	uint32_t data_size;
+	/**
+	 * Incremented before and after every update, odd while one is in progress
+	 */
+	uint64_t sequence;
+	/**
+	 * Stream positions of the oldest stored byte and just past the newest one
+	 */
+	uint64_t start;
+	uint64_t end;
+	/**
+	 * The device's circular buffer: entry[] has slot_mask + 1 slots and the stored writes
+	 * are the count slots from out_offs on, wrapping with slot_mask
+	 */
+	uint32_t slot_mask;
+	uint32_t out_offs;
+	uint32_t count;
+	uint32_t reserved;
+	struct aesd_history_entry entry[];
+};
+
+#ifdef __KERNEL__
+
+#include "aesd-circular-buffer.h"
+
+struct vm_area_struct;
+
+struct aesd_history
+{
+	/**
+	 * Header pages, then the data pages, then the data pages again; NULL when disabled
+	 */
+	struct page **pages;
+	unsigned int page_count;
+	/**
+	 * The first pages, header and data, which the history allocated and frees
+	 */
+	unsigned int owned_pages;
+	/**
+	 * Kernel mapping of pages, laid out like the userspace one
+	 */
+	struct aesd_history_header *header;
+	char *data;
+	size_t data_size;
+};
+
+extern int aesd_history_init(struct aesd_history *history, unsigned int data_pages, uint32_t slots);
+
+extern void aesd_history_destroy(struct aesd_history *history);
+
+extern char *aesd_history_reserve(struct aesd_history *history, struct aesd_circular_buffer *buffer,
+			size_t size);
+
+extern void aesd_history_publish(struct aesd_history *history, struct aesd_circular_buffer *buffer,
+			size_t size);
+
+extern int aesd_history_mmap(struct aesd_history *history, struct vm_area_struct *vma);
+
+#endif /* __KERNEL__ */
+
+#endif /* AESD_HISTORY_H */
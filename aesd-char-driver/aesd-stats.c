@@ -0,0 +1,89 @@
+/**
+ * @file aesd-stats.c
+ * @brief Per CPU counters and latency histograms of an aesd char device
+ *
+ * @author Chris Choi
+ * @date 2021-10-19
+ *
+ */
+
+#include <linux/errno.h>
+#include <linux/percpu.h>
+#include <linux/seq_file.h>
+#include <linux/string.h>
+
+#include "aesd-stats.h"
+
+/**
+ * @return 0 or -ENOMEM
+ */
+int aesd_stats_init(struct aesd_stats *stats)
+{
+	stats->cpu = alloc_percpu(struct aesd_stats_cpu);
+	return stats->cpu == NULL ? -ENOMEM : 0;
+}
+
+void aesd_stats_destroy(struct aesd_stats *stats)
+{
+	free_percpu(stats->cpu);
+	stats->cpu = NULL;
+}
+
+static void aesd_stats_show_histogram(struct seq_file *m, const char *name, const u64 *histogram)
+{
+	unsigned int bucket;
+
+	seq_printf(m, "%s:\n", name);
+	for(bucket = 0; bucket < AESD_STATS_BUCKETS; bucket++)
+	{
+		if(histogram[bucket] == 0)
+			continue;
+		if(bucket == AESD_STATS_BUCKETS - 1)
+			seq_printf(m, "  >= %llu ns: %llu\n", 1ull << bucket, histogram[bucket]);
+		else
+			seq_printf(m, "  %llu - %llu ns: %llu\n", bucket ? 1ull << bucket : 0,
+					(1ull << (bucket + 1)) - 1, histogram[bucket]);
+	}
+}
+
+/**
+ * Writes the sum of every CPU's counters to @param m.  Counters updated meanwhile may be
+ * off by the updates in flight.
+ */
+void aesd_stats_show(struct seq_file *m, struct aesd_stats *stats)
+{
+	struct aesd_stats_cpu total;
+	struct aesd_stats_cpu *cpu_stats;
+	unsigned int bucket;
+	int cpu;
+
+	memset(&total, 0, sizeof(total));
+	for_each_possible_cpu(cpu)
+	{
+		cpu_stats = per_cpu_ptr(stats->cpu, cpu);
+		total.bytes_written += READ_ONCE(cpu_stats->bytes_written);
+		total.bytes_staged += READ_ONCE(cpu_stats->bytes_staged);
+		total.entries_written += READ_ONCE(cpu_stats->entries_written);
+		total.entries_evicted += READ_ONCE(cpu_stats->entries_evicted);
+		total.reads += READ_ONCE(cpu_stats->reads);
+		total.bytes_read += READ_ONCE(cpu_stats->bytes_read);
+		total.lock_wait_ns += READ_ONCE(cpu_stats->lock_wait_ns);
+		total.lock_acquisitions += READ_ONCE(cpu_stats->lock_acquisitions);
+		for(bucket = 0; bucket < AESD_STATS_BUCKETS; bucket++)
+		{
+			total.read_latency[bucket] += READ_ONCE(cpu_stats->read_latency[bucket]);
+			total.write_latency[bucket] += READ_ONCE(cpu_stats->write_latency[bucket]);
+		}
+	}
+
+	seq_printf(m, "bytes_written: %llu\n", total.bytes_written);
+	seq_printf(m, "pending_bytes: %lld\n", total.bytes_staged);
+	seq_printf(m, "entries_written: %llu\n", total.entries_written);
+	seq_printf(m, "entries_evicted: %llu\n", total.entries_evicted);
+	seq_printf(m, "reads: %llu\n", total.reads);
+	seq_printf(m, "bytes_read: %llu\n", total.bytes_read);
+	seq_printf(m, "lock_wait_ns: %llu\n", total.lock_wait_ns);
+	seq_printf(m, "lock_acquisitions: %llu\n", total.lock_acquisitions);
+	aesd_stats_show_histogram(m, "read_latency", total.read_latency);
+	aesd_stats_show_histogram(m, "write_latency", total.write_latency);
+}
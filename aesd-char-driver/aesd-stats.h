@@ -0,0 +1,70 @@
+/*
+ * aesd-stats.h
+ *
+ * Per device counters and latency histograms of an aesd char device, shown in
+ * debugfs as aesdchar/aesdchar<minor>/stats.  Every CPU updates its own copy, so
+ * counting adds no shared cache lines to the read and write paths; the copies
+ * are only summed when the file is read.
+ *
+ *  Created on: October 19, 2021
+ *      Author: Chris Choi
+ */
+
+#ifndef AESD_STATS_H
+#define AESD_STATS_H
+
+#include <linux/types.h>
+#include <linux/bitops.h>
+#include <linux/percpu.h>
+
+/**
+ * Histogram bucket b counts latencies in [2^b, 2^(b+1)) nanoseconds, the last one everything longer
+ */
+#define AESD_STATS_BUCKETS 32
+
+struct seq_file;
+
+struct aesd_stats_cpu
+{
+	u64 bytes_written;
+	/**
+	 * Bytes appended less bytes committed or dropped; one CPU's count may go negative, the sum cannot
+	 */
+	s64 bytes_staged;
+	u64 entries_written;
+	u64 entries_evicted;
+	u64 reads;
+	u64 bytes_read;
+	/**
+	 * Time spent waiting for the device lock, over lock_acquisitions acquisitions
+	 */
+	u64 lock_wait_ns;
+	u64 lock_acquisitions;
+	u64 read_latency[AESD_STATS_BUCKETS];
+	u64 write_latency[AESD_STATS_BUCKETS];
+};
+
+struct aesd_stats
+{
+	struct aesd_stats_cpu __percpu *cpu;
+};
+
+#define aesd_stats_add(stats, field, value) this_cpu_add((stats)->cpu->field, (value))
+
+static inline unsigned int aesd_stats_bucket(u64 ns)
+{
+	unsigned int bucket = ns ? fls64(ns) - 1 : 0;
+
+	return bucket < AESD_STATS_BUCKETS ? bucket : AESD_STATS_BUCKETS - 1;
+}
+
+#define aesd_stats_latency(stats, histogram, ns) \
+	this_cpu_inc((stats)->cpu->histogram[aesd_stats_bucket(ns)])
+
+extern int aesd_stats_init(struct aesd_stats *stats);
+
+extern void aesd_stats_destroy(struct aesd_stats *stats);
+
+extern void aesd_stats_show(struct seq_file *m, struct aesd_stats *stats);
+
+#endif /* AESD_STATS_H */
@@ -0,0 +1,49 @@
+/*
+ * aesd_ioctl.h
+ *
+ * Definitions for the ioctls used on the aesd char device, shared by the driver and
+ * userspace callers such as aesdsocket.
+ *
+ *  Created on: October 19, 2021
+ *      Author: Chris Choi
+ */
+
+#ifndef AESD_IOCTL_H
+#define AESD_IOCTL_H
+
+#ifdef __KERNEL__
+#include <asm-generic/ioctl.h>
+#include <linux/types.h>
+#else
+#include <sys/ioctl.h>
+#include <stdint.h>
+#endif
+
+/**
+ * Argument of the AESDCHAR_IOCSEEKTO ioctl
+ */
+struct aesd_seekto
+{
+	/**
+	 * The zero referenced write command to seek into, 0 is the oldest write still stored
+	 */
+	uint32_t write_cmd;
+	/**
+	 * The zero referenced offset within the write
+	 */
+	uint32_t write_cmd_offset;
+};
+
+#define AESD_IOC_MAGIC 0x16
+
+/**
+ * Sets the file position to write_cmd_offset bytes into the write_cmd'th write stored on the
+ * device.  Fails with EINVAL when that write or byte is not stored.
+ */
+#define AESDCHAR_IOCSEEKTO _IOWR(AESD_IOC_MAGIC, 1, struct aesd_seekto)
+/**
+ * The maximum number of commands supported, used for bounds checking
+ */
+#define AESDCHAR_IOC_MAXNR 1
+
+#endif /* AESD_IOCTL_H */
@@ -8,7 +8,7 @@
 #ifndef AESD_CHAR_DRIVER_AESDCHAR_H_
 #define AESD_CHAR_DRIVER_AESDCHAR_H_
 
-#define AESD_DEBUG 1  //Remove comment on this line to enable debug
+//#define AESD_DEBUG 1  //Remove comment on this line to enable debug
 
 #undef PDEBUG             /* undef it, just in case */
 #ifdef AESD_DEBUG
@@ -29,10 +29,48 @@ struct aesd_dev
 	 * TODO: Add structure(s) and locks needed to complete assignment requirements
 	 */
 	struct cdev 			cdev;	  
+	/**
+	 * Serializes commits into the ring; readers use seq and srcu instead
+	 */
 	struct mutex 			lock;
+	seqcount_mutex_t		seq;
+	struct srcu_struct		srcu;
+	/**
+	 * Readers waiting at the end of the data, woken when a write completes
+	 */
+	wait_queue_head_t		inq;
 	struct aesd_circular_buffer 	buff;
-	struct aesd_buffer_entry 	entry;
+	/**
+	 * Short stored writes, copied here under lock so they share chunks
+	 */
+	struct aesd_chunk_log		chunks;
+	struct aesd_history		history;
+	struct aesd_stats		stats;
+	struct dentry			*debugfs;
+
+} ____cacheline_aligned_in_smp;
 
+/**
+ * Per open file state, in filp->private_data
+ */
+struct aesd_file
+{
+	struct aesd_dev			*dev;
+	/**
+	 * Serializes writers through this file, which stage a partial command in chunks and entry
+	 * without the device lock
+	 */
+	struct mutex			lock;
+	struct aesd_chunk_log		chunks;
+	struct aesd_buffer_entry	entry;
+	/**
+	 * Set with eof, the stream position just past the newest write, and eof_pos, the file
+	 * position the read stopped at, when a blocking read found no more data; the next read
+	 * from eof_pos starts at the first write added since.  Read and written under lock.
+	 */
+	bool				at_eof;
+	size_t				eof;
+	loff_t				eof_pos;
 };
 
 #endif /* AESD_CHAR_DRIVER_AESDCHAR_H_ */
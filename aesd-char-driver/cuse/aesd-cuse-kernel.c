@@ -0,0 +1,457 @@
+/**
+ * @file aesd-cuse-kernel.c
+ * @brief Userspace implementations of the kernel interfaces in aesd-cuse-kernel.h
+ *
+ * @author Chris Choi
+ * @date 2021-10-19
+ *
+ */
+
+#define _GNU_SOURCE
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "aesd-cuse-kernel.h"
+
+/**
+ * Callbacks queued before call_srcu runs a grace period for them
+ */
+#define AESD_CUSE_SRCU_BATCH 64
+
+/* memory */
+
+//struct aesd_dev is cache line aligned, so every allocation is too
+void *kmalloc(size_t size, gfp_t flags)
+{
+	return aligned_alloc(SMP_CACHE_BYTES, DIV_ROUND_UP(size, SMP_CACHE_BYTES) * SMP_CACHE_BYTES);
+}
+
+void *kzalloc(size_t size, gfp_t flags)
+{
+	void *ptr = kmalloc(size, flags);
+
+	if(ptr != NULL)
+		memset(ptr, 0, size);
+	return ptr;
+}
+
+void *kcalloc(size_t n, size_t size, gfp_t flags)
+{
+	if(size != 0 && n > SIZE_MAX / size)
+		return NULL;
+	return kzalloc(n * size, flags);
+}
+
+void kfree(const void *ptr)
+{
+	free((void *)ptr);
+}
+
+struct kmem_cache
+{
+	unsigned int size;
+	unsigned int align;
+};
+
+struct kmem_cache *kmem_cache_create(const char *name, unsigned int size, unsigned int align,
+			unsigned long flags, void (*ctor)(void *))
+{
+	struct kmem_cache *cache = malloc(sizeof(*cache));
+
+	if(cache == NULL)
+		return NULL;
+	cache->align = align ? align : sizeof(void *);
+	cache->size = DIV_ROUND_UP(size, cache->align) * cache->align;
+	return cache;
+}
+
+void *kmem_cache_alloc(struct kmem_cache *cache, gfp_t flags)
+{
+	return aligned_alloc(cache->align, cache->size);
+}
+
+void kmem_cache_free(struct kmem_cache *cache, void *ptr)
+{
+	free(ptr);
+}
+
+void kmem_cache_destroy(struct kmem_cache *cache)
+{
+	free(cache);
+}
+
+struct page *alloc_page(gfp_t flags)
+{
+	struct page *page = malloc(sizeof(*page));
+
+	if(page == NULL)
+		return NULL;
+	//a new memfd reads as zeros, so __GFP_ZERO needs nothing more
+	page->fd = memfd_create("aesd_page", MFD_CLOEXEC);
+	if(page->fd < 0 || ftruncate(page->fd, PAGE_SIZE) != 0)
+	{
+		if(page->fd >= 0)
+			close(page->fd);
+		free(page);
+		return NULL;
+	}
+	return page;
+}
+
+void __free_page(struct page *page)
+{
+	close(page->fd);
+	free(page);
+}
+
+/**
+ * Maps @param pages contiguously, each at its own address even if it repeats.  The page before
+ * the mapping records its length for vunmap.
+ */
+void *vmap(struct page **pages, unsigned int count, unsigned long flags, int prot)
+{
+	size_t length = ((size_t)count + 1) * PAGE_SIZE;
+	char *base;
+	unsigned int index;
+
+	base = mmap(NULL, length, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(base == MAP_FAILED)
+		return NULL;
+	if(mmap(base, PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED,
+			-1, 0) == MAP_FAILED)
+		goto fail;
+	*(size_t *)base = length;
+
+	for(index = 0; index < count; index++)
+	{
+		if(mmap(base + ((size_t)index + 1) * PAGE_SIZE, PAGE_SIZE, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_FIXED, pages[index]->fd, 0) == MAP_FAILED)
+			goto fail;
+	}
+	return base + PAGE_SIZE;
+
+fail:
+	munmap(base, length);
+	return NULL;
+}
+
+void vunmap(const void *addr)
+{
+	char *base = (char *)addr - PAGE_SIZE;
+
+	munmap(base, *(size_t *)base);
+}
+
+u64 ktime_get_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* srcu */
+
+int init_srcu_struct(struct srcu_struct *srcu)
+{
+	memset(srcu, 0, sizeof(*srcu));
+	return -pthread_mutex_init(&srcu->lock, NULL);
+}
+
+void cleanup_srcu_struct(struct srcu_struct *srcu)
+{
+	srcu_barrier(srcu);
+	pthread_mutex_destroy(&srcu->lock);
+}
+
+int srcu_read_lock(struct srcu_struct *srcu)
+{
+	int idx = __atomic_load_n(&srcu->idx, __ATOMIC_RELAXED) & 1;
+
+	__atomic_fetch_add(&srcu->readers[idx], 1, __ATOMIC_RELAXED);
+	//pairs with the barrier in aesd_cuse_srcu_flip: either the grace period sees this reader
+	//or this reader sees everything removed before it
+	smp_mb();
+	return idx;
+}
+
+void srcu_read_unlock(struct srcu_struct *srcu, int idx)
+{
+	__atomic_fetch_sub(&srcu->readers[idx], 1, __ATOMIC_RELEASE);
+}
+
+static void aesd_cuse_srcu_flip(struct srcu_struct *srcu)
+{
+	unsigned long idx = srcu->idx;
+
+	smp_mb();
+	__atomic_store_n(&srcu->idx, idx + 1, __ATOMIC_RELAXED);
+	smp_mb();
+	while(__atomic_load_n(&srcu->readers[idx & 1], __ATOMIC_ACQUIRE) != 0)
+		sched_yield();
+}
+
+/**
+ * Must be called with srcu->lock held
+ */
+static void aesd_cuse_srcu_grace_period(struct srcu_struct *srcu)
+{
+	//a reader that sampled idx just before the first flip counts itself in the new counter
+	aesd_cuse_srcu_flip(srcu);
+	aesd_cuse_srcu_flip(srcu);
+}
+
+void synchronize_srcu(struct srcu_struct *srcu)
+{
+	pthread_mutex_lock(&srcu->lock);
+	aesd_cuse_srcu_grace_period(srcu);
+	pthread_mutex_unlock(&srcu->lock);
+}
+
+static void aesd_cuse_srcu_invoke(struct rcu_head *head)
+{
+	struct rcu_head *next;
+
+	while(head != NULL)
+	{
+		next = head->next;
+		head->func(head);
+		head = next;
+	}
+}
+
+/**
+ * Waits for a grace period and runs every queued callback
+ */
+void srcu_barrier(struct srcu_struct *srcu)
+{
+	struct rcu_head *callbacks;
+
+	pthread_mutex_lock(&srcu->lock);
+	callbacks = srcu->callbacks;
+	srcu->callbacks = NULL;
+	srcu->queued = 0;
+	if(callbacks != NULL)
+		aesd_cuse_srcu_grace_period(srcu);
+	pthread_mutex_unlock(&srcu->lock);
+
+	aesd_cuse_srcu_invoke(callbacks);
+}
+
+/**
+ * Queues @param func, running the queue after a grace period once it holds a batch.  The
+ * caller may wait for readers, so it must not be in a read section of @param srcu.
+ */
+void call_srcu(struct srcu_struct *srcu, struct rcu_head *head, void (*func)(struct rcu_head *head))
+{
+	bool full;
+
+	head->func = func;
+	pthread_mutex_lock(&srcu->lock);
+	head->next = srcu->callbacks;
+	srcu->callbacks = head;
+	full = ++srcu->queued >= AESD_CUSE_SRCU_BATCH;
+	pthread_mutex_unlock(&srcu->lock);
+
+	if(full)
+		srcu_barrier(srcu);
+}
+
+/* wait queues */
+
+void init_waitqueue_head(wait_queue_head_t *wq)
+{
+	pthread_mutex_init(&wq->lock, NULL);
+	pthread_cond_init(&wq->cond, NULL);
+}
+
+void wake_up_interruptible(wait_queue_head_t *wq)
+{
+	pthread_mutex_lock(&wq->lock);
+	pthread_cond_broadcast(&wq->cond);
+	pthread_mutex_unlock(&wq->lock);
+}
+
+/* files */
+
+loff_t fixed_size_llseek(struct file *filp, loff_t off, int whence, loff_t size)
+{
+	loff_t pos;
+
+	switch(whence)
+	{
+	case SEEK_SET:
+		pos = off;
+		break;
+	case SEEK_CUR:
+		pos = filp->f_pos + off;
+		break;
+	case SEEK_END:
+		pos = size + off;
+		break;
+	default:
+		return -EINVAL;
+	}
+	if(pos < 0 || pos > size)
+		return -EINVAL;
+	filp->f_pos = pos;
+	return pos;
+}
+
+/* debugfs and seq_file */
+
+struct dentry
+{
+	char name[64];
+	struct dentry *parent;
+	struct dentry *next;
+	void *data;
+	const struct file_operations *fops;
+};
+
+static struct dentry *aesd_cuse_dentries;
+static pthread_mutex_t aesd_cuse_dentries_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct dentry *aesd_cuse_debugfs_create(const char *name, struct dentry *parent,
+			void *data, const struct file_operations *fops)
+{
+	struct dentry *dentry = calloc(1, sizeof(*dentry));
+
+	if(dentry == NULL)
+		return NULL;
+	snprintf(dentry->name, sizeof(dentry->name), "%s", name);
+	dentry->parent = parent;
+	dentry->data = data;
+	dentry->fops = fops;
+
+	pthread_mutex_lock(&aesd_cuse_dentries_lock);
+	dentry->next = aesd_cuse_dentries;
+	aesd_cuse_dentries = dentry;
+	pthread_mutex_unlock(&aesd_cuse_dentries_lock);
+	return dentry;
+}
+
+struct dentry *debugfs_create_dir(const char *name, struct dentry *parent)
+{
+	return aesd_cuse_debugfs_create(name, parent, NULL, NULL);
+}
+
+struct dentry *debugfs_create_file(const char *name, unsigned int mode, struct dentry *parent,
+			void *data, const struct file_operations *fops)
+{
+	return aesd_cuse_debugfs_create(name, parent, data, fops);
+}
+
+static bool aesd_cuse_dentry_within(struct dentry *dentry, struct dentry *ancestor)
+{
+	for(; dentry != NULL; dentry = dentry->parent)
+	{
+		if(dentry == ancestor)
+			return true;
+	}
+	return false;
+}
+
+void debugfs_remove_recursive(struct dentry *dentry)
+{
+	struct dentry **link;
+	struct dentry *removed = NULL;
+	struct dentry *next;
+
+	if(dentry == NULL)
+		return;
+
+	//unlink everything below dentry first, children point at their parents
+	pthread_mutex_lock(&aesd_cuse_dentries_lock);
+	link = &aesd_cuse_dentries;
+	while(*link != NULL)
+	{
+		next = (*link)->next;
+		if(aesd_cuse_dentry_within(*link, dentry))
+		{
+			(*link)->next = removed;
+			removed = *link;
+			*link = next;
+		}
+		else
+			link = &(*link)->next;
+	}
+	pthread_mutex_unlock(&aesd_cuse_dentries_lock);
+
+	while(removed != NULL)
+	{
+		next = removed->next;
+		free(removed);
+		removed = next;
+	}
+}
+
+static void aesd_cuse_dentry_path(FILE *out, struct dentry *dentry)
+{
+	if(dentry->parent != NULL)
+		aesd_cuse_dentry_path(out, dentry->parent);
+	fprintf(out, "/%s", dentry->name);
+}
+
+void aesd_cuse_debugfs_show(FILE *out)
+{
+	struct dentry *dentry;
+	struct inode inode;
+	struct file filp;
+
+	pthread_mutex_lock(&aesd_cuse_dentries_lock);
+	for(dentry = aesd_cuse_dentries; dentry != NULL; dentry = dentry->next)
+	{
+		if(dentry->fops == NULL || dentry->fops->open == NULL)
+			continue;
+		aesd_cuse_dentry_path(out, dentry);
+		fprintf(out, ":\n");
+
+		//single_open writes straight to the stream passed in private_data
+		memset(&inode, 0, sizeof(inode));
+		memset(&filp, 0, sizeof(filp));
+		inode.i_private = dentry->data;
+		filp.private_data = out;
+		if(dentry->fops->open(&inode, &filp) == 0 && dentry->fops->release != NULL)
+			dentry->fops->release(&inode, &filp);
+	}
+	pthread_mutex_unlock(&aesd_cuse_dentries_lock);
+}
+
+void seq_printf(struct seq_file *m, const char *fmt, ...)
+{
+	va_list args;
+
+	va_start(args, fmt);
+	vfprintf(m->out, fmt, args);
+	va_end(args);
+}
+
+/**
+ * Runs @param show at once, writing to the stream aesd_cuse_debugfs_show put in @param filp
+ */
+int single_open(struct file *filp, int (*show)(struct seq_file *m, void *v), void *data)
+{
+	struct seq_file m;
+
+	m.out = filp->private_data;
+	m.private = data;
+	return show(&m, NULL);
+}
+
+ssize_t seq_read(struct file *filp, char __user *buf, size_t count, loff_t *pos)
+{
+	return 0;
+}
+
+loff_t seq_lseek(struct file *filp, loff_t off, int whence)
+{
+	return -ESPIPE;
+}
+
+int single_release(struct inode *inode, struct file *filp)
+{
+	return 0;
+}
@@ -0,0 +1,498 @@
+/*
+ * aesd-cuse-kernel.h
+ *
+ * The kernel interfaces the aesd char driver uses, implemented in userspace so main.c and
+ * its helpers build unchanged into aesdchar-cuse.  The headers under linux/ and asm/ in
+ * this directory all include this one, and the driver sources are compiled with
+ * -D__KERNEL__ -I cuse so their #include <linux/...> lines find them.
+ *
+ * Locks are pthread mutexes, SRCU is a two counter grace period with batched callbacks,
+ * per CPU counters are one copy updated atomically and debugfs keeps only the stats file
+ * so the daemon can print it.  Anything a CUSE device cannot reach (mmap, splice, module
+ * and cdev registration) is a stub.
+ *
+ *  Created on: October 19, 2021
+ *      Author: Chris Choi
+ */
+
+#ifndef AESD_CUSE_KERNEL_H
+#define AESD_CUSE_KERNEL_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/types.h>
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+//the kernel's 64 bit types are long long everywhere, which its printk formats rely on
+typedef unsigned long long u64;
+typedef int32_t s32;
+typedef long long s64;
+typedef unsigned int gfp_t;
+typedef unsigned int fmode_t;
+typedef unsigned int __poll_t;
+
+//the driver returns it from interrupted waits, the daemon replies EINTR
+#define ERESTARTSYS 512
+
+#define __user
+#define __percpu
+#define __init
+#define __exit
+#define __always_unused __attribute__((unused))
+#define ____cacheline_aligned __attribute__((aligned(64)))
+#define ____cacheline_aligned_in_smp ____cacheline_aligned
+#define likely(x) __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+
+#define READ_ONCE(x) (*(const volatile __typeof__(x) *)&(x))
+#define WRITE_ONCE(x, val) do { *(volatile __typeof__(x) *)&(x) = (val); } while(0)
+#define barrier() __asm__ __volatile__("" ::: "memory")
+#define smp_mb() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define smp_rmb() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define smp_wmb() __atomic_thread_fence(__ATOMIC_RELEASE)
+
+#define container_of(ptr, type, member) ((type *)((char *)(ptr) - offsetof(type, member)))
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#define max(a, b) ((a) > (b) ? (a) : (b))
+#define min_t(type, a, b) min((type)(a), (type)(b))
+#define max_t(type, a, b) max((type)(a), (type)(b))
+#define DIV_ROUND_UP(n, d) (((n) + (d) - 1) / (d))
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+#define KERNEL_VERSION(a, b, c) (((a) << 16) + ((b) << 8) + (c))
+#define LINUX_VERSION_CODE KERNEL_VERSION(6, 5, 0)
+
+/* printk */
+
+#define KERN_ERR ""
+#define KERN_WARNING ""
+#define KERN_NOTICE ""
+#define KERN_INFO ""
+#define KERN_DEBUG ""
+#define printk(fmt, ...) fprintf(stderr, fmt, ##__VA_ARGS__)
+
+/* module */
+
+#define THIS_MODULE NULL
+#define MODULE_AUTHOR(x)
+#define MODULE_LICENSE(x)
+#define MODULE_PARM_DESC(name, desc)
+#define module_param(name, type, perm)
+#define module_init(fn)
+#define module_exit(fn)
+#define S_IRUGO 0444
+
+struct module;
+
+/* memory */
+
+#define PAGE_SHIFT 12
+#define PAGE_SIZE (1UL << PAGE_SHIFT)
+#define GFP_KERNEL 0u
+#define __GFP_ZERO 1u
+#define SMP_CACHE_BYTES 64
+
+void *kmalloc(size_t size, gfp_t flags);
+void *kzalloc(size_t size, gfp_t flags);
+void *kcalloc(size_t n, size_t size, gfp_t flags);
+void kfree(const void *ptr);
+#define kvcalloc kcalloc
+#define kvfree kfree
+
+struct kmem_cache;
+
+struct kmem_cache *kmem_cache_create(const char *name, unsigned int size, unsigned int align,
+			unsigned long flags, void (*ctor)(void *));
+void *kmem_cache_alloc(struct kmem_cache *cache, gfp_t flags);
+void kmem_cache_free(struct kmem_cache *cache, void *ptr);
+void kmem_cache_destroy(struct kmem_cache *cache);
+
+/**
+ * A page is a one page memfd, so vmap can map the same page at several addresses
+ */
+struct page
+{
+	int fd;
+};
+
+#define VM_MAP 0
+#define PAGE_KERNEL 0
+#define VM_WRITE 0x2UL
+#define VM_MAYWRITE 0x20UL
+
+struct page *alloc_page(gfp_t flags);
+void __free_page(struct page *page);
+void *vmap(struct page **pages, unsigned int count, unsigned long flags, int prot);
+void vunmap(const void *addr);
+
+struct vm_area_struct
+{
+	unsigned long vm_start;
+	unsigned long vm_end;
+	unsigned long vm_pgoff;
+	unsigned long vm_flags;
+};
+
+static inline unsigned long vma_pages(struct vm_area_struct *vma)
+{
+	return (vma->vm_end - vma->vm_start) >> PAGE_SHIFT;
+}
+
+static inline void vm_flags_clear(struct vm_area_struct *vma, unsigned long flags)
+{
+	vma->vm_flags &= ~flags;
+}
+
+static inline int vm_insert_page(struct vm_area_struct *vma, unsigned long addr, struct page *page)
+{
+	return -ENODEV;
+}
+
+static inline unsigned long copy_to_user(void __user *to, const void *from, unsigned long n)
+{
+	memcpy(to, from, n);
+	return 0;
+}
+
+static inline unsigned long copy_from_user(void *to, const void __user *from, unsigned long n)
+{
+	memcpy(to, from, n);
+	return 0;
+}
+
+/* atomics */
+
+typedef struct { int refs; } refcount_t;
+
+static inline void refcount_set(refcount_t *r, int n)
+{
+	__atomic_store_n(&r->refs, n, __ATOMIC_RELAXED);
+}
+
+static inline void refcount_inc(refcount_t *r)
+{
+	__atomic_fetch_add(&r->refs, 1, __ATOMIC_RELAXED);
+}
+
+static inline bool refcount_dec_and_test(refcount_t *r)
+{
+	return __atomic_sub_fetch(&r->refs, 1, __ATOMIC_ACQ_REL) == 0;
+}
+
+typedef struct { long counter; } atomic_long_t;
+
+#define ATOMIC_LONG_INIT(i) { (i) }
+
+static inline void atomic_long_inc(atomic_long_t *a)
+{
+	__atomic_fetch_add(&a->counter, 1, __ATOMIC_RELAXED);
+}
+
+static inline void atomic_long_dec(atomic_long_t *a)
+{
+	__atomic_fetch_sub(&a->counter, 1, __ATOMIC_RELAXED);
+}
+
+static inline long atomic_long_read(const atomic_long_t *a)
+{
+	return __atomic_load_n(&a->counter, __ATOMIC_RELAXED);
+}
+
+static inline int fls64(u64 x)
+{
+	return x ? 64 - __builtin_clzll(x) : 0;
+}
+
+/* per cpu data, one copy shared by every thread */
+
+#define alloc_percpu(type) ((type *)kzalloc(sizeof(type), GFP_KERNEL))
+#define free_percpu(ptr) kfree(ptr)
+#define per_cpu_ptr(ptr, cpu) (ptr)
+#define for_each_possible_cpu(cpu) for((cpu) = 0; (cpu) < 1; (cpu)++)
+#define this_cpu_add(var, val) __atomic_fetch_add(&(var), (val), __ATOMIC_RELAXED)
+#define this_cpu_inc(var) this_cpu_add(var, 1)
+
+u64 ktime_get_ns(void);
+
+/* locking */
+
+struct mutex
+{
+	pthread_mutex_t lock;
+};
+
+#define mutex_init(m) pthread_mutex_init(&(m)->lock, NULL)
+#define mutex_lock(m) pthread_mutex_lock(&(m)->lock)
+#define mutex_unlock(m) pthread_mutex_unlock(&(m)->lock)
+
+static inline int mutex_lock_interruptible(struct mutex *m)
+{
+	return pthread_mutex_lock(&m->lock) == 0 ? 0 : -EINTR;
+}
+
+typedef struct
+{
+	unsigned int sequence;
+} seqcount_mutex_t;
+
+#define seqcount_mutex_init(s, lock) ((s)->sequence = 0)
+
+static inline unsigned int read_seqcount_begin(const seqcount_mutex_t *s)
+{
+	unsigned int seq;
+
+	while((seq = __atomic_load_n(&s->sequence, __ATOMIC_ACQUIRE)) & 1)
+		;
+	return seq;
+}
+
+static inline int read_seqcount_retry(const seqcount_mutex_t *s, unsigned int seq)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&s->sequence, __ATOMIC_RELAXED) != seq;
+}
+
+static inline void write_seqcount_begin(seqcount_mutex_t *s)
+{
+	__atomic_store_n(&s->sequence, s->sequence + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void write_seqcount_end(seqcount_mutex_t *s)
+{
+	__atomic_store_n(&s->sequence, s->sequence + 1, __ATOMIC_RELEASE);
+}
+
+struct rcu_head
+{
+	struct rcu_head *next;
+	void (*func)(struct rcu_head *head);
+};
+
+/**
+ * Readers count themselves in readers[idx & 1].  A grace period flips idx and waits for the
+ * old counter to drain, twice, so readers that sampled idx just before a flip are waited for
+ * too.  Callbacks are queued and run in batches after one grace period.
+ */
+struct srcu_struct
+{
+	unsigned long idx;
+	long readers[2];
+	pthread_mutex_t lock;
+	struct rcu_head *callbacks;
+	unsigned int queued;
+};
+
+int init_srcu_struct(struct srcu_struct *srcu);
+void cleanup_srcu_struct(struct srcu_struct *srcu);
+int srcu_read_lock(struct srcu_struct *srcu);
+void srcu_read_unlock(struct srcu_struct *srcu, int idx);
+void synchronize_srcu(struct srcu_struct *srcu);
+void call_srcu(struct srcu_struct *srcu, struct rcu_head *head, void (*func)(struct rcu_head *head));
+void srcu_barrier(struct srcu_struct *srcu);
+
+/* wait queues */
+
+typedef struct
+{
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} wait_queue_head_t;
+
+void init_waitqueue_head(wait_queue_head_t *wq);
+void wake_up_interruptible(wait_queue_head_t *wq);
+
+/**
+ * Implemented by the daemon: true once the request the calling thread serves was interrupted
+ */
+bool signal_pending_current(void);
+
+//the waker takes wq->lock before broadcasting, so a condition that turns true after it is
+//checked here is never missed; interrupting a request wakes the queue too
+#define wait_event_interruptible(wq, condition)					\
+({										\
+	int __ret = 0;								\
+	pthread_mutex_lock(&(wq).lock);						\
+	while(!(condition))							\
+	{									\
+		if(signal_pending_current())					\
+		{								\
+			__ret = -ERESTARTSYS;					\
+			break;							\
+		}								\
+		pthread_cond_wait(&(wq).cond, &(wq).lock);			\
+	}									\
+	pthread_mutex_unlock(&(wq).lock);					\
+	__ret;									\
+})
+
+/* files */
+
+#define IOCB_NOWAIT (1 << 7)
+
+#define MINORBITS 20
+#define MKDEV(ma, mi) (((ma) << MINORBITS) | (mi))
+#define MAJOR(dev) ((unsigned int)((dev) >> MINORBITS))
+
+struct file_operations;
+struct dentry;
+
+struct cdev
+{
+	struct module *owner;
+	const struct file_operations *ops;
+};
+
+struct inode
+{
+	struct cdev *i_cdev;
+	void *i_private;
+};
+
+struct file
+{
+	loff_t f_pos;
+	unsigned int f_flags;
+	void *private_data;
+};
+
+struct kiocb
+{
+	struct file *ki_filp;
+	loff_t ki_pos;
+	int ki_flags;
+};
+
+/**
+ * One contiguous buffer, which is all a CUSE request carries
+ */
+struct iov_iter
+{
+	char *base;
+	size_t count;
+};
+
+static inline size_t iov_iter_count(const struct iov_iter *i)
+{
+	return i->count;
+}
+
+static inline void iov_iter_init_buf(struct iov_iter *i, void *buf, size_t count)
+{
+	i->base = buf;
+	i->count = count;
+}
+
+static inline size_t copy_to_iter(const void *addr, size_t bytes, struct iov_iter *i)
+{
+	bytes = min(bytes, i->count);
+	memcpy(i->base, addr, bytes);
+	i->base += bytes;
+	i->count -= bytes;
+	return bytes;
+}
+
+static inline size_t copy_from_iter(void *addr, size_t bytes, struct iov_iter *i)
+{
+	bytes = min(bytes, i->count);
+	memcpy(addr, i->base, bytes);
+	i->base += bytes;
+	i->count -= bytes;
+	return bytes;
+}
+
+static inline void iov_iter_revert(struct iov_iter *i, size_t bytes)
+{
+	i->base -= bytes;
+	i->count += bytes;
+}
+
+struct poll_table_struct;
+typedef struct poll_table_struct poll_table;
+
+//poll is not forwarded by aesdchar-cuse, so nobody waits through a poll table
+static inline void poll_wait(struct file *filp, wait_queue_head_t *wq, poll_table *wait)
+{
+}
+
+struct seq_file
+{
+	FILE *out;
+	void *private;
+};
+
+struct file_operations
+{
+	struct module *owner;
+	ssize_t (*read)(struct file *filp, char __user *buf, size_t count, loff_t *pos);
+	ssize_t (*read_iter)(struct kiocb *iocb, struct iov_iter *to);
+	void *splice_read;
+	ssize_t (*write_iter)(struct kiocb *iocb, struct iov_iter *from);
+	loff_t (*llseek)(struct file *filp, loff_t off, int whence);
+	long (*unlocked_ioctl)(struct file *filp, unsigned int cmd, unsigned long arg);
+	int (*mmap)(struct file *filp, struct vm_area_struct *vma);
+	__poll_t (*poll)(struct file *filp, poll_table *wait);
+	int (*open)(struct inode *inode, struct file *filp);
+	int (*release)(struct inode *inode, struct file *filp);
+};
+
+#define copy_splice_read NULL
+
+loff_t fixed_size_llseek(struct file *filp, loff_t off, int whence, loff_t size);
+
+static inline void cdev_init(struct cdev *cdev, const struct file_operations *fops)
+{
+	cdev->ops = fops;
+}
+
+static inline int cdev_add(struct cdev *cdev, dev_t dev, unsigned int count)
+{
+	return 0;
+}
+
+static inline void cdev_del(struct cdev *cdev)
+{
+}
+
+static inline int alloc_chrdev_region(dev_t *dev, unsigned int first, unsigned int count, const char *name)
+{
+	*dev = MKDEV(0, first);
+	return 0;
+}
+
+static inline void unregister_chrdev_region(dev_t dev, unsigned int count)
+{
+}
+
+/* debugfs and seq_file */
+
+struct dentry *debugfs_create_dir(const char *name, struct dentry *parent);
+struct dentry *debugfs_create_file(const char *name, unsigned int mode, struct dentry *parent,
+			void *data, const struct file_operations *fops);
+void debugfs_remove_recursive(struct dentry *dentry);
+
+__attribute__((format(printf, 2, 3)))
+void seq_printf(struct seq_file *m, const char *fmt, ...);
+int single_open(struct file *filp, int (*show)(struct seq_file *m, void *v), void *data);
+ssize_t seq_read(struct file *filp, char __user *buf, size_t count, loff_t *pos);
+loff_t seq_lseek(struct file *filp, loff_t off, int whence);
+int single_release(struct inode *inode, struct file *filp);
+
+/**
+ * Writes every debugfs file the driver created to @param out, as reading them would show
+ */
+void aesd_cuse_debugfs_show(FILE *out);
+
+#endif /* AESD_CUSE_KERNEL_H */
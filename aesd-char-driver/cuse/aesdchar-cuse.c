@@ -0,0 +1,321 @@
+/**
+ * @file aesdchar-cuse.c
+ * @brief Serves the aesd char driver from userspace as a CUSE device
+ *
+ * usage: aesdchar-cuse [-f] [-d] [-s] [--name=aesdchar] [--capacity=N] [--history-pages=N]
+ *                      [--max-bytes=N] [--blocking-reads] [--stats]
+ *
+ * main.c and its helpers are built unchanged against aesd-cuse-kernel.h, and each CUSE
+ * request calls the same aesd_open, aesd_read_iter, aesd_write_iter, aesd_unlocked_ioctl
+ * and aesd_release the module registers, so /dev/<name> behaves like the module's
+ * /dev/aesdchar0 without loading it.  The options mirror the module parameters; --stats
+ * prints the debugfs stats file on exit.  Needs /dev/cuse, so usually root.
+ *
+ * A CUSE device is a stream: lseek does not reach the daemon and AESDCHAR_IOCSEEKTO is the
+ * only way to move the file position.  poll always reports readable and writable, and
+ * mmap and splice are not available.
+ *
+ * @author Chris Choi
+ * @date 2021-10-19
+ *
+ */
+
+#define FUSE_USE_VERSION 35
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <cuse_lowlevel.h>
+#include <fuse_opt.h>
+
+#include "aesd-cuse-kernel.h"
+#include "aesd-circular-buffer.h"
+#include "aesd-history.h"
+#include "aesd-chunk.h"
+#include "aesd-stats.h"
+#include "aesdchar.h"
+#include "aesd_ioctl.h"
+
+//module parameters and entry points from main.c
+extern unsigned int aesd_capacity;
+extern unsigned int aesd_history_pages;
+extern int aesd_nr_devs;
+extern unsigned long aesd_max_bytes;
+extern bool aesd_blocking_reads;
+extern struct aesd_dev *aesd_devices;
+
+int aesd_init_module(void);
+void aesd_cleanup_module(void);
+int aesd_open(struct inode *inode, struct file *filp);
+int aesd_release(struct inode *inode, struct file *filp);
+ssize_t aesd_read_iter(struct kiocb *iocb, struct iov_iter *to);
+ssize_t aesd_write_iter(struct kiocb *iocb, struct iov_iter *from);
+long aesd_unlocked_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
+
+/**
+ * What the kernel would keep for one open file
+ */
+struct aesd_cuse_file
+{
+	struct inode inode;
+	struct file file;
+};
+
+struct aesd_cuse_params
+{
+	char *name;
+	unsigned int capacity;
+	unsigned int history_pages;
+	unsigned long max_bytes;
+	int blocking_reads;
+	int stats;
+};
+
+enum
+{
+	AESD_CUSE_KEY_HELP,
+};
+
+#define AESD_CUSE_OPT(template, field) { template, offsetof(struct aesd_cuse_params, field), 1 }
+
+static const struct fuse_opt aesd_cuse_opts[] = {
+	AESD_CUSE_OPT("--name=%s", name),
+	AESD_CUSE_OPT("--capacity=%u", capacity),
+	AESD_CUSE_OPT("--history-pages=%u", history_pages),
+	AESD_CUSE_OPT("--max-bytes=%lu", max_bytes),
+	AESD_CUSE_OPT("--blocking-reads", blocking_reads),
+	AESD_CUSE_OPT("--stats", stats),
+	FUSE_OPT_KEY("-h", AESD_CUSE_KEY_HELP),
+	FUSE_OPT_KEY("--help", AESD_CUSE_KEY_HELP),
+	FUSE_OPT_END
+};
+
+static const char *aesd_cuse_usage =
+"usage: aesdchar-cuse [options]\n"
+"\n"
+"options:\n"
+"    --help|-h             print this help message\n"
+"    -f                    stay in the foreground\n"
+"    -d                    foreground with FUSE debug output\n"
+"    -s                    serve requests from one thread\n"
+"    --name=NAME           device name, /dev/NAME (default: aesdchar)\n"
+"    --capacity=N          writes stored, as aesd_capacity\n"
+"    --history-pages=N     pages of write history, as aesd_history_pages\n"
+"    --max-bytes=N         most bytes stored, as aesd_max_bytes\n"
+"    --blocking-reads      block reads at the end of the data, as aesd_blocking_reads\n"
+"    --stats               print the stats file on exit\n";
+
+//the request the calling thread is serving, for signal_pending_current
+static __thread fuse_req_t aesd_cuse_req;
+
+bool signal_pending_current(void)
+{
+	return aesd_cuse_req != NULL && fuse_req_interrupted(aesd_cuse_req);
+}
+
+/**
+ * Wakes a read waiting for a write so it sees its request was interrupted
+ */
+static void aesd_cuse_interrupt(fuse_req_t req, void *data)
+{
+	wake_up_interruptible(&aesd_devices[0].inq);
+}
+
+static struct aesd_cuse_file *aesd_cuse_file(struct fuse_file_info *fi)
+{
+	return (struct aesd_cuse_file *)(uintptr_t)fi->fh;
+}
+
+/**
+ * @return the errno to reply for the driver's negative return @param retval
+ */
+static int aesd_cuse_errno(long retval)
+{
+	return retval == -ERESTARTSYS ? EINTR : -retval;
+}
+
+static void aesd_cuse_open(fuse_req_t req, struct fuse_file_info *fi)
+{
+	struct aesd_cuse_file *my_file;
+	int retval;
+
+	my_file = calloc(1, sizeof(*my_file));
+	if(my_file == NULL)
+	{
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	my_file->inode.i_cdev = &aesd_devices[0].cdev;
+	my_file->file.f_flags = fi->flags;
+
+	retval = aesd_open(&my_file->inode, &my_file->file);
+	if(retval)
+	{
+		free(my_file);
+		fuse_reply_err(req, aesd_cuse_errno(retval));
+		return;
+	}
+
+	fi->fh = (uintptr_t)my_file;
+	fi->nonseekable = 1;
+	fuse_reply_open(req, fi);
+}
+
+/**
+ * The kernel sends every CUSE read at offset 0, the file position is kept here instead
+ */
+static void aesd_cuse_read(fuse_req_t req, size_t size, off_t off, struct fuse_file_info *fi)
+{
+	struct aesd_cuse_file *my_file = aesd_cuse_file(fi);
+	struct kiocb iocb;
+	struct iov_iter to;
+	ssize_t retval;
+	char *buf;
+
+	buf = malloc(size ? size : 1);
+	if(buf == NULL)
+	{
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+
+	//O_NONBLOCK may have been changed with fcntl since open
+	my_file->file.f_flags = fi->flags;
+	iocb.ki_filp = &my_file->file;
+	iocb.ki_pos = my_file->file.f_pos;
+	iocb.ki_flags = 0;
+	iov_iter_init_buf(&to, buf, size);
+
+	aesd_cuse_req = req;
+	fuse_req_interrupt_func(req, aesd_cuse_interrupt, NULL);
+	retval = aesd_read_iter(&iocb, &to);
+	aesd_cuse_req = NULL;
+
+	if(retval >= 0)
+	{
+		my_file->file.f_pos = iocb.ki_pos;
+		fuse_reply_buf(req, buf, retval);
+	}
+	else
+		fuse_reply_err(req, aesd_cuse_errno(retval));
+	free(buf);
+}
+
+static void aesd_cuse_write(fuse_req_t req, const char *buf, size_t size, off_t off,
+			struct fuse_file_info *fi)
+{
+	struct aesd_cuse_file *my_file = aesd_cuse_file(fi);
+	struct kiocb iocb;
+	struct iov_iter from;
+	ssize_t retval;
+
+	iocb.ki_filp = &my_file->file;
+	iocb.ki_pos = 0;
+	iocb.ki_flags = 0;
+	iov_iter_init_buf(&from, (char *)buf, size);
+
+	retval = aesd_write_iter(&iocb, &from);
+	if(retval >= 0)
+		fuse_reply_write(req, retval);
+	else
+		fuse_reply_err(req, aesd_cuse_errno(retval));
+}
+
+/**
+ * The argument's size and direction are encoded in @param cmd, so the kernel has already
+ * copied it to @param in_buf and the driver's copy_from_user reads it from there
+ */
+static void aesd_cuse_ioctl(fuse_req_t req, unsigned int cmd, void *arg, struct fuse_file_info *fi,
+			unsigned int flags, const void *in_buf, size_t in_bufsz, size_t out_bufsz)
+{
+	struct aesd_cuse_file *my_file = aesd_cuse_file(fi);
+	long retval;
+
+	if((_IOC_DIR(cmd) & _IOC_WRITE) && in_bufsz < _IOC_SIZE(cmd))
+	{
+		fuse_reply_err(req, EINVAL);
+		return;
+	}
+
+	retval = aesd_unlocked_ioctl(&my_file->file, cmd, (unsigned long)in_buf);
+	if(retval >= 0)
+		fuse_reply_ioctl(req, retval, NULL, 0);
+	else
+		fuse_reply_err(req, aesd_cuse_errno(retval));
+}
+
+static void aesd_cuse_release(fuse_req_t req, struct fuse_file_info *fi)
+{
+	struct aesd_cuse_file *my_file = aesd_cuse_file(fi);
+
+	aesd_release(&my_file->inode, &my_file->file);
+	free(my_file);
+	fuse_reply_err(req, 0);
+}
+
+static const struct cuse_lowlevel_ops aesd_cuse_ops = {
+	.open =     aesd_cuse_open,
+	.read =     aesd_cuse_read,
+	.write =    aesd_cuse_write,
+	.ioctl =    aesd_cuse_ioctl,
+	.release =  aesd_cuse_release,
+};
+
+static int aesd_cuse_process_arg(void *data, const char *arg, int key, struct fuse_args *outargs)
+{
+	if(key == AESD_CUSE_KEY_HELP)
+	{
+		fprintf(stderr, "%s", aesd_cuse_usage);
+		exit(0);
+	}
+	//everything else is a FUSE option for cuse_lowlevel_main
+	return 1;
+}
+
+int main(int argc, char *argv[])
+{
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	struct aesd_cuse_params params;
+	struct cuse_info ci;
+	const char *dev_info_argv[1];
+	char devname[128];
+	int retval;
+
+	memset(&params, 0, sizeof(params));
+	params.capacity = aesd_capacity;
+	params.history_pages = aesd_history_pages;
+	params.max_bytes = aesd_max_bytes;
+	params.blocking_reads = aesd_blocking_reads;
+	if(fuse_opt_parse(&args, &params, aesd_cuse_opts, aesd_cuse_process_arg) != 0)
+		return 1;
+
+	aesd_capacity = params.capacity;
+	aesd_history_pages = params.history_pages;
+	aesd_max_bytes = params.max_bytes;
+	aesd_blocking_reads = params.blocking_reads;
+	//one CUSE session serves one device
+	aesd_nr_devs = 1;
+
+	snprintf(devname, sizeof(devname), "DEVNAME=%s", params.name != NULL ? params.name : "aesdchar");
+
+	retval = aesd_init_module();
+	if(retval)
+	{
+		fprintf(stderr, "aesdchar-cuse: initializing the device failed: %s\n", strerror(-retval));
+		return 1;
+	}
+
+	memset(&ci, 0, sizeof(ci));
+	dev_info_argv[0] = devname;
+	ci.dev_info_argc = 1;
+	ci.dev_info_argv = dev_info_argv;
+
+	retval = cuse_lowlevel_main(args.argc, args.argv, &ci, &aesd_cuse_ops, NULL);
+
+	if(params.stats)
+		aesd_cuse_debugfs_show(stderr);
+	aesd_cleanup_module();
+	free(params.name);
+	fuse_opt_free_args(&args);
+	return retval;
+}
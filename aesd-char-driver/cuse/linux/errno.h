@@ -0,0 +1,3 @@
+//glibc's errno.h includes this header for the error numbers
+#include_next <linux/errno.h>
+#include "../aesd-cuse-kernel.h"
@@ -0,0 +1 @@
+#include "../aesd-cuse-kernel.h"
@@ -0,0 +1,3 @@
+//glibc headers include this one for the __u32 style types
+#include_next <linux/types.h>
+#include "../aesd-cuse-kernel.h"
@@ -12,35 +12,99 @@
  */
 
 #include <linux/module.h>
+#include <linux/moduleparam.h>
 #include <linux/init.h>
 #include <linux/printk.h>
 #include <linux/types.h>
 #include <linux/cdev.h>
+#include <linux/debugfs.h>
 #include <linux/fs.h> // file_operations
+#include <linux/uio.h> // iov_iter
 #include "aesd-circular-buffer.h" // circular buffer operations
+#include "aesd-history.h" // mmap-able write history
+#include "aesd-chunk.h" // chunked write log
+#include "aesd-stats.h" // per cpu counters
+#include <linux/cache.h>
 #include <linux/mutex.h>
+#include <linux/poll.h>
+#include <linux/sched.h>
+#include <linux/wait.h>
+#include <linux/ktime.h>
+#include <linux/seq_file.h>
+#include <linux/version.h>
+#include <linux/seqlock.h>
+#include <linux/srcu.h>
 #include <linux/slab.h>
 #include <asm/uaccess.h>
 #include "aesdchar.h"
+#include "aesd_ioctl.h"
 int aesd_major =   0; // use dynamic major
 int aesd_minor =   0;
 
+//number of writes kept, set at load time with aesdchar_load aesd_capacity=<n>
+unsigned int aesd_capacity = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+module_param(aesd_capacity, uint, S_IRUGO);
+MODULE_PARM_DESC(aesd_capacity, "Number of writes kept, slots are rounded up to a power of two");
+
+//pages of page backed write history readers can mmap, 0 keeps writes in the chunk log and disables mmap
+unsigned int aesd_history_pages = 0;
+module_param(aesd_history_pages, uint, S_IRUGO);
+MODULE_PARM_DESC(aesd_history_pages, "Pages of write history readers can mmap, rounded up to a power of two, 0 disables mmap");
+
+//number of minors, /dev/aesdchar0 to /dev/aesdchar<n - 1>, each with its own lock and ring
+int aesd_nr_devs = 1;
+module_param(aesd_nr_devs, int, S_IRUGO);
+MODULE_PARM_DESC(aesd_nr_devs, "Number of aesdchar devices, each with its own lock and ring");
+
+//most bytes the stored writes of a device may take, 0 for no limit beyond aesd_capacity
+unsigned long aesd_max_bytes = 0;
+module_param(aesd_max_bytes, ulong, S_IRUGO);
+MODULE_PARM_DESC(aesd_max_bytes, "Most bytes stored per device, oldest writes are evicted to stay within it, 0 for no limit");
+
+//block reads at the end of the data until the next write, 0 keeps returning end of file there
+bool aesd_blocking_reads = false;
+module_param(aesd_blocking_reads, bool, S_IRUGO);
+MODULE_PARM_DESC(aesd_blocking_reads, "Block reads at the end of the data until the next write completes, O_NONBLOCK gets -EAGAIN");
+
 MODULE_AUTHOR("Chris Choi"); /** TODO: fill in your name **/
 MODULE_LICENSE("Dual BSD/GPL");
 
-struct aesd_dev aesd_device;
+struct aesd_dev *aesd_devices; // allocated in aesd_init_module
+static struct dentry *aesd_debugfs_root;
+
+/**
+ * Takes the device lock like mutex_lock_interruptible, counting the time spent waiting for it
+ */
+static int aesd_lock(struct aesd_dev *my_device)
+{
+	u64 start = ktime_get_ns();
+	int retval;
+
+	retval = mutex_lock_interruptible(&my_device->lock);
+	if(retval == 0)
+	{
+		aesd_stats_add(&my_device->stats, lock_wait_ns, ktime_get_ns() - start);
+		aesd_stats_add(&my_device->stats, lock_acquisitions, 1);
+	}
+	return retval;
+}
 
 int aesd_open(struct inode *inode, struct file *filp)
 {
-	struct aesd_dev* my_device;
+	struct aesd_file* my_file;
 
 	PDEBUG("open");
 	/**
 	 * TODO: handle open
 	 */
 
-	my_device = container_of(inode->i_cdev, struct aesd_dev, cdev);
-	filp->private_data = my_device;
+	my_file = kzalloc(sizeof(struct aesd_file), GFP_KERNEL);
+	if(my_file == NULL)
+		return -ENOMEM;
+	my_file->dev = container_of(inode->i_cdev, struct aesd_dev, cdev);
+	mutex_init(&my_file->lock);
+	aesd_chunk_log_init(&my_file->chunks);
+	filp->private_data = my_file;
 	
 	return 0;
 	
@@ -48,201 +112,724 @@ int aesd_open(struct inode *inode, struct file *filp)
 
 int aesd_release(struct inode *inode, struct file *filp)
 {
+	struct aesd_file *my_file = filp->private_data;
+	struct aesd_dev *my_device = my_file->dev;
+
 	PDEBUG("release");
 	/**
 	 * TODO: handle release
 	 */
+
+	//a command left without its newline is dropped, chunks shared with stored writes stay
+	aesd_stats_add(&my_device->stats, bytes_staged, -(s64)my_file->entry.size);
+	aesd_chunk_log_destroy(&my_file->chunks, &my_device->srcu);
+	kfree(my_file);
 	return 0;
 }
 
-ssize_t aesd_read(struct file *filp, char __user *buf, size_t count,
-                loff_t *f_pos)
+/**
+ * Samples the stream positions just past the newest stored byte and of the oldest one
+ */
+static size_t aesd_read_end(struct aesd_dev *my_device, size_t *start)
 {
-	PDEBUG("read %zu bytes with offset %lld",count,*f_pos);
+	unsigned int seq;
+	size_t end;
+
+	do {
+		seq = read_seqcount_begin(&my_device->seq);
+		end = my_device->buff.end_offset;
+		*start = end - my_device->buff.total_size;
+	} while(read_seqcount_retry(&my_device->seq, seq));
+
+	return end;
+}
+
+/**
+ * @return true if the bytes from stream position @param position on were evicted since they were
+ * looked up.  A history reuses its pages in place, so its readers check this after copying.
+ */
+static bool aesd_read_overwritten(struct aesd_dev *my_device, size_t position)
+{
+	unsigned int seq;
+	size_t start;
+
+	//the copy has to be complete before the sequence is sampled
+	smp_rmb();
+	do {
+		seq = read_seqcount_begin(&my_device->seq);
+		start = my_device->buff.end_offset - my_device->buff.total_size;
+	} while(read_seqcount_retry(&my_device->seq, seq));
+
+	return (ssize_t)(position - start) < 0;
+}
+
+/**
+ * Reads from iocb->ki_pos on, across as many consecutive writes as fit in @param to, so one
+ * read() or readv() of a large buffer returns many short writes at once.  With blocking reads
+ * the file tails the device: a read from the position where one waited for more data, pread()
+ * included, starts at the first write added since, even if the ring was full.  Without them
+ * every read uses its offset as is.
+ */
+ssize_t aesd_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	PDEBUG("read %zu bytes with offset %lld",iov_iter_count(to),iocb->ki_pos);
 	/**
 	 * TODO: handle read
 	 */
 
 	ssize_t retval = 0;
-	ssize_t buffer_offset;
-	ssize_t buffer_bytes;
-	struct aesd_dev *my_device = NULL;
+	size_t buffer_offset;
+	size_t buffer_bytes = 0;
+	size_t copied;
+	size_t position = 0;
+	size_t start;
+	size_t end = 0;
+	const char *entry_ptr = NULL;
+	uint32_t hint = 0;
+	unsigned int seq;
+	int srcu_idx;
+	struct aesd_file *my_file = iocb->ki_filp->private_data;
+	struct aesd_dev *my_device = my_file->dev;
 	struct aesd_buffer_entry *read_entry = NULL;
-	my_device = filp->private_data;
+	u64 start_ns = ktime_get_ns();
 
-	//lock mutex and check return value
-	retval = mutex_lock_interruptible(&my_device->lock);
-	if(retval < 0)
+	//readers never take the lock: the seqcount gives them a consistent lookup and SRCU keeps
+	//what they found allocated while they copy it
+	srcu_idx = srcu_read_lock(&my_device->srcu);
+
+	for(;;)
 	{
-	  retval = -ERESTARTSYS;
-	  return retval;
+		//writes since this file last waited for more data start where that data ended
+		if(mutex_lock_interruptible(&my_file->lock))
+		{
+			retval = -ERESTARTSYS;
+			break;
+		}
+		if(my_file->at_eof && iocb->ki_pos == my_file->eof_pos &&
+				aesd_read_end(my_device, &start) != my_file->eof)
+		{
+			iocb->ki_pos = (ssize_t)(my_file->eof - start) > 0 ? my_file->eof - start : 0;
+			my_file->at_eof = false;
+		}
+		mutex_unlock(&my_file->lock);
+
+		while(iov_iter_count(to) > 0)
+		{
+			//find entry offset, again if a writer changed the ring meanwhile; after the first
+			//entry the hint makes each lookup constant time
+			do {
+				seq = read_seqcount_begin(&my_device->seq);
+				read_entry = aesd_circular_buffer_find_entry_hint(&my_device->buff, iocb->ki_pos,
+						&buffer_offset, &hint);
+				if(read_entry != NULL)
+				{
+					entry_ptr = read_entry->buffptr;
+					buffer_bytes = read_entry->size - buffer_offset;
+					position = read_entry->offset + buffer_offset;
+				}
+				else
+					end = my_device->buff.end_offset;
+			} while(read_seqcount_retry(&my_device->seq, seq));
+
+			if(read_entry == NULL)
+				break;
+
+			//check to see if the space left < bytes in the entry
+			if(buffer_bytes > iov_iter_count(to))
+				buffer_bytes = iov_iter_count(to);
+
+			//a history keeps each write contiguous, the chunk log continues it chunk to chunk
+			if(my_device->history.pages != NULL)
+				copied = copy_to_iter(entry_ptr + buffer_offset, buffer_bytes, to);
+			else
+				copied = aesd_chunk_copy_to_iter(aesd_chunk_seek(entry_ptr, buffer_offset),
+						buffer_bytes, to);
+
+			if(my_device->history.pages != NULL && aesd_read_overwritten(my_device, position))
+			{
+				iov_iter_revert(to, copied);
+				continue;
+			}
+
+			//add bytes read
+			iocb->ki_pos += copied;
+			retval += copied;
+
+			//a fault in the user buffer ends the read, with -EFAULT only if nothing was copied
+			if(copied < buffer_bytes)
+			{
+				if(retval == 0)
+					retval = -EFAULT;
+				break;
+			}
+		}
+
+		if(retval != 0 || iov_iter_count(to) == 0)
+			break;
+
+		//no more data: return end of file, or remember where it ended for the next read of a
+		//tailing reader and wait for a write
+		if(!aesd_blocking_reads)
+			break;
+		mutex_lock(&my_file->lock);
+		my_file->eof = end;
+		my_file->eof_pos = iocb->ki_pos;
+		my_file->at_eof = true;
+		mutex_unlock(&my_file->lock);
+		if((iocb->ki_filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT))
+		{
+			retval = -EAGAIN;
+			break;
+		}
+
+		//a sleeping reader must not hold up the grace periods writers free chunks after
+		srcu_read_unlock(&my_device->srcu, srcu_idx);
+		if(wait_event_interruptible(my_device->inq, READ_ONCE(my_device->buff.end_offset) != end))
+			return -ERESTARTSYS;
+		srcu_idx = srcu_read_lock(&my_device->srcu);
+		//the latency histogram leaves out time spent waiting for a writer
+		start_ns = ktime_get_ns();
 	}
-	
-	//find entry offset and check return for error
-	read_entry = aesd_circular_buffer_find_entry_offset_for_fpos(&my_device->buff, *f_pos,&buffer_offset);
-	if(read_entry == NULL)
+
+	srcu_read_unlock(&my_device->srcu, srcu_idx);
+
+	aesd_stats_add(&my_device->stats, reads, 1);
+	if(retval > 0)
+		aesd_stats_add(&my_device->stats, bytes_read, retval);
+	aesd_stats_latency(&my_device->stats, read_latency, ktime_get_ns() - start_ns);
+
+	//return bytes read
+	return retval;
+}
+
+/**
+ * Evicts the oldest stored write, putting its chunks unless it lives in the history.  Must be
+ * called with the device lock held, inside its write_seqcount section.
+ */
+static void aesd_evict_oldest(struct aesd_dev *my_device)
+{
+	struct aesd_buffer_entry *evicted = aesd_circular_buffer_remove_oldest(&my_device->buff);
+
+	if(my_device->history.pages == NULL)
+		aesd_chunk_put_range(evicted->buffptr, evicted->size, &my_device->srcu);
+}
+
+/**
+ * Stores @param entry, a file's staged write complete up to its newline, in the ring or the
+ * history, evicting what it has to.  Must be called with the device lock held, and with a
+ * history only for an entry that fits in it.
+ */
+static void aesd_store_entry(struct aesd_dev *my_device, struct aesd_buffer_entry *entry)
+{
+	char *history_ptr;
+	char *copy_ptr;
+
+	//readers retry lookups that overlap this section
+	write_seqcount_begin(&my_device->seq);
+
+	//stay within the byte budget, each write is evicted at most once so adding is amortized O(1)
+	if(aesd_max_bytes)
 	{
-	  mutex_unlock(&my_device->lock);
-	  return 0;
+		while(my_device->buff.count > 0 &&
+				my_device->buff.total_size + entry->size > aesd_max_bytes)
+			aesd_evict_oldest(my_device);
 	}
-	
-	//set bytes read and check to see if count < bytes read
-	buffer_bytes = read_entry->size - buffer_offset;
-	if(count < buffer_bytes)
-	   buffer_bytes = count;
-	
-	retval = copy_to_user(buf, (read_entry->buffptr + buffer_offset), buffer_bytes);
-	if (retval != 0)
+
+	//with a history the entry is copied into its pages and the file's log keeps its chunks;
+	//publishing also brings the header up to date with the budget's evictions
+	if(my_device->history.pages != NULL)
 	{
-		retval = -EFAULT;
-		return retval;
+		history_ptr = aesd_history_reserve(&my_device->history, &my_device->buff, entry->size);
+		aesd_chunk_copy(history_ptr, entry->buffptr, entry->size);
+		aesd_history_publish(&my_device->history, &my_device->buff, entry->size);
+	}
+	else
+	{
+		//a write shorter than a chunk is packed into the device's chunks, so short writes through
+		//many files do not each keep a chunk of their file's alive; if that fails it stays put
+		if(entry->size < AESD_CHUNK_DATA_SIZE &&
+				aesd_chunk_log_append_copy(&my_device->chunks, entry->buffptr, entry->size,
+					&copy_ptr) == 0)
+			entry->buffptr = copy_ptr;
+
+		//the ring references the entry's chunks until it is evicted, the logs move on past them
+		aesd_chunk_get_range(entry->buffptr, entry->size);
+		if(my_device->buff.full)
+			aesd_evict_oldest(my_device);
+		aesd_circular_buffer_add_entry(&my_device->buff, entry);
+		aesd_chunk_log_release(&my_device->chunks, NULL, &my_device->srcu);
 	}
 
-	//add bytes read
-	*f_pos += buffer_bytes;
+	write_seqcount_end(&my_device->seq);
+}
 
-	//release mutex
-	mutex_unlock(&my_device->lock); 
+/**
+ * Stores @param entry, a file's staged write complete up to its newline, unless it is larger
+ * than the history.  Must be called with the device lock held.
+ * @return 0, or -EFBIG if it is larger than the history; the staged write is dropped either way
+ */
+static int aesd_commit_entry(struct aesd_dev *my_device, struct aesd_buffer_entry *entry)
+{
+	uint32_t stored = my_device->buff.count;
+	int retval = 0;
 
-	//return bytes read
-	return buffer_bytes;
+	//nothing is evicted for a write that cannot be stored anyway
+	if(my_device->history.pages != NULL && entry->size > my_device->history.data_size)
+		retval = -EFBIG;
+	else
+	{
+		aesd_store_entry(my_device, entry);
+		aesd_stats_add(&my_device->stats, entries_written, 1);
+		stored++;
+	}
+	aesd_stats_add(&my_device->stats, entries_evicted, stored - my_device->buff.count);
+	aesd_stats_add(&my_device->stats, bytes_staged, -(s64)entry->size);
+
+	//set size and ptr to 0
+	entry->size = 0;
+	entry->buffptr = NULL;
+	return retval;
 }
 
-ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
-                loff_t *f_pos)
+/**
+ * Stores every newline terminated command in @param from as its own write.  Partial commands
+ * are staged in the file's own chunk log under the file's lock, so writers through different
+ * files append in parallel; the device lock is only taken, once per segment, to commit the
+ * commands the segment completes.  Bytes after the last newline stay staged for the next write
+ * through the same file.
+ */
+ssize_t aesd_write_iter(struct kiocb *iocb, struct iov_iter *from)
 {
-	PDEBUG("write %zu bytes with offset %lld",count,*f_pos);
+	PDEBUG("write %zu bytes with offset %lld",iov_iter_count(from),iocb->ki_pos);
 	/**
 	 * TODO: handle write
 	 */
 
 	ssize_t retval;
-	ssize_t bytes_remaining;
-	const char* buffer_ret = NULL;
-	struct aesd_dev *my_device = NULL;
-	char* line_position = NULL;
-
-	my_device = filp->private_data;
+	ssize_t copied;
+	size_t written = 0;
+	size_t committed = 0;
+	size_t limit;
+	bool changed = false;
+	bool locked;
+	char *segment;
+	char *segment_end;
+	char *line_end;
+	u64 start_ns = ktime_get_ns();
+	struct aesd_file *my_file = iocb->ki_filp->private_data;
+	struct aesd_dev *my_device = my_file->dev;
+	struct aesd_buffer_entry *entry = &my_file->entry;
+
+	retval = mutex_lock_interruptible(&my_file->lock);
+	if(retval < 0)
+		return retval;
 
-	retval = mutex_lock_interruptible(&my_device->lock);
-		if(retval < 0)
-			return retval;
-	
-	if (my_device->entry.size == 0) 
+	while(iov_iter_count(from) > 0)
 	{
-		//allocate memory
-		my_device->entry.buffptr = kzalloc(count*sizeof(char), GFP_KERNEL); 
-		
-		//check for error
-		if (my_device->entry.buffptr == 0) 
+		//a command that could never be stored within the byte budget is dropped before it takes
+		//more memory, and the write ends after the last command stored
+		limit = iov_iter_count(from);
+		if(aesd_max_bytes)
 		{
-			mutex_unlock(&my_device->lock);
-			retval = -ENOMEM; 
-	        return retval;
+			if(entry->size >= aesd_max_bytes)
+			{
+				aesd_stats_add(&my_device->stats, bytes_staged, -(s64)entry->size);
+				entry->size = 0;
+				entry->buffptr = NULL;
+				changed = true;
+				retval = -EFBIG;
+				break;
+			}
+			limit = min_t(size_t, limit, aesd_max_bytes - entry->size);
 		}
-	}
-	else 
-	{
-		//reallocate memory
-	    my_device->entry.buffptr = krealloc(my_device->entry.buffptr, my_device->entry.size + count, GFP_KERNEL); 
-		
-		//check for error
-		if (my_device->entry.buffptr == 0) 
+
+		//append to the file's chunk log, a partial write stays staged where it is and is never copied again
+		copied = aesd_chunk_log_append_from_iter(&my_file->chunks, from, limit, &segment);
+		if(copied < 0)
+		{
+			retval = copied;
+			break;
+		}
+
+		//only the new bytes are searched, each newline ends a command; a signal while waiting
+		//for the device lock leaves the whole segment unwritten
+		segment_end = segment + copied;
+		line_end = memchr(segment, '\n', copied);
+		locked = line_end != NULL;
+		if(locked)
 		{
+			retval = aesd_lock(my_device);
+			if(retval < 0)
+			{
+				aesd_chunk_log_trim(&my_file->chunks, copied);
+				iov_iter_revert(from, copied);
+				break;
+			}
+		}
+		aesd_stats_add(&my_device->stats, bytes_written, copied);
+		aesd_stats_add(&my_device->stats, bytes_staged, copied);
+
+		while(segment < segment_end)
+		{
+			if(entry->buffptr == NULL)
+				entry->buffptr = segment;
+
+			if(line_end == NULL)
+			{
+				entry->size += segment_end - segment;
+				break;
+			}
+			entry->size += line_end + 1 - segment;
+			segment = line_end + 1;
+
+			changed = true;
+			retval = aesd_commit_entry(my_device, entry);
+			if(retval < 0)
+			{
+				//the rest of the segment is dropped with the command, not staged
+				aesd_stats_add(&my_device->stats, bytes_staged, -(s64)(segment_end - segment));
+				break;
+			}
+			committed = written + (copied - (segment_end - segment));
+			line_end = memchr(segment, '\n', segment_end - segment);
+		}
+
+		if(locked)
+		{
+			//readers waiting at the end of the data, in read or poll
+			wake_up_interruptible(&my_device->inq);
 			mutex_unlock(&my_device->lock);
-	        return retval;
 		}
-	 }
-	bytes_remaining = copy_from_user((void *)(&my_device->entry.buffptr[my_device->entry.size]), buf, count);
-	
-	//set return value by calculating count - bytes remaining and add to entry size
-	retval = count - bytes_remaining;
-	my_device->entry.size += retval;
+		if(retval < 0)
+			break;
+		written += copied;
+	}
 
-	//find line end position
-	line_position = (char *)memchr(my_device->entry.buffptr, '\n', my_device->entry.size);
-	
-	//if line end found
-	if (line_position != NULL) 
+	//bytes after a dropped command were not kept either; after a fault, a failed allocation or
+	//a signal everything copied is stored or staged
+	if(retval == -EFBIG)
+		retval = committed ? committed : retval;
+	else if(retval < 0)
+		retval = written ? written : retval;
+	else
+		retval = written;
+
+	//chunks before the first staged byte now only hold stored writes, which keep what they use
+	if(changed)
+		aesd_chunk_log_release(&my_file->chunks, entry->buffptr, &my_device->srcu);
+
+	iocb->ki_pos = 0;
+	mutex_unlock(&my_file->lock);
+
+	aesd_stats_latency(&my_device->stats, write_latency, ktime_get_ns() - start_ns);
+	return retval;
+}
+
+/**
+ * Seeks within the concatenated contents of the stored writes, SEEK_END is relative to their total size
+ */
+loff_t aesd_llseek(struct file *filp, loff_t off, int whence)
+{
+	struct aesd_file *my_file = filp->private_data;
+	struct aesd_dev *my_device = my_file->dev;
+	loff_t retval;
+
+	PDEBUG("llseek to %lld whence %d",off,whence);
+
+	if(aesd_lock(my_device))
+		return -ERESTARTSYS;
+
+	retval = fixed_size_llseek(filp, off, whence, my_device->buff.total_size);
+	mutex_unlock(&my_device->lock);
+
+	//the file position no longer continues a read that found no more data
+	if(retval >= 0)
 	{
-		//add entry and check return
-		aesd_circular_buffer_add_entry(&my_device->buff, &my_device->entry);
-	   
-		//set size and ptr to 0
-	  	my_device->entry.size = 0;
-    	my_device->entry.buffptr = 0;
+		mutex_lock(&my_file->lock);
+		my_file->at_eof = false;
+		mutex_unlock(&my_file->lock);
 	}
+	return retval;
+}
 
-    *f_pos = 0;
-    mutex_unlock(&my_device->lock);
+/**
+ * Handles AESDCHAR_IOCSEEKTO, moving the file position to a byte of a stored write in constant time
+ */
+long aesd_unlocked_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct aesd_file *my_file = filp->private_data;
+	struct aesd_dev *my_device = my_file->dev;
+	struct aesd_seekto seekto;
+	size_t fpos;
+	long retval;
+
+	PDEBUG("ioctl %u",cmd);
+
+	if(_IOC_TYPE(cmd) != AESD_IOC_MAGIC || _IOC_NR(cmd) > AESDCHAR_IOC_MAXNR)
+		return -ENOTTY;
+	if(cmd != AESDCHAR_IOCSEEKTO)
+		return -ENOTTY;
+
+	if(copy_from_user(&seekto, (const void __user *)arg, sizeof(seekto)) != 0)
+		return -EFAULT;
+
+	if(aesd_lock(my_device))
+		return -ERESTARTSYS;
 
-    return retval;
-       
-	 
+	retval = aesd_circular_buffer_fpos_for_entry(&my_device->buff, seekto.write_cmd,
+			seekto.write_cmd_offset, &fpos);
+	if(retval == 0)
+		filp->f_pos = fpos;
+
+	mutex_unlock(&my_device->lock);
+
+	if(retval == 0)
+	{
+		mutex_lock(&my_file->lock);
+		my_file->at_eof = false;
+		mutex_unlock(&my_file->lock);
+	}
+	return retval;
 }
+
+/**
+ * Maps the device's write history read only, see aesd-history.h for the layout
+ */
+int aesd_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct aesd_dev *my_device = ((struct aesd_file *)filp->private_data)->dev;
+
+	PDEBUG("mmap %lu pages",vma_pages(vma));
+
+	//the pages live as long as the device, so no lock is needed
+	return aesd_history_mmap(&my_device->history, vma);
+}
+
+/**
+ * Reports EPOLLIN while a read would return data: the file position is before the end, or,
+ * with blocking reads, writes completed since a read last waited for more data at it.  Writing
+ * never blocks.
+ */
+__poll_t aesd_poll(struct file *filp, poll_table *wait)
+{
+	struct aesd_file *my_file = filp->private_data;
+	struct aesd_dev *my_device = my_file->dev;
+	__poll_t mask = EPOLLOUT | EPOLLWRNORM;
+	size_t start;
+	size_t end;
+
+	poll_wait(filp, &my_device->inq, wait);
+
+	end = aesd_read_end(my_device, &start);
+	mutex_lock(&my_file->lock);
+	if(my_file->at_eof && filp->f_pos == my_file->eof_pos ? end != my_file->eof :
+			filp->f_pos < end - start)
+		mask |= EPOLLIN | EPOLLRDNORM;
+	mutex_unlock(&my_file->lock);
+	return mask;
+}
+
 struct file_operations aesd_fops = {
 	.owner =    THIS_MODULE,
-	.read =     aesd_read,
-	.write =    aesd_write,
+	.read_iter = aesd_read_iter,
+	//splice and sendfile fill pipe pages through aesd_read_iter, so forwarding the device
+	//to a socket copies each byte once, in the kernel
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+	.splice_read = copy_splice_read,
+#else
+	.splice_read = generic_file_splice_read,
+#endif
+	.write_iter = aesd_write_iter,
+	.llseek =   aesd_llseek,
+	.unlocked_ioctl = aesd_unlocked_ioctl,
+	.mmap =     aesd_mmap,
+	.poll =     aesd_poll,
 	.open =     aesd_open,
 	.release =  aesd_release,
 };
 
-static int aesd_setup_cdev(struct aesd_dev *my_device)
+static int aesd_stats_open_show(struct seq_file *m, void *v)
 {
-	int err, devno = MKDEV(aesd_major, aesd_minor);
+	struct aesd_dev *my_device = m->private;
+
+	seq_printf(m, "stored_entries: %u\n", READ_ONCE(my_device->buff.count));
+	seq_printf(m, "stored_bytes: %zu\n", READ_ONCE(my_device->buff.total_size));
+	seq_printf(m, "max_bytes: %lu\n", aesd_max_bytes);
+	//chunks also hold staged writes and the unused ends of shared chunks, of every device
+	seq_printf(m, "chunk_bytes: %zu\n", aesd_chunk_bytes());
+	aesd_stats_show(m, &my_device->stats);
+	return 0;
+}
+
+static int aesd_stats_open(struct inode *inode, struct file *filp)
+{
+	return single_open(filp, aesd_stats_open_show, inode->i_private);
+}
+
+static const struct file_operations aesd_stats_fops = {
+	.owner =    THIS_MODULE,
+	.open =     aesd_stats_open,
+	.read =     seq_read,
+	.llseek =   seq_lseek,
+	.release =  single_release,
+};
+
+static int aesd_setup_cdev(struct aesd_dev *my_device, int index)
+{
+	int err, devno = MKDEV(aesd_major, aesd_minor + index);
 
 	cdev_init(&my_device->cdev, &aesd_fops);
 	my_device->cdev.owner = THIS_MODULE;
 	my_device->cdev.ops = &aesd_fops;
 	err = cdev_add (&my_device->cdev, devno, 1);
 	if (err) {
-		printk(KERN_ERR "Error %d adding aesd cdev", err);
+		printk(KERN_ERR "Error %d adding aesd%d", err, index);
 	}
 	return err;
 }
 
+/**
+ * Sets up the device of minor aesd_minor + @param index, which is live once this returns 0
+ */
+static int aesd_dev_init(struct aesd_dev *my_device, int index)
+{
+	char name[20];
+	int result;
+
+	mutex_init(&my_device->lock); 
+	seqcount_mutex_init(&my_device->seq, &my_device->lock);
+	init_waitqueue_head(&my_device->inq);
+	aesd_chunk_log_init(&my_device->chunks);
+	result = aesd_stats_init(&my_device->stats);
+	if( result )
+		return result;
+	result = init_srcu_struct(&my_device->srcu);
+	if( result ) {
+		aesd_stats_destroy(&my_device->stats);
+		return result;
+	}
+	result = aesd_circular_buffer_init_capacity(&my_device->buff, aesd_capacity);
+	if( result ) {
+		printk(KERN_WARNING "Can't allocate %u entries\n", aesd_capacity);
+		cleanup_srcu_struct(&my_device->srcu);
+		aesd_stats_destroy(&my_device->stats);
+		return result;
+	}
+
+	if( aesd_history_pages ) {
+		result = aesd_history_init(&my_device->history, aesd_history_pages,
+				my_device->buff.slot_mask + 1);
+		if( result ) {
+			printk(KERN_WARNING "Can't allocate %u history pages\n", aesd_history_pages);
+			aesd_circular_buffer_cleanup(&my_device->buff);
+			cleanup_srcu_struct(&my_device->srcu);
+			aesd_stats_destroy(&my_device->stats);
+			return result;
+		}
+	}
+
+	result = aesd_setup_cdev(my_device, index);
+	if( result ) {
+		aesd_history_destroy(&my_device->history);
+		aesd_circular_buffer_cleanup(&my_device->buff);
+		cleanup_srcu_struct(&my_device->srcu);
+		aesd_stats_destroy(&my_device->stats);
+		return result;
+	}
 
+	//debugfs is best effort, the device works without it
+	snprintf(name, sizeof(name), "aesdchar%d", index);
+	my_device->debugfs = debugfs_create_dir(name, aesd_debugfs_root);
+	debugfs_create_file("stats", S_IRUGO, my_device->debugfs, my_device, &aesd_stats_fops);
+	return 0;
+}
+
+static void aesd_dev_cleanup(struct aesd_dev *my_device)
+{
+	debugfs_remove_recursive(my_device->debugfs);
+	cdev_del(&my_device->cdev);
+
+	//every file is closed, so putting the stored writes' chunks frees them; wait until they
+	//and those released earlier are past their grace period
+	while(my_device->buff.count > 0)
+		aesd_evict_oldest(my_device);
+	aesd_chunk_log_destroy(&my_device->chunks, &my_device->srcu);
+	srcu_barrier(&my_device->srcu);
+
+	aesd_history_destroy(&my_device->history);
+	aesd_circular_buffer_cleanup(&my_device->buff);
+	cleanup_srcu_struct(&my_device->srcu);
+	aesd_stats_destroy(&my_device->stats);
+}
 
 int aesd_init_module(void)
 {
 	dev_t my_device = 0;
 	int result;
-	result = alloc_chrdev_region(&my_device, aesd_minor, 1,
+	int index;
+
+	if (aesd_nr_devs < 1) {
+		printk(KERN_WARNING "aesd_nr_devs must be at least 1\n");
+		return -EINVAL;
+	}
+	result = alloc_chrdev_region(&my_device, aesd_minor, aesd_nr_devs,
 			"aesdchar");
 	aesd_major = MAJOR(my_device);
 	if (result < 0) {
 		printk(KERN_WARNING "Can't get major %d\n", aesd_major);
 		return result;
 	}
-	memset(&aesd_device,0,sizeof(struct aesd_dev));
 
 	/**
 	 * TODO: initialize the AESD specific portion of the device
 	 */
-	mutex_init(&aesd_device.lock); 
-	aesd_circular_buffer_init(&aesd_device.buff);
-
-	result = aesd_setup_cdev(&aesd_device);
-       
+	result = aesd_chunk_cache_create();
 	if( result ) {
-		unregister_chrdev_region(my_device, 1);
+		unregister_chrdev_region(my_device, aesd_nr_devs);
+		return result;
 	}
-	return result;
+
+	//struct aesd_dev is padded to whole cache lines, and an allocation this size is at least
+	//cache line aligned, so neighbouring devices never share a line
+	aesd_devices = kcalloc(aesd_nr_devs, sizeof(struct aesd_dev), GFP_KERNEL);
+	if( aesd_devices == NULL ) {
+		aesd_chunk_cache_destroy();
+		unregister_chrdev_region(my_device, aesd_nr_devs);
+		return -ENOMEM;
+	}
+
+	aesd_debugfs_root = debugfs_create_dir("aesdchar", NULL);
+	for(index = 0; index < aesd_nr_devs; index++)
+	{
+		result = aesd_dev_init(&aesd_devices[index], index);
+		if( result ) {
+			while(index--)
+				aesd_dev_cleanup(&aesd_devices[index]);
+			debugfs_remove_recursive(aesd_debugfs_root);
+			kfree(aesd_devices);
+			aesd_chunk_cache_destroy();
+			unregister_chrdev_region(my_device, aesd_nr_devs);
+			return result;
+		}
+	}
+	return 0;
 
 }
 
 void aesd_cleanup_module(void)
 {
 	dev_t devno = MKDEV(aesd_major, aesd_minor);
-
-	cdev_del(&aesd_device.cdev);
+	int index;
 
 	/**
 	 * TODO: cleanup AESD specific poritions here as necessary
 	 */
-	aesd_circular_buffer_cleanup(&aesd_device.buff);
-	unregister_chrdev_region(devno, 1);
+	for(index = 0; index < aesd_nr_devs; index++)
+		aesd_dev_cleanup(&aesd_devices[index]);
+	debugfs_remove_recursive(aesd_debugfs_root);
+	kfree(aesd_devices);
+	aesd_chunk_cache_destroy();
+	unregister_chrdev_region(devno, aesd_nr_devs);
 }
 
 
@@ -0,0 +1,228 @@
+/**
+ * @file aesd-client-bench.c
+ * @brief Measures packets per second through the aesd-client library
+ *
+ * usage: aesd-client-bench [-h host] [-p port] [-c connections] [-w inflight]
+ *                          [-n packets] [-s size] [-r] [-l] [-U path]
+ *   -r  ask the server to replay the log after every packet
+ *   -l  baseline: one legacy connection per packet, reading the full replay
+ *   -U  use the shared memory transport at path, waiting for commits every
+ *       inflight packets (-w 1 measures per-packet append latency)
+ *
+ * @author Chris Choi
+ * @date 2021-10-19
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#include "aesd-client.h"
+
+#define BENCH_DEFAULT_HOST "localhost"
+#define BENCH_DEFAULT_PORT "9000"
+#define BENCH_DEFAULT_PACKETS 100000
+#define BENCH_DEFAULT_SIZE 64
+#define BENCH_RECV_SIZE 65536
+
+static size_t completed;
+static size_t failed;
+
+static void on_complete(void *arg, int status, off_t end_offset, const char *replay, size_t replay_size)
+{
+	if(status == 0)
+		completed++;
+	else
+		failed++;
+}
+
+static double elapsed_seconds(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+//one connection per packet, the way producers talk to aesdsocket without the library
+static int send_legacy(const char *host, const char *port, const char *packet, size_t size)
+{
+	struct addrinfo hints;
+	struct addrinfo *res;
+	char buffer[BENCH_RECV_SIZE];
+	ssize_t received;
+	int sock;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if(getaddrinfo(host, port, &hints, &res) != 0)
+		return -1;
+
+	sock = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+	if(sock < 0 || connect(sock, res->ai_addr, res->ai_addrlen) != 0)
+	{
+		freeaddrinfo(res);
+		if(sock >= 0)
+			close(sock);
+		return -1;
+	}
+	freeaddrinfo(res);
+
+	if(send(sock, packet, size, MSG_NOSIGNAL) != (ssize_t)size)
+	{
+		close(sock);
+		return -1;
+	}
+	do
+	{
+		received = recv(sock, buffer, sizeof(buffer), 0);
+	}while(received > 0);
+
+	close(sock);
+	return received == 0 ? 0 : -1;
+}
+
+//publish through the shared memory ring, waiting for the commit every inflight packets
+static int send_local(const char *path, const char *packet, size_t size, size_t packets, unsigned int inflight)
+{
+	struct aesd_client_local *local;
+	uint64_t sequence = 0;
+	size_t index;
+
+	local = aesd_client_local_open(path);
+	if(local == NULL)
+	{
+		fprintf(stderr, "Failed to open local transport %s\n", path);
+		return -1;
+	}
+
+	for(index = 0; index < packets; index++)
+	{
+		if(aesd_client_local_send(local, packet, size, &sequence) != 0)
+		{
+			failed++;
+			continue;
+		}
+		if(sequence % inflight == 0 && aesd_client_local_wait(local, sequence, NULL) != 0)
+			break;
+	}
+	if(aesd_client_local_wait(local, sequence, NULL) == 0)
+		completed = sequence;
+
+	aesd_client_local_close(local);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct aesd_client_options options;
+	struct aesd_client_pool *pool;
+	struct timespec start;
+	const char *host = BENCH_DEFAULT_HOST;
+	const char *port = BENCH_DEFAULT_PORT;
+	const char *local_path = NULL;
+	const char *mode;
+	size_t packets = BENCH_DEFAULT_PACKETS;
+	size_t size = BENCH_DEFAULT_SIZE;
+	size_t index;
+	bool legacy = false;
+	char *packet;
+	double seconds;
+	int opt;
+
+	aesd_client_options_init(&options);
+
+	while((opt = getopt(argc, argv, "h:p:c:w:n:s:rlU:")) != -1)
+	{
+		switch(opt)
+		{
+			case 'h': host = optarg; break;
+			case 'p': port = optarg; break;
+			case 'c': options.connections = strtoul(optarg, NULL, 10); break;
+			case 'w': options.max_inflight = strtoul(optarg, NULL, 10); break;
+			case 'n': packets = strtoul(optarg, NULL, 10); break;
+			case 's': size = strtoul(optarg, NULL, 10); break;
+			case 'r': options.replay = true; break;
+			case 'l': legacy = true; break;
+			case 'U': local_path = optarg; break;
+			default:
+				fprintf(stderr, "usage: %s [-h host] [-p port] [-c connections] [-w inflight] "
+						"[-n packets] [-s size] [-r] [-l] [-U path]\n", argv[0]);
+				return EXIT_FAILURE;
+		}
+	}
+	if(size < 1)
+		size = 1;
+	if(options.max_inflight < 1)
+		options.max_inflight = 1;
+
+	packet = malloc(size);
+	if(packet == NULL)
+		return EXIT_FAILURE;
+	memset(packet, 'x', size - 1);
+	packet[size - 1] = '\n';
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	if(local_path != NULL)
+	{
+		if(send_local(local_path, packet, size, packets, options.max_inflight) != 0)
+		{
+			free(packet);
+			return EXIT_FAILURE;
+		}
+	}
+	else if(legacy)
+	{
+		for(index = 0; index < packets; index++)
+		{
+			if(send_legacy(host, port, packet, size) == 0)
+				completed++;
+			else
+				failed++;
+		}
+	}
+	else
+	{
+		pool = aesd_client_pool_create(host, port, &options);
+		if(pool == NULL)
+		{
+			fprintf(stderr, "Failed to connect to %s:%s\n", host, port);
+			free(packet);
+			return EXIT_FAILURE;
+		}
+
+		for(index = 0; index < packets; index++)
+		{
+			if(aesd_client_send(pool, packet, size, on_complete, NULL) != 0)
+				failed++;
+		}
+		aesd_client_flush(pool);
+		aesd_client_pool_destroy(pool);
+	}
+
+	seconds = elapsed_seconds(&start);
+	if(local_path != NULL)
+		mode = "local";
+	else if(legacy)
+		mode = "legacy";
+	else
+		mode = options.replay ? "pipeline-replay" : "pipeline";
+
+	printf("mode=%s connections=%u inflight=%u size=%zu packets=%zu failed=%zu seconds=%.3f "
+			"packets_per_sec=%.0f usec_per_packet=%.2f\n",
+			mode, (legacy || local_path) ? 1 : options.connections, legacy ? 1 : options.max_inflight,
+			size, completed, failed, seconds, completed / seconds,
+			completed ? seconds * 1e6 / completed : 0.0);
+
+	free(packet);
+	return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,268 @@
+/**
+ * @file aesd-client-local.c
+ * @brief Shared memory ring producer for the aesdsocket local transport
+ *
+ * The client writes records straight into the ring mapped from the server's memfd
+ * and only makes a syscall when the server is asleep, or when it has to wait for
+ * ring space or a commit itself.  See aesd-shm-ring.h for the layout.
+ *
+ * @author Chris Choi
+ * @date 2021-10-19
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+
+#include "aesd-client.h"
+#include "aesd-shm-ring.h"
+
+struct aesd_client_local
+{
+	/**
+	 * UNIX socket, kept open for the life of the ring so each side sees the other hang up
+	 */
+	int sock;
+	int fds[AESD_SHM_RING_FDS];
+	struct aesd_shm_ring_header *header;
+	size_t map_size;
+	/**
+	 * Producer position, mirrored to header->head on every publish
+	 */
+	uint64_t head;
+	/**
+	 * Number of records published
+	 */
+	uint64_t sent;
+};
+
+static int local_receive_fds(struct aesd_client_local *local)
+{
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	uint32_t capacity;
+	char cmsg_buffer[CMSG_SPACE(sizeof(int) * AESD_SHM_RING_FDS)];
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &capacity;
+	iov.iov_len = sizeof(capacity);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cmsg_buffer;
+	msg.msg_controllen = sizeof(cmsg_buffer);
+
+	if(recvmsg(local->sock, &msg, MSG_CMSG_CLOEXEC) != sizeof(capacity))
+		return -1;
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if(cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+			cmsg->cmsg_len != CMSG_LEN(sizeof(int) * AESD_SHM_RING_FDS))
+		return -1;
+	memcpy(local->fds, CMSG_DATA(cmsg), sizeof(int) * AESD_SHM_RING_FDS);
+
+	local->map_size = AESD_SHM_RING_HEADER_SIZE + capacity;
+	return 0;
+}
+
+/**
+ * Connects to the server's local transport socket at @param path and maps the ring it hands out
+ * @return the producer handle, or NULL on failure
+ */
+struct aesd_client_local *aesd_client_local_open(const char *path)
+{
+	struct aesd_client_local *local;
+	struct sockaddr_un addr;
+	struct stat st;
+	int index;
+
+	if(strlen(path) >= sizeof(addr.sun_path))
+		return NULL;
+
+	local = calloc(1, sizeof(*local));
+	if(local == NULL)
+		return NULL;
+	local->header = MAP_FAILED;
+	for(index = 0; index < AESD_SHM_RING_FDS; index++)
+		local->fds[index] = -1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	local->sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(local->sock < 0 || connect(local->sock, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+			local_receive_fds(local) != 0)
+		goto fail;
+
+	if(fstat(local->fds[AESD_SHM_RING_FD_MEM], &st) != 0 || (size_t)st.st_size < local->map_size)
+		goto fail;
+
+	local->header = mmap(NULL, local->map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			local->fds[AESD_SHM_RING_FD_MEM], 0);
+	if(local->header == MAP_FAILED || local->header->magic != AESD_SHM_RING_MAGIC ||
+			local->header->capacity != local->map_size - AESD_SHM_RING_HEADER_SIZE)
+		goto fail;
+
+	local->head = atomic_load(&local->header->head);
+	return local;
+
+fail:
+	aesd_client_local_close(local);
+	return NULL;
+}
+
+/**
+ * Unmaps the ring and disconnects.  Records not yet committed may be dropped.
+ */
+void aesd_client_local_close(struct aesd_client_local *local)
+{
+	int index;
+
+	if(local == NULL)
+		return;
+
+	if(local->header != MAP_FAILED)
+		munmap(local->header, local->map_size);
+	for(index = 0; index < AESD_SHM_RING_FDS; index++)
+	{
+		if(local->fds[index] >= 0)
+			close(local->fds[index]);
+	}
+	if(local->sock >= 0)
+		close(local->sock);
+	free(local);
+}
+
+static bool local_has_space(struct aesd_client_local *local, uint64_t need)
+{
+	return local->header->capacity - (local->head - atomic_load(&local->header->tail)) >= need;
+}
+
+static bool local_is_committed(struct aesd_client_local *local, uint64_t sequence)
+{
+	return atomic_load(&local->header->committed) >= sequence;
+}
+
+/**
+ * Spins briefly, then sleeps on the ack eventfd until @param ready holds for @param arg
+ * @return 0, or -ECONNRESET if the server went away
+ */
+static int local_wait_for(struct aesd_client_local *local,
+			bool (*ready)(struct aesd_client_local *, uint64_t), uint64_t arg)
+{
+	struct pollfd fds[2];
+	eventfd_t value;
+	int spin;
+
+	for(spin = 0; spin < aesd_shm_ring_spin_limit(); spin++)
+	{
+		if(ready(local, arg))
+			return 0;
+	}
+
+	for(;;)
+	{
+		//publish that we sleep before the final check, the server checks the flag after committing
+		atomic_store(&local->header->producer_waiting, 1);
+		if(ready(local, arg))
+			break;
+
+		fds[0].fd = local->fds[AESD_SHM_RING_FD_ACK];
+		fds[0].events = POLLIN;
+		fds[1].fd = local->sock;
+		fds[1].events = POLLIN;
+		if(poll(fds, 2, -1) < 0 && errno != EINTR)
+			break;
+		if(fds[1].revents != 0)
+		{
+			atomic_store(&local->header->producer_waiting, 0);
+			return -ECONNRESET;
+		}
+		if(fds[0].revents & POLLIN)
+			eventfd_read(local->fds[AESD_SHM_RING_FD_ACK], &value);
+	}
+	atomic_store(&local->header->producer_waiting, 0);
+	return 0;
+}
+
+/**
+ * Publishes @param packet to the ring, adding a trailing newline when missing.  Waits only
+ * if the ring is full.
+ * @param sequence set to the packet's sequence number, to pass to aesd_client_local_wait
+ * @return 0, -EINVAL for an embedded newline, -EMSGSIZE if the packet exceeds half the ring,
+ *      or -ECONNRESET if the server went away
+ */
+int aesd_client_local_send(struct aesd_client_local *local, const char *packet, size_t size,
+			uint64_t *sequence)
+{
+	struct aesd_shm_ring_header *header = local->header;
+	char *data = aesd_shm_ring_data(header);
+	bool terminated;
+	uint32_t length;
+	uint32_t pad = AESD_SHM_RING_PAD;
+	size_t record;
+	size_t position;
+	size_t contiguous;
+	int status;
+
+	terminated = (size > 0 && packet[size - 1] == '\n');
+	if(memchr(packet, '\n', terminated ? size - 1 : size) != NULL)
+		return -EINVAL;
+
+	length = size + (terminated ? 0 : 1);
+	record = aesd_shm_ring_record_size(length);
+	if(record > header->capacity / 2)
+		return -EMSGSIZE;
+
+	position = local->head & (header->capacity - 1);
+	contiguous = header->capacity - position;
+
+	status = local_wait_for(local, local_has_space, contiguous < record ? contiguous + record : record);
+	if(status != 0)
+		return status;
+
+	//records never straddle the end of the ring
+	if(contiguous < record)
+	{
+		memcpy(&data[position], &pad, sizeof(pad));
+		local->head += contiguous;
+		position = 0;
+	}
+
+	memcpy(&data[position], &length, sizeof(length));
+	memcpy(&data[position + sizeof(length)], packet, size);
+	if(!terminated)
+		data[position + sizeof(length) + size] = '\n';
+	local->head += record;
+
+	atomic_store(&header->head, local->head);
+	if(atomic_load(&header->consumer_waiting))
+		eventfd_write(local->fds[AESD_SHM_RING_FD_DATA], 1);
+
+	*sequence = ++local->sent;
+	return 0;
+}
+
+/**
+ * Waits until the packet numbered @param sequence has been appended to the server log
+ * @param end_offset if not NULL, set to the log size at or after that commit
+ * @return 0, or -ECONNRESET if the server went away
+ */
+int aesd_client_local_wait(struct aesd_client_local *local, uint64_t sequence, off_t *end_offset)
+{
+	int status;
+
+	status = local_wait_for(local, local_is_committed, sequence);
+	if(status == 0 && end_offset != NULL)
+		*end_offset = atomic_load(&local->header->commit_offset);
+	return status;
+}
@@ -0,0 +1,627 @@
+/**
+ * @file aesd-client.c
+ * @brief Pooled, pipelined client for aesdsocket
+ *
+ * Each pooled connection opens with "AESDSOCKET_PIPELINE:<replay>\n".  From then on
+ * the server answers every packet, in order, with its commit offset as a decimal line,
+ * followed by that many bytes of the log when replay was requested.  Sends are
+ * buffered and written without blocking, so callers can keep up to max_inflight
+ * packets outstanding per connection and collect completions from a poll loop.
+ *
+ * @author Chris Choi
+ * @date 2021-10-19
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "aesd-client.h"
+
+#define AESD_CLIENT_DEFAULT_CONNECTIONS 4
+#define AESD_CLIENT_DEFAULT_INFLIGHT 64
+#define AESD_CLIENT_INPUT_SIZE 4096
+#define AESD_CLIENT_PIPELINE_COMMAND "AESDSOCKET_PIPELINE:"
+
+struct aesd_client_completion
+{
+	aesd_client_callback callback;
+	void *arg;
+};
+
+struct aesd_client_conn
+{
+	/**
+	 * Socket, or -1 while disconnected
+	 */
+	int fd;
+	/**
+	 * Bytes queued for the socket, out_sent of which have been written
+	 */
+	char *out;
+	size_t out_len;
+	size_t out_sent;
+	size_t out_size;
+	/**
+	 * Ring of callbacks for unacknowledged packets, oldest at head
+	 */
+	struct aesd_client_completion *inflight;
+	unsigned int head;
+	unsigned int count;
+	/**
+	 * Received bytes not yet parsed
+	 */
+	char in[AESD_CLIENT_INPUT_SIZE];
+	size_t in_len;
+	/**
+	 * Replay being collected for the packet at head
+	 */
+	bool in_replay;
+	off_t ack_offset;
+	char *replay;
+	size_t replay_len;
+	size_t replay_size;
+	/**
+	 * Negative errno the packets in flight fail with at the next poll or dispatch, when the
+	 * connection failed inside aesd_client_send; 0 otherwise
+	 */
+	int failed;
+};
+
+struct aesd_client_pool
+{
+	char *host;
+	char *port;
+	struct aesd_client_options options;
+	struct aesd_client_conn *conns;
+	struct pollfd *fds;
+	unsigned int next;
+};
+
+/**
+ * Fills @param options with the library defaults
+ */
+void aesd_client_options_init(struct aesd_client_options *options)
+{
+	memset(options, 0, sizeof(*options));
+	options->connections = AESD_CLIENT_DEFAULT_CONNECTIONS;
+	options->max_inflight = AESD_CLIENT_DEFAULT_INFLIGHT;
+	options->replay = false;
+}
+
+static int queue_output(struct aesd_client_conn *conn, const char *data, size_t size)
+{
+	char *temp;
+	size_t new_size;
+
+	if(conn->out_size - conn->out_len < size)
+	{
+		new_size = conn->out_size ? conn->out_size : AESD_CLIENT_INPUT_SIZE;
+		while(new_size - conn->out_len < size)
+			new_size *= 2;
+
+		temp = realloc(conn->out, new_size);
+		if(temp == NULL)
+			return -ENOMEM;
+		conn->out = temp;
+		conn->out_size = new_size;
+	}
+	memcpy(&conn->out[conn->out_len], data, size);
+	conn->out_len += size;
+	return 0;
+}
+
+/**
+ * Closes @param conn, leaving the packets waiting for an ack to conn_fail
+ */
+static void conn_close(struct aesd_client_conn *conn)
+{
+	if(conn->fd >= 0)
+		close(conn->fd);
+	conn->fd = -1;
+	conn->out_len = 0;
+	conn->out_sent = 0;
+	conn->in_len = 0;
+	conn->in_replay = false;
+	conn->replay_len = 0;
+}
+
+/**
+ * Closes @param conn and fails every packet still waiting for an ack with @param status
+ */
+static void conn_fail(struct aesd_client_pool *pool, struct aesd_client_conn *conn, int status)
+{
+	struct aesd_client_completion completion;
+
+	conn_close(conn);
+	conn->failed = 0;
+
+	while(conn->count > 0)
+	{
+		completion = conn->inflight[conn->head];
+		conn->head = (conn->head + 1) % pool->options.max_inflight;
+		conn->count--;
+		if(completion.callback != NULL)
+			completion.callback(completion.arg, status, 0, NULL, 0);
+	}
+	conn->head = 0;
+}
+
+static int conn_open(struct aesd_client_pool *pool, struct aesd_client_conn *conn)
+{
+	struct addrinfo hints;
+	struct addrinfo *res;
+	struct addrinfo *ai;
+	char command[sizeof(AESD_CLIENT_PIPELINE_COMMAND) + 2];
+	int one = 1;
+	int status = -ECONNREFUSED;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if(getaddrinfo(pool->host, pool->port, &hints, &res) != 0)
+		return -EHOSTUNREACH;
+
+	for(ai = res; ai != NULL; ai = ai->ai_next)
+	{
+		conn->fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if(conn->fd < 0)
+		{
+			status = -errno;
+			continue;
+		}
+		if(connect(conn->fd, ai->ai_addr, ai->ai_addrlen) == 0)
+			break;
+		status = -errno;
+		close(conn->fd);
+		conn->fd = -1;
+	}
+	freeaddrinfo(res);
+	if(conn->fd < 0)
+		return status;
+
+	setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	fcntl(conn->fd, F_SETFL, fcntl(conn->fd, F_GETFL) | O_NONBLOCK);
+
+	snprintf(command, sizeof(command), "%s%d\n", AESD_CLIENT_PIPELINE_COMMAND, pool->options.replay ? 1 : 0);
+	return queue_output(conn, command, strlen(command));
+}
+
+/**
+ * Writes as much queued output as the socket accepts
+ * @return 0, or a negative errno if the connection failed; the caller fails it
+ */
+static int conn_flush(struct aesd_client_conn *conn)
+{
+	ssize_t sent;
+
+	while(conn->out_sent < conn->out_len)
+	{
+		sent = send(conn->fd, &conn->out[conn->out_sent], conn->out_len - conn->out_sent,
+				MSG_NOSIGNAL | MSG_DONTWAIT);
+		if(sent < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			if(errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			return -errno;
+		}
+		conn->out_sent += sent;
+	}
+	conn->out_len = 0;
+	conn->out_sent = 0;
+	return 0;
+}
+
+static void conn_complete(struct aesd_client_pool *pool, struct aesd_client_conn *conn,
+			const char *replay, size_t replay_size)
+{
+	struct aesd_client_completion completion = conn->inflight[conn->head];
+
+	conn->head = (conn->head + 1) % pool->options.max_inflight;
+	conn->count--;
+	if(completion.callback != NULL)
+		completion.callback(completion.arg, 0, conn->ack_offset, replay, replay_size);
+}
+
+/**
+ * Consumes acks and replays from conn->in
+ * @return the number of packets completed, or -1 if the stream was malformed
+ */
+static int conn_parse(struct aesd_client_pool *pool, struct aesd_client_conn *conn)
+{
+	size_t consumed = 0;
+	size_t length;
+	char *newline;
+	char *temp;
+	int completed = 0;
+
+	while(consumed < conn->in_len)
+	{
+		if(!conn->in_replay)
+		{
+			newline = memchr(&conn->in[consumed], '\n', conn->in_len - consumed);
+			if(newline == NULL)
+				break;
+			if(conn->count == 0)
+				return -1;
+
+			*newline = '\0';
+			conn->ack_offset = strtoll(&conn->in[consumed], NULL, 10);
+			consumed = newline - conn->in + 1;
+
+			if(!pool->options.replay)
+			{
+				conn_complete(pool, conn, NULL, 0);
+				completed++;
+				continue;
+			}
+
+			if(conn->replay_size < (size_t)conn->ack_offset)
+			{
+				temp = realloc(conn->replay, conn->ack_offset);
+				if(temp == NULL)
+					return -1;
+				conn->replay = temp;
+				conn->replay_size = conn->ack_offset;
+			}
+			conn->in_replay = true;
+			conn->replay_len = 0;
+		}
+
+		length = conn->ack_offset - conn->replay_len;
+		if(length > conn->in_len - consumed)
+			length = conn->in_len - consumed;
+		memcpy(&conn->replay[conn->replay_len], &conn->in[consumed], length);
+		conn->replay_len += length;
+		consumed += length;
+
+		if(conn->replay_len == (size_t)conn->ack_offset)
+		{
+			conn->in_replay = false;
+			conn_complete(pool, conn, conn->replay, conn->replay_len);
+			completed++;
+		}
+	}
+
+	//an ack line longer than the input buffer can only be garbage
+	if(consumed == 0 && conn->in_len == sizeof(conn->in))
+		return -1;
+
+	memmove(conn->in, &conn->in[consumed], conn->in_len - consumed);
+	conn->in_len -= consumed;
+	return completed;
+}
+
+static int conn_read(struct aesd_client_pool *pool, struct aesd_client_conn *conn)
+{
+	ssize_t received;
+	int completed = 0;
+	int parsed;
+
+	for(;;)
+	{
+		received = recv(conn->fd, &conn->in[conn->in_len], sizeof(conn->in) - conn->in_len, MSG_DONTWAIT);
+		if(received < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			if(errno == EAGAIN || errno == EWOULDBLOCK)
+				return completed;
+			conn_fail(pool, conn, -errno);
+			return completed;
+		}
+		if(received == 0)
+		{
+			conn_fail(pool, conn, -ECONNRESET);
+			return completed;
+		}
+
+		conn->in_len += received;
+		parsed = conn_parse(pool, conn);
+		if(parsed < 0)
+		{
+			conn_fail(pool, conn, -EPROTO);
+			return completed;
+		}
+		completed += parsed;
+	}
+}
+
+/**
+ * Runs the callbacks of packets whose connection failed inside aesd_client_send
+ */
+static void pool_fail_deferred(struct aesd_client_pool *pool)
+{
+	unsigned int index;
+
+	for(index = 0; index < pool->options.connections; index++)
+	{
+		if(pool->conns[index].failed != 0)
+			conn_fail(pool, &pool->conns[index], pool->conns[index].failed);
+	}
+}
+
+static void pool_free(struct aesd_client_pool *pool)
+{
+	unsigned int index;
+
+	if(pool->conns != NULL)
+	{
+		for(index = 0; index < pool->options.connections; index++)
+		{
+			free(pool->conns[index].out);
+			free(pool->conns[index].inflight);
+			free(pool->conns[index].replay);
+		}
+	}
+	free(pool->conns);
+	free(pool->fds);
+	free(pool->host);
+	free(pool->port);
+	free(pool);
+}
+
+/**
+ * Creates a pool and connects all of its connections.
+ * @param options pool configuration, or NULL for the defaults from aesd_client_options_init
+ * @return the pool, or NULL if any connection failed
+ */
+struct aesd_client_pool *aesd_client_pool_create(const char *host, const char *port,
+			const struct aesd_client_options *options)
+{
+	struct aesd_client_pool *pool;
+	unsigned int index;
+
+	pool = calloc(1, sizeof(*pool));
+	if(pool == NULL)
+		return NULL;
+
+	if(options != NULL)
+		pool->options = *options;
+	else
+		aesd_client_options_init(&pool->options);
+	if(pool->options.connections == 0 || pool->options.max_inflight == 0)
+	{
+		free(pool);
+		return NULL;
+	}
+
+	pool->host = strdup(host);
+	pool->port = strdup(port);
+	pool->conns = calloc(pool->options.connections, sizeof(*pool->conns));
+	pool->fds = calloc(pool->options.connections, sizeof(*pool->fds));
+	if(pool->host == NULL || pool->port == NULL || pool->conns == NULL || pool->fds == NULL)
+	{
+		pool_free(pool);
+		return NULL;
+	}
+
+	for(index = 0; index < pool->options.connections; index++)
+		pool->conns[index].fd = -1;
+
+	for(index = 0; index < pool->options.connections; index++)
+	{
+		pool->conns[index].inflight = calloc(pool->options.max_inflight, sizeof(struct aesd_client_completion));
+		if(pool->conns[index].inflight == NULL || conn_open(pool, &pool->conns[index]) != 0)
+		{
+			aesd_client_pool_destroy(pool);
+			return NULL;
+		}
+	}
+	return pool;
+}
+
+/**
+ * Closes every connection.  Packets still in flight complete with -ECANCELED.
+ */
+void aesd_client_pool_destroy(struct aesd_client_pool *pool)
+{
+	struct aesd_client_conn *conn;
+	unsigned int index;
+
+	if(pool == NULL)
+		return;
+
+	for(index = 0; index < pool->options.connections; index++)
+	{
+		conn = &pool->conns[index];
+		conn_fail(pool, conn, conn->failed ? conn->failed : -ECANCELED);
+	}
+	pool_free(pool);
+}
+
+/**
+ * Queues @param packet on the next connection with room and writes as much as the socket accepts.
+ * A trailing newline is added when missing.  Blocks in aesd_client_poll only while every
+ * connection has max_inflight packets outstanding, and only then runs callbacks of earlier
+ * packets before returning.
+ * @return 0 when queued, -EINVAL if the packet contains an embedded newline, or a negative errno
+ *      if no connection could be opened.  @param callback runs later, from aesd_client_poll or
+ *      aesd_client_dispatch, never from this call, even when the write fails at once.
+ */
+int aesd_client_send(struct aesd_client_pool *pool, const char *packet, size_t size,
+			aesd_client_callback callback, void *arg)
+{
+	struct aesd_client_conn *conn = NULL;
+	unsigned int index;
+	unsigned int slot;
+	bool terminated;
+	int status;
+
+	terminated = (size > 0 && packet[size - 1] == '\n');
+	if(memchr(packet, '\n', terminated ? size - 1 : size) != NULL)
+		return -EINVAL;
+
+	while(conn == NULL)
+	{
+		for(index = 0; index < pool->options.connections; index++)
+		{
+			slot = (pool->next + index) % pool->options.connections;
+			//a connection that failed is not reused before its packets have failed
+			if(pool->conns[slot].failed == 0 && pool->conns[slot].count < pool->options.max_inflight)
+			{
+				conn = &pool->conns[slot];
+				pool->next = (slot + 1) % pool->options.connections;
+				break;
+			}
+		}
+		if(conn == NULL && aesd_client_poll(pool, -1) < 0)
+			return -errno;
+	}
+
+	if(conn->fd < 0)
+	{
+		status = conn_open(pool, conn);
+		if(status != 0)
+			return status;
+	}
+
+	status = queue_output(conn, packet, size);
+	if(status == 0 && !terminated)
+		status = queue_output(conn, "\n", 1);
+	if(status != 0)
+		return status;
+
+	conn->inflight[(conn->head + conn->count) % pool->options.max_inflight] =
+		(struct aesd_client_completion){ .callback = callback, .arg = arg };
+	conn->count++;
+
+	//the packet is queued, so a failed write is reported through the callbacks once polled
+	status = conn_flush(conn);
+	if(status != 0)
+	{
+		conn_close(conn);
+		conn->failed = status;
+	}
+	return 0;
+}
+
+/**
+ * Fills @param fds with the sockets that have packets in flight or output pending, for use
+ * with an external poll loop.  Pass the same array to aesd_client_dispatch after polling.
+ * @return the number of entries filled, at most @param nfds
+ */
+size_t aesd_client_pollfds(struct aesd_client_pool *pool, struct pollfd *fds, size_t nfds)
+{
+	struct aesd_client_conn *conn;
+	unsigned int index;
+	size_t filled = 0;
+
+	for(index = 0; index < pool->options.connections && filled < nfds; index++)
+	{
+		conn = &pool->conns[index];
+		if(conn->fd < 0 || (conn->count == 0 && conn->out_len == 0))
+			continue;
+
+		fds[filled].fd = conn->fd;
+		fds[filled].events = POLLIN;
+		if(conn->out_sent < conn->out_len)
+			fds[filled].events |= POLLOUT;
+		fds[filled].revents = 0;
+		filled++;
+	}
+	return filled;
+}
+
+/**
+ * Handles the readiness reported in @param fds, writing queued output and running the
+ * callbacks of acknowledged packets, and of packets whose connection failed in
+ * aesd_client_send.  Call it after every poll, even one that reported nothing ready.
+ * @return the number of packets completed successfully
+ */
+int aesd_client_dispatch(struct aesd_client_pool *pool, const struct pollfd *fds, size_t nfds)
+{
+	struct aesd_client_conn *conn;
+	unsigned int index;
+	size_t fd_index;
+	int completed = 0;
+	int status;
+
+	pool_fail_deferred(pool);
+
+	for(fd_index = 0; fd_index < nfds; fd_index++)
+	{
+		if(fds[fd_index].revents == 0)
+			continue;
+
+		for(index = 0; index < pool->options.connections; index++)
+		{
+			conn = &pool->conns[index];
+			if(conn->fd != fds[fd_index].fd)
+				continue;
+
+			if(fds[fd_index].revents & POLLOUT)
+			{
+				status = conn_flush(conn);
+				if(status != 0)
+				{
+					conn_fail(pool, conn, status);
+					break;
+				}
+			}
+			if(fds[fd_index].revents & (POLLIN | POLLERR | POLLHUP))
+				completed += conn_read(pool, conn);
+			break;
+		}
+	}
+	return completed;
+}
+
+/**
+ * Polls the pool's own sockets for up to @param timeout_ms and dispatches the result
+ * @return the number of packets completed, or -1 with errno set if poll failed
+ */
+int aesd_client_poll(struct aesd_client_pool *pool, int timeout_ms)
+{
+	size_t nfds;
+	int ready;
+
+	pool_fail_deferred(pool);
+
+	nfds = aesd_client_pollfds(pool, pool->fds, pool->options.connections);
+	if(nfds == 0)
+		return 0;
+
+	ready = poll(pool->fds, nfds, timeout_ms);
+	if(ready < 0)
+		return errno == EINTR ? 0 : -1;
+
+	return aesd_client_dispatch(pool, pool->fds, nfds);
+}
+
+/**
+ * Waits until every queued packet has completed
+ * @return 0, or -1 with errno set if poll failed
+ */
+int aesd_client_flush(struct aesd_client_pool *pool)
+{
+	while(aesd_client_inflight(pool) > 0)
+	{
+		if(aesd_client_poll(pool, -1) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+/**
+ * @return the number of packets sent but not yet completed
+ */
+size_t aesd_client_inflight(const struct aesd_client_pool *pool)
+{
+	unsigned int index;
+	size_t inflight = 0;
+
+	for(index = 0; index < pool->options.connections; index++)
+		inflight += pool->conns[index].count;
+	return inflight;
+}
@@ -0,0 +1,86 @@
+/*
+ * aesd-client.h
+ *
+ * Client library for aesdsocket.  Packets are sent over a pool of persistent
+ * connections which are switched to pipeline mode with the in-band
+ * AESDSOCKET_PIPELINE command, so many packets can be in flight per connection
+ * and completions are reported through a callback.  Producers on the same host
+ * can instead use aesd_client_local_*, which hands packets to the server through
+ * a shared memory ring obtained from its UNIX socket (aesdsocket -u).
+ *
+ *  Created on: October 19, 2021
+ *      Author: Chris Choi
+ */
+
+#ifndef AESD_CLIENT_H
+#define AESD_CLIENT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <poll.h>
+#include <sys/types.h>
+
+struct aesd_client_pool;
+
+/**
+ * Invoked once per packet, in send order for each connection, from aesd_client_poll or
+ * aesd_client_dispatch.
+ * @param arg the value passed to aesd_client_send
+ * @param status 0 on success or a negative errno if the connection failed before the ack arrived
+ * @param end_offset the size of the server log right after this packet was committed
+ * @param replay the server log up to end_offset when the pool replays, otherwise NULL.  Only valid
+ *      for the duration of the callback.
+ * @param replay_size number of bytes in replay
+ */
+typedef void (*aesd_client_callback)(void *arg, int status, off_t end_offset,
+			const char *replay, size_t replay_size);
+
+struct aesd_client_options
+{
+	/**
+	 * Number of persistent connections in the pool
+	 */
+	unsigned int connections;
+	/**
+	 * Maximum number of unacknowledged packets per connection before aesd_client_send waits
+	 */
+	unsigned int max_inflight;
+	/**
+	 * Ask the server to send the log back after every packet.  Off by default.
+	 */
+	bool replay;
+};
+
+extern void aesd_client_options_init(struct aesd_client_options *options);
+
+extern struct aesd_client_pool *aesd_client_pool_create(const char *host, const char *port,
+			const struct aesd_client_options *options);
+
+extern void aesd_client_pool_destroy(struct aesd_client_pool *pool);
+
+extern int aesd_client_send(struct aesd_client_pool *pool, const char *packet, size_t size,
+			aesd_client_callback callback, void *arg);
+
+extern size_t aesd_client_pollfds(struct aesd_client_pool *pool, struct pollfd *fds, size_t nfds);
+
+extern int aesd_client_dispatch(struct aesd_client_pool *pool, const struct pollfd *fds, size_t nfds);
+
+extern int aesd_client_poll(struct aesd_client_pool *pool, int timeout_ms);
+
+extern int aesd_client_flush(struct aesd_client_pool *pool);
+
+extern size_t aesd_client_inflight(const struct aesd_client_pool *pool);
+
+struct aesd_client_local;
+
+extern struct aesd_client_local *aesd_client_local_open(const char *path);
+
+extern void aesd_client_local_close(struct aesd_client_local *local);
+
+extern int aesd_client_local_send(struct aesd_client_local *local, const char *packet, size_t size,
+			uint64_t *sequence);
+
+extern int aesd_client_local_wait(struct aesd_client_local *local, uint64_t sequence, off_t *end_offset);
+
+#endif /* AESD_CLIENT_H */
@@ -0,0 +1,427 @@
+/**
+ * @file aesd-coroutine.c
+ * @brief M:N coroutine scheduler built on ucontext
+ *
+ * Every worker owns an epoll instance, a run queue only it touches, and an inbox
+ * that other threads hand new coroutines to.  A coroutine waiting on a socket
+ * arms a one shot epoll registration for it and switches back to its worker,
+ * which runs whatever else is ready and sleeps in epoll_wait when nothing is.
+ * Stacks are mapped with a guard page below them and only touched pages are
+ * ever backed by memory.
+ *
+ * @author Chris Choi
+ * @date 2021-10-19
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <ucontext.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "aesd-coroutine.h"
+
+#define AESD_CO_EVENTS 64
+
+struct aesd_co_worker;
+
+struct aesd_co
+{
+	ucontext_t context;
+	struct aesd_co_worker *worker;
+	struct aesd_co *next;
+	aesd_co_function function;
+	void *arg;
+	/**
+	 * Mapping holding the guard page and the stack
+	 */
+	void *mapping;
+	size_t mapping_size;
+	/**
+	 * fd currently registered with the worker's epoll instance, -1 if none
+	 */
+	int registered_fd;
+	bool finished;
+};
+
+struct aesd_co_worker
+{
+	struct aesd_co_scheduler *scheduler;
+	pthread_t thread;
+	int epoll_fd;
+	/**
+	 * Written to wake the worker for its inbox or for shutdown
+	 */
+	int wake_fd;
+	ucontext_t context;
+	/**
+	 * Ready coroutines, touched only by the worker itself
+	 */
+	struct aesd_co *run_head;
+	struct aesd_co *run_tail;
+	/**
+	 * Coroutines spawned from other threads, not yet picked up
+	 */
+	pthread_mutex_t inbox_lock;
+	struct aesd_co *inbox;
+	/**
+	 * Coroutines owned by this worker that have not finished
+	 */
+	size_t live;
+};
+
+struct aesd_co_scheduler
+{
+	struct aesd_co_worker *workers;
+	unsigned int worker_count;
+	size_t stack_size;
+	atomic_uint next_worker;
+	atomic_bool stopping;
+};
+
+static __thread struct aesd_co *co_current;
+
+static void co_enqueue(struct aesd_co_worker *worker, struct aesd_co *co)
+{
+	co->next = NULL;
+	if(worker->run_tail != NULL)
+		worker->run_tail->next = co;
+	else
+		worker->run_head = co;
+	worker->run_tail = co;
+}
+
+static void co_free(struct aesd_co *co)
+{
+	munmap(co->mapping, co->mapping_size);
+	free(co);
+}
+
+static void co_entry(void)
+{
+	struct aesd_co *co = co_current;
+
+	co->function(co->arg);
+	co->finished = true;
+	//returning switches to uc_link, the worker
+}
+
+static void co_run(struct aesd_co_worker *worker, struct aesd_co *co)
+{
+	co_current = co;
+	swapcontext(&worker->context, &co->context);
+	co_current = NULL;
+
+	if(co->finished)
+	{
+		co_free(co);
+		worker->live--;
+	}
+}
+
+static void co_take_inbox(struct aesd_co_worker *worker)
+{
+	struct aesd_co *reversed = NULL;
+	struct aesd_co *co;
+	struct aesd_co *next;
+
+	pthread_mutex_lock(&worker->inbox_lock);
+	co = worker->inbox;
+	worker->inbox = NULL;
+	pthread_mutex_unlock(&worker->inbox_lock);
+
+	//the inbox is a stack, so reverse it to start coroutines in spawn order
+	while(co != NULL)
+	{
+		next = co->next;
+		co->next = reversed;
+		reversed = co;
+		co = next;
+	}
+	for(co = reversed; co != NULL; co = next)
+	{
+		next = co->next;
+		worker->live++;
+		co_enqueue(worker, co);
+	}
+}
+
+static void *co_worker(void *arg)
+{
+	struct aesd_co_worker *worker = arg;
+	struct epoll_event events[AESD_CO_EVENTS];
+	struct aesd_co *co;
+	eventfd_t value;
+	int count;
+	int index;
+
+	for(;;)
+	{
+		co_take_inbox(worker);
+
+		if(worker->run_head == NULL)
+		{
+			if(worker->live == 0 && atomic_load(&worker->scheduler->stopping))
+				break;
+
+			count = epoll_wait(worker->epoll_fd, events, AESD_CO_EVENTS, -1);
+			for(index = 0; index < count; index++)
+			{
+				if(events[index].data.ptr == NULL)
+					eventfd_read(worker->wake_fd, &value);
+				else
+					co_enqueue(worker, events[index].data.ptr);
+			}
+			continue;
+		}
+
+		while((co = worker->run_head) != NULL)
+		{
+			worker->run_head = co->next;
+			if(worker->run_head == NULL)
+				worker->run_tail = NULL;
+			co_run(worker, co);
+		}
+	}
+	return NULL;
+}
+
+static void co_worker_close(struct aesd_co_worker *worker)
+{
+	if(worker->epoll_fd >= 0)
+		close(worker->epoll_fd);
+	if(worker->wake_fd >= 0)
+		close(worker->wake_fd);
+	pthread_mutex_destroy(&worker->inbox_lock);
+}
+
+/**
+ * Starts @param workers threads that run coroutines with stacks of @param stack_size bytes
+ * @return the scheduler, or NULL on failure
+ */
+struct aesd_co_scheduler *aesd_co_scheduler_create(unsigned int workers, size_t stack_size)
+{
+	struct aesd_co_scheduler *scheduler;
+	struct aesd_co_worker *worker;
+	struct epoll_event event;
+	unsigned int index;
+
+	if(workers == 0)
+		return NULL;
+
+	scheduler = calloc(1, sizeof(*scheduler));
+	if(scheduler == NULL)
+		return NULL;
+	scheduler->workers = calloc(workers, sizeof(*scheduler->workers));
+	if(scheduler->workers == NULL)
+	{
+		free(scheduler);
+		return NULL;
+	}
+	scheduler->stack_size = stack_size ? stack_size : AESD_CO_DEFAULT_STACK_SIZE;
+	atomic_init(&scheduler->next_worker, 0);
+	atomic_init(&scheduler->stopping, false);
+
+	for(index = 0; index < workers; index++)
+	{
+		worker = &scheduler->workers[index];
+		worker->scheduler = scheduler;
+		pthread_mutex_init(&worker->inbox_lock, NULL);
+		worker->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		worker->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+		memset(&event, 0, sizeof(event));
+		event.events = EPOLLIN;
+		event.data.ptr = NULL;
+		if(worker->epoll_fd < 0 || worker->wake_fd < 0 ||
+				epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, worker->wake_fd, &event) != 0 ||
+				pthread_create(&worker->thread, NULL, co_worker, worker) != 0)
+		{
+			co_worker_close(worker);
+			break;
+		}
+		scheduler->worker_count++;
+	}
+
+	if(scheduler->worker_count != workers)
+	{
+		aesd_co_scheduler_destroy(scheduler);
+		return NULL;
+	}
+	return scheduler;
+}
+
+/**
+ * Waits for every coroutine to finish, then stops the workers
+ */
+void aesd_co_scheduler_destroy(struct aesd_co_scheduler *scheduler)
+{
+	unsigned int index;
+
+	atomic_store(&scheduler->stopping, true);
+	for(index = 0; index < scheduler->worker_count; index++)
+		eventfd_write(scheduler->workers[index].wake_fd, 1);
+	for(index = 0; index < scheduler->worker_count; index++)
+	{
+		pthread_join(scheduler->workers[index].thread, NULL);
+		co_worker_close(&scheduler->workers[index]);
+	}
+	free(scheduler->workers);
+	free(scheduler);
+}
+
+/**
+ * Starts @param function(@param arg) as a coroutine on the next worker, round robin
+ * @return 0 or a negative errno
+ */
+int aesd_co_spawn(struct aesd_co_scheduler *scheduler, aesd_co_function function, void *arg)
+{
+	struct aesd_co_worker *worker;
+	struct aesd_co *co;
+	long page_size = sysconf(_SC_PAGESIZE);
+
+	co = calloc(1, sizeof(*co));
+	if(co == NULL)
+		return -ENOMEM;
+
+	co->mapping_size = page_size + ((scheduler->stack_size + page_size - 1) & ~(page_size - 1));
+	co->mapping = mmap(NULL, co->mapping_size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+	if(co->mapping == MAP_FAILED)
+	{
+		free(co);
+		return -ENOMEM;
+	}
+	//stacks grow down, so an overflow hits the guard page instead of a neighbour
+	mprotect(co->mapping, page_size, PROT_NONE);
+
+	worker = &scheduler->workers[atomic_fetch_add(&scheduler->next_worker, 1) % scheduler->worker_count];
+	co->worker = worker;
+	co->function = function;
+	co->arg = arg;
+	co->registered_fd = -1;
+
+	getcontext(&co->context);
+	co->context.uc_stack.ss_sp = (char *)co->mapping + page_size;
+	co->context.uc_stack.ss_size = co->mapping_size - page_size;
+	co->context.uc_link = &worker->context;
+	makecontext(&co->context, co_entry, 0);
+
+	pthread_mutex_lock(&worker->inbox_lock);
+	co->next = worker->inbox;
+	worker->inbox = co;
+	pthread_mutex_unlock(&worker->inbox_lock);
+	eventfd_write(worker->wake_fd, 1);
+	return 0;
+}
+
+/**
+ * @return true when called from a coroutine
+ */
+bool aesd_co_active(void)
+{
+	return co_current != NULL;
+}
+
+/**
+ * Lets the other ready coroutines on this worker run.  Does nothing outside a coroutine.
+ */
+void aesd_co_yield(void)
+{
+	struct aesd_co *co = co_current;
+
+	if(co == NULL)
+		return;
+	co_enqueue(co->worker, co);
+	swapcontext(&co->context, &co->worker->context);
+}
+
+/**
+ * Suspends the calling coroutine until @param fd reports one of @param events, or blocks the
+ * thread in poll when called outside a coroutine
+ * @return 0 or a negative errno
+ */
+int aesd_co_wait_fd(int fd, uint32_t events)
+{
+	struct aesd_co *co = co_current;
+	struct epoll_event event;
+	struct pollfd poll_fd;
+	int status;
+
+	if(co == NULL)
+	{
+		poll_fd.fd = fd;
+		poll_fd.events = events;
+		return poll(&poll_fd, 1, -1) < 0 ? -errno : 0;
+	}
+
+	memset(&event, 0, sizeof(event));
+	event.events = events | EPOLLONESHOT;
+	event.data.ptr = co;
+	if(co->registered_fd == fd)
+	{
+		status = epoll_ctl(co->worker->epoll_fd, EPOLL_CTL_MOD, fd, &event);
+	}
+	else
+	{
+		//a closed fd drops out of epoll by itself, but a reused number may still be known to it
+		status = epoll_ctl(co->worker->epoll_fd, EPOLL_CTL_ADD, fd, &event);
+		if(status != 0 && errno == EEXIST)
+			status = epoll_ctl(co->worker->epoll_fd, EPOLL_CTL_MOD, fd, &event);
+		if(status == 0)
+			co->registered_fd = fd;
+	}
+	if(status != 0)
+		return -errno;
+
+	swapcontext(&co->context, &co->worker->context);
+	return 0;
+}
+
+/**
+ * recv that yields while the socket has nothing to read
+ */
+ssize_t aesd_co_recv(int fd, void *buffer, size_t size, int flags)
+{
+	ssize_t result;
+
+	if(co_current == NULL)
+		return recv(fd, buffer, size, flags);
+
+	while((result = recv(fd, buffer, size, flags | MSG_DONTWAIT)) < 0 &&
+			(errno == EAGAIN || errno == EWOULDBLOCK))
+	{
+		if(aesd_co_wait_fd(fd, EPOLLIN | EPOLLRDHUP) != 0)
+			return -1;
+	}
+	return result;
+}
+
+/**
+ * send that yields while the socket buffer is full
+ */
+ssize_t aesd_co_send(int fd, const void *buffer, size_t size, int flags)
+{
+	ssize_t result;
+
+	if(co_current == NULL)
+		return send(fd, buffer, size, flags);
+
+	while((result = send(fd, buffer, size, flags | MSG_DONTWAIT)) < 0 &&
+			(errno == EAGAIN || errno == EWOULDBLOCK))
+	{
+		if(aesd_co_wait_fd(fd, EPOLLOUT) != 0)
+			return -1;
+	}
+	return result;
+}
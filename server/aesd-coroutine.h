@@ -0,0 +1,41 @@
+/*
+ * aesd-coroutine.h
+ *
+ * Stackful coroutines on a few worker threads, so aesdsocket can keep its
+ * sequential connection handler while serving far more clients than it could
+ * with a thread each.  A coroutine stays on the worker it was spawned on, so
+ * thread local state such as errno is never carried across threads; socket
+ * calls made through aesd_co_recv and aesd_co_send yield to the worker until
+ * the socket is ready instead of blocking it.
+ *
+ *  Created on: October 19, 2021
+ *      Author: Chris Choi
+ */
+
+#ifndef AESD_COROUTINE_H
+#define AESD_COROUTINE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#define AESD_CO_DEFAULT_STACK_SIZE (64*1024)
+
+struct aesd_co_scheduler;
+
+typedef void (*aesd_co_function)(void *arg);
+
+extern struct aesd_co_scheduler *aesd_co_scheduler_create(unsigned int workers, size_t stack_size);
+extern void aesd_co_scheduler_destroy(struct aesd_co_scheduler *scheduler);
+
+extern int aesd_co_spawn(struct aesd_co_scheduler *scheduler, aesd_co_function function, void *arg);
+
+extern bool aesd_co_active(void);
+extern void aesd_co_yield(void);
+extern int aesd_co_wait_fd(int fd, uint32_t events);
+
+extern ssize_t aesd_co_recv(int fd, void *buffer, size_t size, int flags);
+extern ssize_t aesd_co_send(int fd, const void *buffer, size_t size, int flags);
+
+#endif /* AESD_COROUTINE_H */
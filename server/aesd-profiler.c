@@ -0,0 +1,443 @@
+/**
+ * @file aesd-profiler.c
+ * @brief SIGPROF sampling profiler writing folded stacks
+ *
+ * The signal handler needs no lock: it claims a slot in the buffer being
+ * filled with fetch_add, fills it, then publishes the depth with a release
+ * store.  The claim word holds the buffer in its top bit and the slots
+ * claimed below it.  The profiler thread swaps buffers often enough that the
+ * one being filled never runs out.  It waits for the old one's claimed slots
+ * to be published and folds them into counts per distinct stack, so the
+ * profile keeps growing for as long as the process runs.  Samples arriving
+ * while a buffer is full are counted as dropped.  The same thread rewrites
+ * the profile when SIGUSR1 or aesd_profiler_stop posts its semaphore.
+ *
+ * @author Chris Choi
+ * @date 2021-10-19
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <dlfcn.h>
+#include <execinfo.h>
+
+#include "aesd-profiler.h"
+
+/**
+ * Frames belonging to the signal handler and the signal trampoline
+ */
+#define AESD_PROFILER_SKIP 2
+
+/**
+ * Top bit of the claim word, set while the second sample buffer is being filled
+ */
+#define AESD_PROFILER_BUFFER_BIT (UINT64_C(1) << 63)
+
+/**
+ * Hash buckets of the folded stacks, a power of two
+ */
+#define AESD_PROFILER_BUCKETS 1024
+
+/**
+ * Longest time between folds, however slowly the buffers fill
+ */
+#define AESD_PROFILER_FOLD_MAX_NS 1000000000L
+
+struct aesd_profiler_sample
+{
+	/**
+	 * Number of frames, 0 until the sample is complete
+	 */
+	_Atomic unsigned int depth;
+	void *frame[AESD_PROFILER_DEPTH];
+};
+
+/**
+ * A distinct stack and how many samples had it, touched only by the profiler thread
+ */
+struct aesd_profiler_stack
+{
+	struct aesd_profiler_stack *next;
+	unsigned long count;
+	unsigned int depth;
+	void *frame[AESD_PROFILER_DEPTH];
+};
+
+static struct
+{
+	struct aesd_profiler_sample *samples[2];
+	_Atomic uint64_t claim;
+	atomic_ulong dropped;
+	struct aesd_profiler_stack **stacks;
+	unsigned long stack_count;
+	struct timespec fold_period;
+	const char *path;
+	timer_t timer;
+	pthread_t dumper;
+	sem_t request;
+	atomic_bool stopping;
+	bool running;
+} profiler;
+
+static void profiler_sample(int signal_number)
+{
+	void *frame[AESD_PROFILER_DEPTH + AESD_PROFILER_SKIP];
+	struct aesd_profiler_sample *sample;
+	uint64_t claim;
+	uint64_t slot;
+	int depth;
+	int saved_errno = errno;
+
+	//pairs with the exchange in profiler_fold, which emptied the slots of this buffer first
+	claim = atomic_fetch_add_explicit(&profiler.claim, 1, memory_order_acquire);
+	slot = claim & ~AESD_PROFILER_BUFFER_BIT;
+	if(slot >= AESD_PROFILER_SAMPLES)
+	{
+		atomic_fetch_add_explicit(&profiler.dropped, 1, memory_order_relaxed);
+		errno = saved_errno;
+		return;
+	}
+
+	sample = &profiler.samples[(claim & AESD_PROFILER_BUFFER_BIT) != 0][slot];
+	depth = backtrace(frame, AESD_PROFILER_DEPTH + AESD_PROFILER_SKIP) - AESD_PROFILER_SKIP;
+	if(depth <= 0)
+	{
+		frame[AESD_PROFILER_SKIP] = NULL;
+		depth = 1;
+	}
+	memcpy(sample->frame, &frame[AESD_PROFILER_SKIP], depth * sizeof(void *));
+	atomic_store_explicit(&sample->depth, depth, memory_order_release);
+	errno = saved_errno;
+}
+
+static void profiler_dump_signal(int signal_number)
+{
+	aesd_profiler_request_dump();
+}
+
+static int profiler_compare(const void *a, const void *b)
+{
+	const struct aesd_profiler_stack *left = *(const struct aesd_profiler_stack * const *)a;
+	const struct aesd_profiler_stack *right = *(const struct aesd_profiler_stack * const *)b;
+
+	if(left->depth != right->depth)
+		return left->depth < right->depth ? -1 : 1;
+	return memcmp(left->frame, right->frame, left->depth * sizeof(void *));
+}
+
+static unsigned int profiler_hash(void * const *frame, unsigned int depth)
+{
+	uint64_t hash = UINT64_C(14695981039346656037);
+	unsigned int index;
+
+	for(index = 0; index < depth; index++)
+		hash = (hash ^ (uintptr_t)frame[index]) * UINT64_C(1099511628211);
+	return (hash ^ (hash >> 32)) & (AESD_PROFILER_BUCKETS - 1);
+}
+
+/**
+ * Counts a sample of @param depth frames in the folded stacks
+ * @return 0 or -ENOMEM
+ */
+static int profiler_count(void * const *frame, unsigned int depth)
+{
+	struct aesd_profiler_stack **bucket = &profiler.stacks[profiler_hash(frame, depth)];
+	struct aesd_profiler_stack *stack;
+
+	for(stack = *bucket; stack != NULL; stack = stack->next)
+	{
+		if(stack->depth == depth && memcmp(stack->frame, frame, depth * sizeof(void *)) == 0)
+		{
+			stack->count++;
+			return 0;
+		}
+	}
+
+	stack = malloc(sizeof(*stack));
+	if(stack == NULL)
+		return -ENOMEM;
+	stack->count = 1;
+	stack->depth = depth;
+	memcpy(stack->frame, frame, depth * sizeof(void *));
+	stack->next = *bucket;
+	*bucket = stack;
+	profiler.stack_count++;
+	return 0;
+}
+
+/**
+ * Swaps the sample buffers and folds every sample of the one that was being filled into the
+ * stack counts, leaving it empty for the next swap
+ */
+static void profiler_fold(void)
+{
+	struct aesd_profiler_sample *samples;
+	struct aesd_profiler_sample *sample;
+	uint64_t claim = atomic_load(&profiler.claim);
+	uint64_t count;
+	uint64_t index;
+	unsigned int depth;
+
+	//the exchange returns how many slots of the old buffer were claimed, new samples go to the other
+	claim = atomic_exchange_explicit(&profiler.claim, (claim & AESD_PROFILER_BUFFER_BIT) ^
+			AESD_PROFILER_BUFFER_BIT, memory_order_acq_rel);
+	samples = profiler.samples[(claim & AESD_PROFILER_BUFFER_BIT) != 0];
+	count = claim & ~AESD_PROFILER_BUFFER_BIT;
+	if(count > AESD_PROFILER_SAMPLES)
+		count = AESD_PROFILER_SAMPLES;
+
+	for(index = 0; index < count; index++)
+	{
+		sample = &samples[index];
+		//a handler that claimed the slot before the exchange is about to publish it
+		while((depth = atomic_load_explicit(&sample->depth, memory_order_acquire)) == 0)
+			sched_yield();
+		if(profiler_count(sample->frame, depth) != 0)
+			atomic_fetch_add_explicit(&profiler.dropped, 1, memory_order_relaxed);
+		atomic_store_explicit(&sample->depth, 0, memory_order_relaxed);
+	}
+}
+
+static void profiler_write_frame(FILE *out, void *address)
+{
+	Dl_info info;
+	const char *module;
+
+	if(address != NULL && dladdr(address, &info) != 0)
+	{
+		if(info.dli_sname != NULL)
+		{
+			fputs(info.dli_sname, out);
+			return;
+		}
+		if(info.dli_fname != NULL)
+		{
+			module = strrchr(info.dli_fname, '/');
+			fprintf(out, "%s+0x%lx", module ? module + 1 : info.dli_fname,
+					(unsigned long)((char *)address - (char *)info.dli_fbase));
+			return;
+		}
+	}
+	fprintf(out, "0x%lx", (unsigned long)address);
+}
+
+/**
+ * Writes the stack counts to the profile file as folded stacks, root frame first
+ */
+static int profiler_dump(void)
+{
+	struct aesd_profiler_stack **sorted;
+	struct aesd_profiler_stack *stack;
+	unsigned long used = 0;
+	unsigned long index;
+	int frame;
+	FILE *out;
+
+	profiler_fold();
+
+	sorted = malloc((profiler.stack_count ? profiler.stack_count : 1) * sizeof(*sorted));
+	if(sorted == NULL)
+		return -ENOMEM;
+	for(index = 0; index < AESD_PROFILER_BUCKETS; index++)
+	{
+		for(stack = profiler.stacks[index]; stack != NULL; stack = stack->next)
+			sorted[used++] = stack;
+	}
+	//sorted like flamegraph.pl's input, so consecutive dumps diff cleanly
+	qsort(sorted, used, sizeof(*sorted), profiler_compare);
+
+	out = fopen(profiler.path, "w");
+	if(out == NULL)
+	{
+		free(sorted);
+		return -errno;
+	}
+
+	for(index = 0; index < used; index++)
+	{
+		for(frame = sorted[index]->depth - 1; frame >= 0; frame--)
+		{
+			profiler_write_frame(out, sorted[index]->frame[frame]);
+			fputc(frame ? ';' : ' ', out);
+		}
+		fprintf(out, "%lu\n", sorted[index]->count);
+	}
+	if(atomic_load(&profiler.dropped) != 0)
+		fprintf(out, "[dropped] %lu\n", atomic_load(&profiler.dropped));
+
+	free(sorted);
+	return fclose(out) == 0 ? 0 : -errno;
+}
+
+/**
+ * Folds the samples every fold_period, and dumps them when asked
+ */
+static void *profiler_dumper(void *arg)
+{
+	struct timespec deadline;
+
+	for(;;)
+	{
+		//sem_timedwait only takes CLOCK_REALTIME deadlines
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += profiler.fold_period.tv_sec;
+		deadline.tv_nsec += profiler.fold_period.tv_nsec;
+		if(deadline.tv_nsec >= 1000000000L)
+		{
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+
+		if(sem_timedwait(&profiler.request, &deadline) != 0)
+		{
+			if(errno == ETIMEDOUT)
+				profiler_fold();
+			continue;
+		}
+		profiler_dump();
+		if(atomic_load(&profiler.stopping))
+			break;
+	}
+	return NULL;
+}
+
+static void profiler_free(void)
+{
+	struct aesd_profiler_stack *stack;
+	unsigned int index;
+
+	if(profiler.stacks != NULL)
+	{
+		for(index = 0; index < AESD_PROFILER_BUCKETS; index++)
+		{
+			while((stack = profiler.stacks[index]) != NULL)
+			{
+				profiler.stacks[index] = stack->next;
+				free(stack);
+			}
+		}
+	}
+	free(profiler.stacks);
+	free(profiler.samples[0]);
+	free(profiler.samples[1]);
+	profiler.stacks = NULL;
+	profiler.samples[0] = NULL;
+	profiler.samples[1] = NULL;
+	profiler.stack_count = 0;
+}
+
+/**
+ * Starts sampling at @param hz per second of process CPU time, 0 for AESD_PROFILER_DEFAULT_HZ.
+ * Dumps go to @param path, which is rewritten on every SIGUSR1 and when the profiler stops.
+ * @return 0, -EINVAL if @param hz is above AESD_PROFILER_MAX_HZ, or another negative errno
+ */
+int aesd_profiler_start(const char *path, unsigned int hz)
+{
+	struct sigaction action;
+	struct sigevent event;
+	struct itimerspec interval;
+	void *warm_up[1];
+	long processors = sysconf(_SC_NPROCESSORS_ONLN);
+	long fold_ns;
+
+	if(hz == 0)
+		hz = AESD_PROFILER_DEFAULT_HZ;
+	if(hz > AESD_PROFILER_MAX_HZ)
+		return -EINVAL;
+
+	profiler.samples[0] = calloc(AESD_PROFILER_SAMPLES, sizeof(struct aesd_profiler_sample));
+	profiler.samples[1] = calloc(AESD_PROFILER_SAMPLES, sizeof(struct aesd_profiler_sample));
+	profiler.stacks = calloc(AESD_PROFILER_BUCKETS, sizeof(*profiler.stacks));
+	if(profiler.samples[0] == NULL || profiler.samples[1] == NULL || profiler.stacks == NULL)
+	{
+		profiler_free();
+		return -ENOMEM;
+	}
+	profiler.path = path;
+	atomic_init(&profiler.claim, 0);
+	atomic_init(&profiler.dropped, 0);
+	atomic_init(&profiler.stopping, false);
+
+	//every CPU busy fills a buffer fastest, swap when it is at most half full
+	if(processors < 1)
+		processors = 1;
+	fold_ns = (long)((AESD_PROFILER_SAMPLES / 2) * 1000000000ULL / ((unsigned long long)hz * processors));
+	if(fold_ns > AESD_PROFILER_FOLD_MAX_NS)
+		fold_ns = AESD_PROFILER_FOLD_MAX_NS;
+	profiler.fold_period.tv_sec = 0;
+	profiler.fold_period.tv_nsec = fold_ns;
+
+	//the first backtrace loads the unwinder, which must not happen inside the signal handler
+	backtrace(warm_up, 1);
+
+	if(sem_init(&profiler.request, 0, 0) != 0 ||
+			pthread_create(&profiler.dumper, NULL, profiler_dumper, NULL) != 0)
+	{
+		profiler_free();
+		return -errno;
+	}
+
+	//restart interrupted syscalls so sampling does not turn into EINTR in the server
+	memset(&action, 0, sizeof(action));
+	action.sa_flags = SA_RESTART;
+	sigemptyset(&action.sa_mask);
+	action.sa_handler = profiler_sample;
+	sigaction(SIGPROF, &action, NULL);
+	action.sa_handler = profiler_dump_signal;
+	sigaction(SIGUSR1, &action, NULL);
+
+	memset(&event, 0, sizeof(event));
+	event.sigev_notify = SIGEV_SIGNAL;
+	event.sigev_signo = SIGPROF;
+	interval.it_interval.tv_sec = 1 / hz;
+	interval.it_interval.tv_nsec = (1000000000L / hz) % 1000000000L;
+	interval.it_value = interval.it_interval;
+	if(timer_create(CLOCK_PROCESS_CPUTIME_ID, &event, &profiler.timer) != 0 ||
+			timer_settime(profiler.timer, 0, &interval, NULL) != 0)
+	{
+		aesd_profiler_stop();
+		return -errno;
+	}
+	profiler.running = true;
+	return 0;
+}
+
+/**
+ * Asks the dump thread to rewrite the profile file.  Safe to call from a signal handler.
+ */
+void aesd_profiler_request_dump(void)
+{
+	sem_post(&profiler.request);
+}
+
+/**
+ * Stops sampling and writes the final profile
+ */
+void aesd_profiler_stop(void)
+{
+	if(profiler.running)
+		timer_delete(profiler.timer);
+	profiler.running = false;
+	signal(SIGPROF, SIG_IGN);
+	signal(SIGUSR1, SIG_IGN);
+
+	atomic_store(&profiler.stopping, true);
+	sem_post(&profiler.request);
+	pthread_join(profiler.dumper, NULL);
+	sem_destroy(&profiler.request);
+	profiler_free();
+}
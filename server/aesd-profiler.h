@@ -0,0 +1,29 @@
+/*
+ * aesd-profiler.h
+ *
+ * Opt-in sampling profiler for aesdsocket on targets without perf.  A
+ * CLOCK_PROCESS_CPUTIME_ID timer raises SIGPROF while the process burns CPU;
+ * the handler records the interrupted thread's stack into one of two buffers
+ * allocated up front, claiming slots with an atomic counter.  A profiler
+ * thread keeps folding the samples into counts per distinct stack, so memory
+ * stays bounded however long the process runs.  Dumps write the counts as
+ * folded stacks ("root;caller;leaf count" per line) ready for flamegraph.pl.  Frames without a dynamic symbol are written as
+ * module+0xoffset for addr2line.
+ *
+ *  Created on: October 19, 2021
+ *      Author: Chris Choi
+ */
+
+#ifndef AESD_PROFILER_H
+#define AESD_PROFILER_H
+
+#define AESD_PROFILER_DEFAULT_HZ 99
+#define AESD_PROFILER_MAX_HZ 10000
+#define AESD_PROFILER_SAMPLES 8192
+#define AESD_PROFILER_DEPTH 24
+
+extern int aesd_profiler_start(const char *path, unsigned int hz);
+extern void aesd_profiler_request_dump(void);
+extern void aesd_profiler_stop(void);
+
+#endif /* AESD_PROFILER_H */
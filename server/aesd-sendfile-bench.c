@@ -0,0 +1,213 @@
+/**
+ * @file aesd-sendfile-bench.c
+ * @brief Compares forwarding a file to a socket with read and write against sendfile
+ *
+ * usage: aesd-sendfile-bench [-f path] [-n passes] [-b buffer size]
+ *   -f  file or device to forward, default /dev/aesdchar
+ *   -n  times the whole contents are forwarded per method
+ *   -b  buffer size for read and write, also the most sendfile is asked for at once
+ *
+ * Each pass seeks back to the start and forwards everything to one end of a UNIX socket pair,
+ * drained by a second thread.  sendfile needs the driver's splice_read and is reported as
+ * unsupported without it.
+ *
+ * @author Chris Choi
+ * @date 2021-10-19
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+
+#define BENCH_DEFAULT_PATH "/dev/aesdchar"
+#define BENCH_DEFAULT_PASSES 1000
+#define BENCH_DEFAULT_BUFFER 65536
+
+static size_t buffer_size = BENCH_DEFAULT_BUFFER;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void *drain(void *arg)
+{
+	int fd = *(int *)arg;
+	char *buffer = malloc(BENCH_DEFAULT_BUFFER);
+
+	if(buffer == NULL)
+		return NULL;
+	while(read(fd, buffer, BENCH_DEFAULT_BUFFER) > 0)
+		;
+	free(buffer);
+	return NULL;
+}
+
+static int write_all(int fd, const char *data, size_t size)
+{
+	ssize_t written;
+
+	while(size > 0)
+	{
+		written = write(fd, data, size);
+		if(written < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			return -1;
+		}
+		data += written;
+		size -= written;
+	}
+	return 0;
+}
+
+/**
+ * @return bytes forwarded in one pass, or -1 with errno set
+ */
+static ssize_t forward_read_write(int in_fd, int out_fd, char *buffer)
+{
+	ssize_t total = 0;
+	ssize_t got;
+
+	while((got = read(in_fd, buffer, buffer_size)) != 0)
+	{
+		if(got < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			return -1;
+		}
+		if(write_all(out_fd, buffer, got) != 0)
+			return -1;
+		total += got;
+	}
+	return total;
+}
+
+static ssize_t forward_sendfile(int in_fd, int out_fd, char *buffer)
+{
+	ssize_t total = 0;
+	ssize_t sent;
+
+	(void)buffer;
+	while((sent = sendfile(out_fd, in_fd, NULL, buffer_size)) != 0)
+	{
+		if(sent < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			return -1;
+		}
+		total += sent;
+	}
+	return total;
+}
+
+typedef ssize_t (*forward_fn)(int, int, char *);
+
+static void bench(const char *name, forward_fn forward, int in_fd, unsigned int passes)
+{
+	pthread_t drainer;
+	uint64_t start;
+	uint64_t elapsed;
+	uint64_t bytes = 0;
+	ssize_t forwarded;
+	char *buffer;
+	int pair[2];
+	unsigned int pass;
+
+	buffer = malloc(buffer_size);
+	if(buffer == NULL || socketpair(AF_UNIX, SOCK_STREAM, 0, pair) != 0)
+	{
+		perror("setup");
+		exit(1);
+	}
+	pthread_create(&drainer, NULL, drain, &pair[1]);
+
+	start = now_ns();
+	for(pass = 0; pass < passes; pass++)
+	{
+		if(lseek(in_fd, 0, SEEK_SET) < 0)
+		{
+			perror("lseek");
+			exit(1);
+		}
+		forwarded = forward(in_fd, pair[0], buffer);
+		if(forwarded < 0)
+			break;
+		bytes += forwarded;
+	}
+	elapsed = now_ns() - start;
+
+	if(pass < passes)
+		printf("%-12s %s\n", name, errno == EINVAL ? "unsupported" : strerror(errno));
+	else if(bytes == 0)
+		printf("%-12s nothing to forward\n", name);
+	else
+		printf("%-12s %12.1f MB/s %10.3f ns/byte\n", name, bytes * 1000.0 / elapsed,
+				(double)elapsed / bytes);
+
+	close(pair[0]);
+	pthread_join(drainer, NULL);
+	close(pair[1]);
+	free(buffer);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *path = BENCH_DEFAULT_PATH;
+	unsigned int passes = BENCH_DEFAULT_PASSES;
+	int opt;
+	int fd;
+
+	while((opt = getopt(argc, argv, "f:n:b:")) != -1)
+	{
+		switch(opt)
+		{
+		case 'f':
+			path = optarg;
+			break;
+		case 'n':
+			passes = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			buffer_size = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-f path] [-n passes] [-b buffer size]\n", argv[0]);
+			return 1;
+		}
+	}
+	if(buffer_size == 0)
+	{
+		fprintf(stderr, "buffer size must be positive\n");
+		return 1;
+	}
+
+	fd = open(path, O_RDONLY);
+	if(fd < 0)
+	{
+		perror(path);
+		return 1;
+	}
+
+	bench("read+write", forward_read_write, fd, passes);
+	bench("sendfile", forward_sendfile, fd, passes);
+
+	close(fd);
+	return 0;
+}
@@ -0,0 +1,87 @@
+/*
+ * aesd-shm-ring.h
+ *
+ * Layout of the shared memory ring used by the aesdsocket local transport.
+ * A client connects to the server's UNIX socket and receives a memfd holding
+ * one header page followed by the data ring, plus two eventfds: one the client
+ * writes when it publishes a record and the server is asleep, one the server
+ * writes when it commits and the client is asleep.  Records are a 32 bit length
+ * followed by the packet, padded to 8 bytes; a record that would straddle the
+ * end of the ring is preceded by a pad record and starts at offset 0 instead.
+ *
+ *  Created on: October 19, 2021
+ *      Author: Chris Choi
+ */
+
+#ifndef AESD_SHM_RING_H
+#define AESD_SHM_RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <unistd.h>
+
+#define AESD_SHM_RING_MAGIC 0x61657364
+#define AESD_SHM_RING_HEADER_SIZE 4096
+#define AESD_SHM_RING_DEFAULT_CAPACITY (1024*1024)
+#define AESD_SHM_RING_PAD 0xffffffffu
+#define AESD_SHM_RING_SPIN 4096
+#define AESD_SHM_RING_FD_MEM 0
+#define AESD_SHM_RING_FD_DATA 1
+#define AESD_SHM_RING_FD_ACK 2
+#define AESD_SHM_RING_FDS 3
+
+struct aesd_shm_ring_header
+{
+	uint32_t magic;
+	/**
+	 * Size of the data ring in bytes, a power of two
+	 */
+	uint32_t capacity;
+	/**
+	 * Bytes published by the producer, free running
+	 */
+	_Alignas(64) _Atomic uint64_t head;
+	/**
+	 * Set while the producer sleeps on the ack eventfd
+	 */
+	_Atomic uint32_t producer_waiting;
+	/**
+	 * Bytes consumed by the server, free running
+	 */
+	_Alignas(64) _Atomic uint64_t tail;
+	/**
+	 * Set while the server sleeps on the data eventfd
+	 */
+	_Atomic uint32_t consumer_waiting;
+	/**
+	 * Number of records appended to the log, and the log size after the latest one
+	 */
+	_Atomic uint64_t committed;
+	_Atomic int64_t commit_offset;
+};
+
+static inline size_t aesd_shm_ring_record_size(size_t size)
+{
+	return (sizeof(uint32_t) + size + 7) & ~(size_t)7;
+}
+
+/**
+ * @return how many times to poll the ring before sleeping.  Spinning only pays off when the
+ * other side can run at the same time, so uniprocessors go straight to the eventfd.
+ */
+static inline int aesd_shm_ring_spin_limit(void)
+{
+	static int spin_limit = -1;
+
+	if(spin_limit < 0)
+		spin_limit = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? AESD_SHM_RING_SPIN : 0;
+	return spin_limit;
+}
+
+static inline char *aesd_shm_ring_data(struct aesd_shm_ring_header *header)
+{
+	return (char *)header + AESD_SHM_RING_HEADER_SIZE;
+}
+
+#endif /* AESD_SHM_RING_H */
@@ -0,0 +1,204 @@
+/**
+ * @file aesd-timer-wheel.c
+ * @brief Hierarchical timing wheel with O(1) arm and cancel
+ *
+ * Level n holds timers due within 64^(n+1) ticks, each slot covering 64^n ticks.
+ * Whenever the level below wraps, the next slot of a level is emptied and its
+ * timers re-inserted one level down, so every timer is touched at most once per
+ * level.  Deadlines past the last level are clamped to it.
+ *
+ * @author Chris Choi
+ * @date 2021-10-19
+ *
+ */
+
+#include <string.h>
+#include <errno.h>
+
+#include "aesd-timer-wheel.h"
+
+#define AESD_TIMER_WHEEL_MASK (AESD_TIMER_WHEEL_SLOTS - 1)
+#define AESD_TIMER_WHEEL_RANGE ((uint64_t)1 << (AESD_TIMER_WHEEL_BITS * AESD_TIMER_WHEEL_LEVELS))
+
+static void wheel_link(struct aesd_timer **head, struct aesd_timer *timer)
+{
+	timer->next = *head;
+	if(timer->next != NULL)
+		timer->next->pprev = &timer->next;
+	timer->pprev = head;
+	*head = timer;
+}
+
+static void wheel_unlink(struct aesd_timer *timer)
+{
+	*timer->pprev = timer->next;
+	if(timer->next != NULL)
+		timer->next->pprev = timer->pprev;
+	timer->next = NULL;
+	timer->pprev = NULL;
+}
+
+/**
+ * Files @param timer in the slot for its expiry, called with the wheel locked
+ */
+static void wheel_insert(struct aesd_timer_wheel *wheel, struct aesd_timer *timer)
+{
+	uint64_t delta;
+	int level;
+
+	if(timer->expires < wheel->current)
+		timer->expires = wheel->current;
+	delta = timer->expires - wheel->current;
+	if(delta >= AESD_TIMER_WHEEL_RANGE)
+	{
+		timer->expires = wheel->current + AESD_TIMER_WHEEL_RANGE - 1;
+		delta = AESD_TIMER_WHEEL_RANGE - 1;
+	}
+
+	for(level = 0; level < AESD_TIMER_WHEEL_LEVELS - 1; level++)
+	{
+		if(delta < ((uint64_t)1 << (AESD_TIMER_WHEEL_BITS * (level + 1))))
+			break;
+	}
+	wheel_link(&wheel->slot[level][(timer->expires >> (AESD_TIMER_WHEEL_BITS * level)) & AESD_TIMER_WHEEL_MASK],
+			timer);
+}
+
+/**
+ * Moves every timer in the current slot of @param level down a level
+ * @return the slot index, 0 when this level wrapped too
+ */
+static unsigned int wheel_cascade(struct aesd_timer_wheel *wheel, int level)
+{
+	unsigned int index = (wheel->current >> (AESD_TIMER_WHEEL_BITS * level)) & AESD_TIMER_WHEEL_MASK;
+	struct aesd_timer *timer;
+
+	while((timer = wheel->slot[level][index]) != NULL)
+	{
+		wheel_unlink(timer);
+		wheel_insert(wheel, timer);
+	}
+	return index;
+}
+
+int aesd_timer_wheel_init(struct aesd_timer_wheel *wheel, unsigned int tick_ms)
+{
+	memset(wheel, 0, sizeof(*wheel));
+	wheel->tick_ms = tick_ms ? tick_ms : AESD_TIMER_WHEEL_DEFAULT_TICK_MS;
+	atomic_init(&wheel->stop, false);
+	if(clock_gettime(CLOCK_MONOTONIC, &wheel->start) != 0)
+		return -errno;
+	return -pthread_mutex_init(&wheel->lock, NULL);
+}
+
+void aesd_timer_wheel_destroy(struct aesd_timer_wheel *wheel)
+{
+	pthread_mutex_destroy(&wheel->lock);
+}
+
+/**
+ * Processes every tick before @param now, running the callbacks of expired timers
+ */
+void aesd_timer_wheel_advance(struct aesd_timer_wheel *wheel, uint64_t now)
+{
+	struct aesd_timer *timer;
+	unsigned int index;
+	int level;
+
+	pthread_mutex_lock(&wheel->lock);
+	while(wheel->current < now)
+	{
+		index = wheel->current & AESD_TIMER_WHEEL_MASK;
+		for(level = 1; index == 0 && level < AESD_TIMER_WHEEL_LEVELS; level++)
+			index = wheel_cascade(wheel, level);
+
+		index = wheel->current & AESD_TIMER_WHEEL_MASK;
+		while((timer = wheel->slot[0][index]) != NULL)
+		{
+			wheel_unlink(timer);
+			timer->callback(timer);
+		}
+		wheel->current++;
+	}
+	pthread_mutex_unlock(&wheel->lock);
+}
+
+static uint64_t wheel_now(struct aesd_timer_wheel *wheel)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return ((now.tv_sec - wheel->start.tv_sec) * 1000 + (now.tv_nsec - wheel->start.tv_nsec) / 1000000) /
+			wheel->tick_ms;
+}
+
+static void *wheel_ticker(void *arg)
+{
+	struct aesd_timer_wheel *wheel = arg;
+	struct timespec next = wheel->start;
+
+	while(!atomic_load(&wheel->stop))
+	{
+		//absolute deadlines, so a late wakeup does not push every later tick back
+		next.tv_nsec += wheel->tick_ms * 1000000L;
+		while(next.tv_nsec >= 1000000000L)
+		{
+			next.tv_nsec -= 1000000000L;
+			next.tv_sec++;
+		}
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+		aesd_timer_wheel_advance(wheel, wheel_now(wheel) + 1);
+	}
+	return NULL;
+}
+
+/**
+ * Starts the single ticker thread that drives @param wheel
+ * @return 0 or a negative errno
+ */
+int aesd_timer_wheel_start(struct aesd_timer_wheel *wheel)
+{
+	return -pthread_create(&wheel->ticker, NULL, wheel_ticker, wheel);
+}
+
+/**
+ * Stops the ticker thread, waiting at most one tick.  Armed timers stay armed and do not fire.
+ */
+void aesd_timer_wheel_stop(struct aesd_timer_wheel *wheel)
+{
+	atomic_store(&wheel->stop, true);
+	pthread_join(wheel->ticker, NULL);
+}
+
+void aesd_timer_init(struct aesd_timer *timer, aesd_timer_callback callback)
+{
+	timer->next = NULL;
+	timer->pprev = NULL;
+	timer->expires = 0;
+	timer->callback = callback;
+}
+
+/**
+ * Arms @param timer to fire no earlier than @param timeout_ms from now, re-arming it if pending
+ */
+void aesd_timer_arm(struct aesd_timer_wheel *wheel, struct aesd_timer *timer, unsigned int timeout_ms)
+{
+	pthread_mutex_lock(&wheel->lock);
+	if(timer->pprev != NULL)
+		wheel_unlink(timer);
+	//round up and count the partial tick in progress, so the timer never fires early
+	timer->expires = wheel->current + (timeout_ms + wheel->tick_ms - 1) / wheel->tick_ms + 1;
+	wheel_insert(wheel, timer);
+	pthread_mutex_unlock(&wheel->lock);
+}
+
+/**
+ * Disarms @param timer if pending.  Waits for its callback if it is running right now.
+ */
+void aesd_timer_cancel(struct aesd_timer_wheel *wheel, struct aesd_timer *timer)
+{
+	pthread_mutex_lock(&wheel->lock);
+	if(timer->pprev != NULL)
+		wheel_unlink(timer);
+	pthread_mutex_unlock(&wheel->lock);
+}
@@ -0,0 +1,75 @@
+/*
+ * aesd-timer-wheel.h
+ *
+ * Hierarchical timing wheel for aesdsocket connection deadlines.  Timers are
+ * embedded in their owner, so arming and cancelling is a list insert or unlink
+ * under the wheel lock and never allocates.  A single ticker thread advances
+ * the wheel and runs expired callbacks; timers further out than the first
+ * level are cascaded down as their level comes round.
+ *
+ *  Created on: October 19, 2021
+ *      Author: Chris Choi
+ */
+
+#ifndef AESD_TIMER_WHEEL_H
+#define AESD_TIMER_WHEEL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+
+#define AESD_TIMER_WHEEL_BITS 6
+#define AESD_TIMER_WHEEL_SLOTS (1 << AESD_TIMER_WHEEL_BITS)
+#define AESD_TIMER_WHEEL_LEVELS 4
+#define AESD_TIMER_WHEEL_DEFAULT_TICK_MS 10
+
+struct aesd_timer;
+
+/**
+ * Runs on the ticker thread with the wheel locked, so it must not arm or cancel timers.
+ * Once aesd_timer_cancel returns the callback is not running and will not run.
+ */
+typedef void (*aesd_timer_callback)(struct aesd_timer *timer);
+
+struct aesd_timer
+{
+	struct aesd_timer *next;
+	/**
+	 * Link that points at this timer, NULL while the timer is not armed
+	 */
+	struct aesd_timer **pprev;
+	/**
+	 * Tick at which the timer fires
+	 */
+	uint64_t expires;
+	aesd_timer_callback callback;
+};
+
+struct aesd_timer_wheel
+{
+	pthread_mutex_t lock;
+	struct aesd_timer *slot[AESD_TIMER_WHEEL_LEVELS][AESD_TIMER_WHEEL_SLOTS];
+	/**
+	 * Next tick to be processed
+	 */
+	uint64_t current;
+	unsigned int tick_ms;
+	struct timespec start;
+	pthread_t ticker;
+	atomic_bool stop;
+};
+
+extern int aesd_timer_wheel_init(struct aesd_timer_wheel *wheel, unsigned int tick_ms);
+extern void aesd_timer_wheel_destroy(struct aesd_timer_wheel *wheel);
+
+extern int aesd_timer_wheel_start(struct aesd_timer_wheel *wheel);
+extern void aesd_timer_wheel_stop(struct aesd_timer_wheel *wheel);
+extern void aesd_timer_wheel_advance(struct aesd_timer_wheel *wheel, uint64_t now);
+
+extern void aesd_timer_init(struct aesd_timer *timer, aesd_timer_callback callback);
+extern void aesd_timer_arm(struct aesd_timer_wheel *wheel, struct aesd_timer *timer, unsigned int timeout_ms);
+extern void aesd_timer_cancel(struct aesd_timer_wheel *wheel, struct aesd_timer *timer);
+
+#endif /* AESD_TIMER_WHEEL_H */
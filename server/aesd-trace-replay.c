@@ -0,0 +1,597 @@
+/**
+ * @file aesd-trace-replay.c
+ * @brief Replays a trace recorded with aesdsocket -t against a server and reports latencies
+ *
+ * usage: aesd-trace-replay [-h host] [-p port] [-x speed] trace
+ *   -x  time scale, 1 replays at the recorded pace, 10 ten times faster and
+ *       0 issues all events back to back without waiting
+ *
+ * Connections, pipeline switches, packet sizes and closes are reissued with their
+ * recorded timing; packet contents are filler.  Connections that used the shared
+ * memory transport are replayed as pipelined TCP connections without replay.
+ * Latency is measured from the moment a packet is due until the server's full
+ * answer (replay, or ack) has arrived.
+ *
+ * @author Chris Choi
+ * @date 2021-10-19
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "aesd-trace.h"
+
+#define REPLAY_DEFAULT_HOST "localhost"
+#define REPLAY_DEFAULT_PORT "9000"
+#define REPLAY_FILLER_SIZE 65536
+#define REPLAY_RECV_SIZE 65536
+#define REPLAY_PIPELINE_COMMAND "AESDSOCKET_PIPELINE:"
+#define NSEC_PER_SEC 1000000000ULL
+
+enum conn_state
+{
+	CONN_IDLE,
+	CONN_OPEN,
+	CONN_CLOSING,
+	CONN_DONE
+};
+
+struct send_item
+{
+	/**
+	 * Bytes of this packet still to be written, the last one is the newline
+	 */
+	uint64_t remaining;
+	/**
+	 * Pipeline command text, or NULL for a filler packet
+	 */
+	const char *command;
+};
+
+struct replay_conn
+{
+	enum conn_state state;
+	int fd;
+	bool pipeline;
+	bool replay;
+	/**
+	 * Queued sends
+	 */
+	struct send_item *sends;
+	size_t send_head;
+	size_t send_count;
+	size_t send_size;
+	/**
+	 * Due times of packets still waiting for their answer
+	 */
+	uint64_t *pending;
+	size_t pending_head;
+	size_t pending_count;
+	size_t pending_size;
+	/**
+	 * Pipeline answer parsing: ack digits, then replay bytes to skip
+	 */
+	char ack[32];
+	size_t ack_len;
+	uint64_t skip;
+};
+
+struct latency_stats
+{
+	const char *name;
+	uint64_t *values;
+	size_t count;
+	size_t size;
+};
+
+static char filler[REPLAY_FILLER_SIZE];
+static struct latency_stats legacy_stats = { .name = "legacy" };
+static struct latency_stats pipeline_stats = { .name = "pipeline" };
+static size_t errors;
+
+static uint64_t now_ns(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * NSEC_PER_SEC + now.tv_nsec;
+}
+
+static void *grow(void *array, size_t *size, size_t element)
+{
+	size_t new_size = *size ? *size * 2 : 16;
+	void *temp = realloc(array, new_size * element);
+
+	if(temp == NULL)
+	{
+		fprintf(stderr, "Out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	*size = new_size;
+	return temp;
+}
+
+static void stats_add(struct latency_stats *stats, uint64_t value)
+{
+	if(stats->count == stats->size)
+		stats->values = grow(stats->values, &stats->size, sizeof(uint64_t));
+	stats->values[stats->count++] = value;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+	uint64_t left = *(const uint64_t *)a;
+	uint64_t right = *(const uint64_t *)b;
+
+	return left < right ? -1 : left > right;
+}
+
+static double percentile_us(const struct latency_stats *stats, double fraction)
+{
+	size_t index = fraction * (stats->count - 1) + 0.5;
+
+	return stats->values[index] / 1e3;
+}
+
+static void stats_print(struct latency_stats *stats)
+{
+	uint64_t total = 0;
+	size_t index;
+
+	if(stats->count == 0)
+		return;
+
+	qsort(stats->values, stats->count, sizeof(uint64_t), compare_u64);
+	for(index = 0; index < stats->count; index++)
+		total += stats->values[index];
+
+	printf("%s packets=%zu mean_us=%.1f min_us=%.1f p50_us=%.1f p90_us=%.1f p99_us=%.1f p999_us=%.1f max_us=%.1f\n",
+			stats->name, stats->count, total / 1e3 / stats->count,
+			percentile_us(stats, 0.0), percentile_us(stats, 0.5), percentile_us(stats, 0.9),
+			percentile_us(stats, 0.99), percentile_us(stats, 0.999), percentile_us(stats, 1.0));
+}
+
+static void queue_send(struct replay_conn *conn, uint64_t size, const char *command)
+{
+	if(conn->send_count == conn->send_size)
+	{
+		struct send_item *old = conn->sends;
+		size_t old_size = conn->send_size;
+		size_t index;
+
+		conn->sends = grow(NULL, &conn->send_size, sizeof(struct send_item));
+		for(index = 0; index < conn->send_count; index++)
+			conn->sends[index] = old[(conn->send_head + index) % old_size];
+		conn->send_head = 0;
+		free(old);
+	}
+	conn->sends[(conn->send_head + conn->send_count) % conn->send_size] =
+		(struct send_item){ .remaining = size, .command = command };
+	conn->send_count++;
+}
+
+static void queue_pending(struct replay_conn *conn, uint64_t due)
+{
+	if(conn->pending_count == conn->pending_size)
+	{
+		uint64_t *old = conn->pending;
+		size_t old_size = conn->pending_size;
+		size_t index;
+
+		conn->pending = grow(NULL, &conn->pending_size, sizeof(uint64_t));
+		for(index = 0; index < conn->pending_count; index++)
+			conn->pending[index] = old[(conn->pending_head + index) % old_size];
+		conn->pending_head = 0;
+		free(old);
+	}
+	conn->pending[(conn->pending_head + conn->pending_count) % conn->pending_size] = due;
+	conn->pending_count++;
+}
+
+static void complete_pending(struct replay_conn *conn)
+{
+	uint64_t due = conn->pending[conn->pending_head];
+
+	conn->pending_head = (conn->pending_head + 1) % conn->pending_size;
+	conn->pending_count--;
+	stats_add(conn->pipeline ? &pipeline_stats : &legacy_stats, now_ns() - due);
+}
+
+static void conn_close(struct replay_conn *conn, bool failed)
+{
+	if(failed)
+		errors += conn->pending_count ? conn->pending_count : 1;
+	if(conn->fd >= 0)
+		close(conn->fd);
+	conn->fd = -1;
+	conn->state = CONN_DONE;
+	conn->send_count = 0;
+	conn->pending_count = 0;
+}
+
+static int conn_open(struct replay_conn *conn, const struct addrinfo *addr)
+{
+	int one = 1;
+
+	conn->fd = socket(addr->ai_family, addr->ai_socktype | SOCK_NONBLOCK, addr->ai_protocol);
+	if(conn->fd < 0)
+		return -1;
+	setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	if(connect(conn->fd, addr->ai_addr, addr->ai_addrlen) != 0 && errno != EINPROGRESS)
+	{
+		close(conn->fd);
+		conn->fd = -1;
+		return -1;
+	}
+	conn->state = CONN_OPEN;
+	return 0;
+}
+
+static void conn_write(struct replay_conn *conn)
+{
+	struct send_item *item;
+	const char *data;
+	size_t length;
+	ssize_t sent;
+
+	while(conn->send_count > 0)
+	{
+		item = &conn->sends[conn->send_head];
+		if(item->command != NULL)
+		{
+			data = item->command + strlen(item->command) - item->remaining;
+			length = item->remaining;
+		}
+		else if(item->remaining > 1)
+		{
+			data = filler;
+			length = item->remaining - 1 < sizeof(filler) ? item->remaining - 1 : sizeof(filler);
+		}
+		else
+		{
+			data = "\n";
+			length = 1;
+		}
+
+		sent = send(conn->fd, data, length, MSG_NOSIGNAL);
+		if(sent < 0)
+		{
+			if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				conn_close(conn, true);
+			return;
+		}
+
+		item->remaining -= sent;
+		if(item->remaining == 0)
+		{
+			conn->send_head = (conn->send_head + 1) % conn->send_size;
+			conn->send_count--;
+		}
+	}
+}
+
+static void conn_read(struct replay_conn *conn)
+{
+	char buffer[REPLAY_RECV_SIZE];
+	ssize_t received;
+	size_t index;
+
+	for(;;)
+	{
+		received = recv(conn->fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+		if(received < 0)
+		{
+			if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				conn_close(conn, true);
+			return;
+		}
+
+		if(received == 0)
+		{
+			//a legacy answer ends when the server closes
+			if(!conn->pipeline && conn->pending_count == 1)
+			{
+				complete_pending(conn);
+				conn_close(conn, false);
+			}
+			else
+			{
+				conn_close(conn, conn->pending_count > 0);
+			}
+			return;
+		}
+
+		if(!conn->pipeline)
+			continue;
+
+		for(index = 0; index < (size_t)received; index++)
+		{
+			if(conn->skip > 0)
+			{
+				size_t length = received - index < conn->skip ? received - index : conn->skip;
+
+				conn->skip -= length;
+				index += length - 1;
+				if(conn->skip == 0 && conn->pending_count > 0)
+					complete_pending(conn);
+				continue;
+			}
+
+			if(buffer[index] != '\n')
+			{
+				if(conn->ack_len < sizeof(conn->ack) - 1)
+					conn->ack[conn->ack_len++] = buffer[index];
+				continue;
+			}
+
+			conn->ack[conn->ack_len] = '\0';
+			conn->ack_len = 0;
+			conn->skip = conn->replay ? strtoull(conn->ack, NULL, 10) : 0;
+			if(conn->skip == 0 && conn->pending_count > 0)
+				complete_pending(conn);
+		}
+
+		if(conn->state == CONN_CLOSING && conn->pending_count == 0)
+		{
+			conn_close(conn, false);
+			return;
+		}
+	}
+}
+
+static void apply_record(struct replay_conn *conn, const struct aesd_trace_record *record,
+			const struct addrinfo *addr, uint64_t due)
+{
+	switch(record->event)
+	{
+		case AESD_TRACE_CONNECT:
+			if(conn_open(conn, addr) != 0)
+			{
+				errors++;
+				conn->state = CONN_DONE;
+				break;
+			}
+			if(record->flags & AESD_TRACE_FLAG_LOCAL)
+			{
+				conn->pipeline = true;
+				queue_send(conn, strlen(REPLAY_PIPELINE_COMMAND "0\n"), REPLAY_PIPELINE_COMMAND "0\n");
+			}
+			break;
+
+		case AESD_TRACE_PIPELINE:
+			if(conn->state != CONN_OPEN)
+				break;
+			conn->pipeline = true;
+			conn->replay = (record->flags & AESD_TRACE_FLAG_REPLAY) != 0;
+			if(conn->replay)
+				queue_send(conn, strlen(REPLAY_PIPELINE_COMMAND "1\n"), REPLAY_PIPELINE_COMMAND "1\n");
+			else
+				queue_send(conn, strlen(REPLAY_PIPELINE_COMMAND "0\n"), REPLAY_PIPELINE_COMMAND "0\n");
+			break;
+
+		case AESD_TRACE_PACKET:
+			if(conn->state != CONN_OPEN || record->size == 0)
+				break;
+			queue_send(conn, record->size, NULL);
+			queue_pending(conn, due);
+			break;
+
+		case AESD_TRACE_CLOSE:
+			if(conn->state != CONN_OPEN)
+				break;
+			if(conn->pending_count == 0 && conn->send_count == 0)
+				conn_close(conn, false);
+			else
+				conn->state = CONN_CLOSING;
+			break;
+	}
+}
+
+static struct aesd_trace_record *load_trace(const char *path, size_t *count)
+{
+	struct aesd_trace_header header;
+	struct aesd_trace_record *records = NULL;
+	size_t size = 0;
+	FILE *file;
+
+	file = fopen(path, "rb");
+	if(file == NULL)
+	{
+		perror(path);
+		return NULL;
+	}
+
+	if(fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, AESD_TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+			header.version != AESD_TRACE_VERSION || header.record_size != sizeof(struct aesd_trace_record))
+	{
+		fprintf(stderr, "%s is not an aesdsocket trace\n", path);
+		fclose(file);
+		return NULL;
+	}
+
+	*count = 0;
+	for(;;)
+	{
+		if(*count == size)
+			records = grow(records, &size, sizeof(struct aesd_trace_record));
+		if(fread(&records[*count], sizeof(struct aesd_trace_record), 1, file) != 1)
+			break;
+		(*count)++;
+	}
+	fclose(file);
+	return records;
+}
+
+int main(int argc, char *argv[])
+{
+	struct aesd_trace_record *records;
+	struct replay_conn *conns = NULL;
+	struct replay_conn *conn;
+	struct pollfd *fds = NULL;
+	size_t *fd_conns = NULL;
+	struct addrinfo hints;
+	struct addrinfo *addr;
+	struct timespec timeout;
+	const char *host = REPLAY_DEFAULT_HOST;
+	const char *port = REPLAY_DEFAULT_PORT;
+	double speed = 1.0;
+	size_t count;
+	size_t next = 0;
+	size_t conn_count = 0;
+	size_t nfds;
+	size_t index;
+	uint64_t start;
+	uint64_t now;
+	uint64_t due;
+	bool active;
+	int opt;
+
+	while((opt = getopt(argc, argv, "h:p:x:")) != -1)
+	{
+		switch(opt)
+		{
+			case 'h': host = optarg; break;
+			case 'p': port = optarg; break;
+			case 'x': speed = strtod(optarg, NULL); break;
+			default:
+				fprintf(stderr, "usage: %s [-h host] [-p port] [-x speed] trace\n", argv[0]);
+				return EXIT_FAILURE;
+		}
+	}
+	if(optind != argc - 1 || speed < 0)
+	{
+		fprintf(stderr, "usage: %s [-h host] [-p port] [-x speed] trace\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	records = load_trace(argv[optind], &count);
+	if(records == NULL)
+		return EXIT_FAILURE;
+
+	for(index = 0; index < count; index++)
+	{
+		if(records[index].connection >= conn_count)
+			conn_count = records[index].connection + 1;
+	}
+	conns = calloc(conn_count ? conn_count : 1, sizeof(struct replay_conn));
+	fds = calloc(conn_count ? conn_count : 1, sizeof(struct pollfd));
+	fd_conns = calloc(conn_count ? conn_count : 1, sizeof(size_t));
+	if(conns == NULL || fds == NULL || fd_conns == NULL)
+		return EXIT_FAILURE;
+	for(index = 0; index < conn_count; index++)
+		conns[index].fd = -1;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if(getaddrinfo(host, port, &hints, &addr) != 0)
+	{
+		fprintf(stderr, "Failed to resolve %s:%s\n", host, port);
+		return EXIT_FAILURE;
+	}
+
+	memset(filler, 'x', sizeof(filler));
+	signal(SIGPIPE, SIG_IGN);
+	start = now_ns();
+
+	for(;;)
+	{
+		//issue every event that is due
+		now = now_ns();
+		while(next < count)
+		{
+			due = start + (speed > 0 ? (uint64_t)(records[next].timestamp / speed) : 0);
+			if(speed > 0 && due > now)
+				break;
+			if(speed == 0)
+				due = now;
+			apply_record(&conns[records[next].connection], &records[next], addr, due);
+			next++;
+		}
+
+		nfds = 0;
+		active = false;
+		for(index = 0; index < conn_count; index++)
+		{
+			conn = &conns[index];
+			if(conn->fd < 0)
+				continue;
+			conn_write(conn);
+			if(conn->fd < 0)
+				continue;
+			active = true;
+			fds[nfds].fd = conn->fd;
+			fds[nfds].events = POLLIN | (conn->send_count > 0 ? POLLOUT : 0);
+			fds[nfds].revents = 0;
+			fd_conns[nfds] = index;
+			nfds++;
+		}
+
+		if(next == count && !active)
+			break;
+
+		if(next < count && speed > 0)
+		{
+			due = start + (uint64_t)(records[next].timestamp / speed);
+			now = now_ns();
+			due = due > now ? due - now : 0;
+			timeout.tv_sec = due / NSEC_PER_SEC;
+			timeout.tv_nsec = due % NSEC_PER_SEC;
+		}
+		else if(next < count)
+		{
+			timeout.tv_sec = 0;
+			timeout.tv_nsec = 0;
+		}
+
+		if(ppoll(fds, nfds, next < count ? &timeout : NULL, NULL) < 0 && errno != EINTR)
+		{
+			perror("ppoll");
+			break;
+		}
+
+		for(index = 0; index < nfds; index++)
+		{
+			conn = &conns[fd_conns[index]];
+			if(conn->fd < 0)
+				continue;
+			if(fds[index].revents & POLLOUT)
+				conn_write(conn);
+			if(conn->fd >= 0 && (fds[index].revents & (POLLIN | POLLERR | POLLHUP)))
+				conn_read(conn);
+		}
+	}
+
+	printf("trace_events=%zu connections=%zu speed=%g seconds=%.3f errors=%zu\n",
+			count, conn_count, speed, (now_ns() - start) / 1e9, errors);
+	stats_print(&legacy_stats);
+	stats_print(&pipeline_stats);
+
+	freeaddrinfo(addr);
+	free(records);
+	free(fds);
+	free(fd_conns);
+	for(index = 0; index < conn_count; index++)
+	{
+		free(conns[index].sends);
+		free(conns[index].pending);
+	}
+	free(conns);
+	return errors == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
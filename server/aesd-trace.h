@@ -0,0 +1,74 @@
+/*
+ * aesd-trace.h
+ *
+ * Binary traffic trace written by aesdsocket -t and read by aesd-trace-replay.
+ * A trace is one aesd_trace_header followed by fixed size aesd_trace_record
+ * entries in the host's byte order.  Only sizes and timing are recorded, never
+ * packet contents.
+ *
+ *  Created on: October 19, 2021
+ *      Author: Chris Choi
+ */
+
+#ifndef AESD_TRACE_H
+#define AESD_TRACE_H
+
+#include <stdint.h>
+
+#define AESD_TRACE_MAGIC "AESDTRC1"
+#define AESD_TRACE_VERSION 1
+
+/**
+ * A client connected
+ */
+#define AESD_TRACE_CONNECT 1
+/**
+ * The connection switched to pipeline mode
+ */
+#define AESD_TRACE_PIPELINE 2
+/**
+ * A packet of size bytes was committed and replay bytes were sent back
+ */
+#define AESD_TRACE_PACKET 3
+/**
+ * The connection closed
+ */
+#define AESD_TRACE_CLOSE 4
+
+/**
+ * Event flags
+ */
+#define AESD_TRACE_FLAG_LOCAL 0x01
+#define AESD_TRACE_FLAG_REPLAY 0x02
+
+struct aesd_trace_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t record_size;
+};
+
+struct aesd_trace_record
+{
+	/**
+	 * Nanoseconds since the trace started, CLOCK_MONOTONIC
+	 */
+	uint64_t timestamp;
+	/**
+	 * Packet bytes for AESD_TRACE_PACKET
+	 */
+	uint64_t size;
+	/**
+	 * Replay bytes sent for AESD_TRACE_PACKET
+	 */
+	uint64_t replay;
+	/**
+	 * Identifies the connection across its events
+	 */
+	uint32_t connection;
+	uint8_t event;
+	uint8_t flags;
+	uint16_t reserved;
+};
+
+#endif /* AESD_TRACE_H */
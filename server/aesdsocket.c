@@ -5,6 +5,26 @@
 *	logs closed connection
 *	restarts accepting connection until SIGINT or SIGTERM and gracefully exits
 *	deletes the temp file
+*	a connection whose first line is "AESDSOCKET_PIPELINE:<0|1>" stays open for any number of packets,
+*	each acked with the file size after its commit and, for 1, followed by that many bytes of the file
+*	with -u <path>, same-host clients can connect to a UNIX socket and get a shared memory ring
+*	(see aesd-shm-ring.h) whose records are appended like TCP packets
+*	with -t <path>, connection events and packet sizes are recorded to a binary trace (see aesd-trace.h)
+*	for aesd-trace-replay
+*	a connection whose first line is "AESDSOCKET_CHANNEL:<key>" appends to and replays its own log,
+*	/var/tmp/aesdsocketdata.<key>, with its own lock; with -M, connections without a key replay every
+*	channel interleaved in commit order
+*	with -T idle[,read[,replay]], connections are closed when idle between packets, slow to deliver a
+*	packet, or slow to take a replay for longer than the given milliseconds
+*	with -w <n>, connections run as coroutines on n worker threads instead of one thread each
+*	(see aesd-coroutine.h)
+*	with -P <path>, CPU samples (at -F hertz, 1 to 10000, default 99) are written to path as folded stacks on
+*	SIGUSR1 and at exit (see aesd-profiler.h)
+*	with -D, a packet already in the file is stored as a reference to its first copy; replies and acks
+*	are unchanged since replay expands references back into the original bytes
+*	with -c <path>, packets go to the aesdchar device at path instead of the file and no timestamps are
+*	written; a connection whose line is "AESDCHAR_IOCSEEKTO:<write>,<offset>" is not stored but answered
+*	with the device contents from that byte of that write on (see aesd_ioctl.h)
 *
 * author: Chris Choi
 *
@@ -13,6 +33,8 @@
 */
 
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -33,24 +55,168 @@
 #include <pthread.h>
 #include <sys/time.h>
 #include <sys/queue.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <ctype.h>
+#include <stddef.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+
+#include "aesd-shm-ring.h"
+#include "aesd-trace.h"
+#include "aesd-timer-wheel.h"
+#include "aesd-coroutine.h"
+#include "aesd-profiler.h"
+#include "../aesd-char-driver/aesd_ioctl.h"
 
 
 #define FILE_OUT_PATH "/var/tmp/aesdsocketdata"
 #define MAXSIZE 100
 #define MYPORT "9000"  		
-#define BACKLOG 10     	
+#define BACKLOG SOMAXCONN
 #define TIMESPECADD 1000000000L	
 #define TIMER_N_SEC 1000000
-#define FD_SIZE 3
+#define FD_SIZE 4
 #define FD_DATA 0
 #define FD_CLIENT 1
 #define FD_SOCKET 2
+#define FD_LOCAL 3
 #define FAILURE -1
+#define STREAM_CHUNK 4096
+#define SENDFILE_CHUNK (1024*1024)
+#define STREAM_THRESHOLD_DEFAULT (64*1024)
+#define SPILL_DIR "/var/tmp"
+#define SPILL_TEMPLATE "/var/tmp/aesdsocketspillXXXXXX"
+#define PIPELINE_COMMAND "AESDSOCKET_PIPELINE:"
+#define ACK_SIZE 32
+#define RECORD_LITERAL 'L'
+#define RECORD_REFERENCE 'R'
+#define RECORD_LITERAL_SIZE (1 + sizeof(uint64_t))
+#define RECORD_REFERENCE_SIZE (1 + 2 * sizeof(uint64_t))
+#define DEDUP_MIN_SIZE 32
+#define DEDUP_TABLE_INITIAL 1024
+#define DEDUP_MAX_ENTRIES (1024*1024)
+#define CHANNEL_COMMAND "AESDSOCKET_CHANNEL:"
+#define CHANNEL_NAME_MAX 32
+#define CHANNEL_MAX 64
+#define CHANNEL_PATH_SIZE (sizeof(FILE_OUT_PATH) + 1 + CHANNEL_NAME_MAX)
+#define INDEX_BLOCK 4096
+#define DEADLINE_NONE 0
+#define DEADLINE_IDLE 1
+#define DEADLINE_READ 2
+#define DEADLINE_REPLAY 3
+#define SEEKTO_COMMAND "AESDCHAR_IOCSEEKTO:"
+#define SEEKTO_COMMAND_MAX 64
 
 int fd[FD_SIZE];
 int sigFlag=0;	
 
-pthread_mutex_t mutex;	
+//packets larger than this are staged on disk instead of the heap
+size_t streamThreshold = STREAM_THRESHOLD_DEFAULT;
+
+//UNIX socket path for the shared memory transport, NULL when disabled
+const char *localPath = NULL;
+
+//traffic trace written with -t, NULL when disabled
+FILE *traceFile = NULL;
+struct timespec traceStart;
+atomic_uint traceConnectionId;
+
+//where the first copy of a packet's payload sits in a deduplicated log
+struct dedupEntry
+{
+    uint64_t hash;
+    //0 marks an empty slot, a payload always follows a record header
+    off_t offset;
+    size_t length;
+};
+
+//sequence number and log size after one commit, kept with -M so channels can be merged in commit order
+struct commitIndex
+{
+    uint64_t sequence;
+    off_t physicalEnd;
+    off_t logicalEnd;
+};
+
+//the append only packet log; with -D a packet seen before is stored as a reference to its first copy.
+//a deduplicated file is a sequence of records: 'L' + 64 bit length + payload, or 'R' + 64 bit length
+//+ 64 bit offset of the first copy's payload
+struct store
+{
+    int fd;
+    pthread_mutex_t lock;
+    bool dedup;
+    //bytes in the file, and bytes a replay of the whole log produces
+    off_t physicalEnd;
+    off_t logicalEnd;
+    //open addressed hash table, a power of two in size
+    struct dedupEntry *table;
+    size_t tableSize;
+    size_t tableCount;
+    //commit index in fixed blocks, so a snapshot of the block pointers stays valid after the lock is dropped
+    struct commitIndex **indexBlocks;
+    size_t indexBlockSlots;
+    size_t indexCount;
+    //channel key, empty for the default log
+    char name[CHANNEL_NAME_MAX + 1];
+    //an aesdchar device only keeps its latest writes, so its size is read back after each commit
+    bool device;
+};
+
+//log size after a commit, physical bounds the replay and logical is what clients are told
+struct storePosition
+{
+    off_t physical;
+    off_t logical;
+    //global commit sequence with -M, 0 otherwise
+    uint64_t sequence;
+};
+
+//default log, used by connections that name no channel and by the timer
+struct store dataStore;
+
+//with -D every log stores repeated packets once
+bool dedup = false;
+
+//aesdchar device holding the default log with -c, NULL for FILE_OUT_PATH
+const char *devicePath = NULL;
+
+//logs created on demand by AESDSOCKET_CHANNEL:<name>, each with its own file and lock
+struct store channels[CHANNEL_MAX];
+size_t channelCount = 0;
+pthread_mutex_t channelLock = PTHREAD_MUTEX_INITIALIZER;
+
+//with -M default connections replay every channel interleaved by commitSequence
+bool mergedView = false;
+atomic_ullong commitSequence;
+
+//one channel's commits up to a sequence number
+struct channelSnapshot
+{
+    struct store *store;
+    struct commitIndex **blocks;
+    size_t count;
+};
+
+struct mergedSnapshot
+{
+    struct channelSnapshot channel[CHANNEL_MAX + 1];
+    size_t channelCount;
+    off_t logicalEnd;
+};
+
+//connection deadlines in milliseconds set with -T, 0 disables one
+unsigned int idleTimeout = 0;
+unsigned int readTimeout = 0;
+unsigned int replayTimeout = 0;
+struct aesd_timer_wheel timerWheel;
+
+//with -w connections run as coroutines on this many worker threads instead of a thread each
+unsigned int coWorkers = 0;
+struct aesd_co_scheduler *coScheduler = NULL;
 
 struct sockaddr_in connection_addr;
 
@@ -62,9 +228,37 @@ struct params
     int tid;
 };
 
+static int commitBuffer(struct store *store, const char *data, size_t size, struct storePosition *end);
+
 struct timerthread
 {
-	int timerParams;
+	struct store* timerStore;
+};
+
+//per connection packet assembly state
+struct connection
+{
+    int clientFd;
+    //log this connection appends to and replays
+    struct store *store;
+    //packet under assembly, bounded by streamThreshold
+    char* bufferAppend;
+    size_t memAllocSize;
+    size_t bufferSize;
+    //spill file holding the packet once it outgrows the threshold
+    int spillFd;
+    //total size of the packet under assembly, in memory or spilled
+    size_t packetSize;
+    //connection number in the traffic trace
+    uint32_t traceId;
+    //the one deadline pending for this connection and which one it is
+    struct aesd_timer deadline;
+    int deadlineKind;
+    atomic_bool timedOut;
+    //bytes received but not yet consumed
+    char receiveBuffer[STREAM_CHUNK];
+    size_t receiveStart;
+    size_t receiveEnd;
 };
 
 typedef struct slist_data_s slist_data_t;
@@ -75,265 +269,1492 @@ struct slist_data_s
 	SLIST_ENTRY(slist_data_s) entries;
 };
 
+SLIST_HEAD(slisthead, slist_data_s);
+
 //add timespec
 static inline void timespec_add( struct timespec *returnValue, const struct timespec *timeStamp1, const struct timespec *timeStamp2)
 {
     returnValue->tv_sec = timeStamp1->tv_sec + timeStamp2->tv_sec;
     returnValue->tv_nsec = timeStamp1->tv_nsec + timeStamp2->tv_nsec;
 
-    if(returnValue->tv_nsec > TIMESPECADD) 
-    {
-        returnValue->tv_nsec -= TIMESPECADD;
-        returnValue->tv_sec ++;
-    }
+    if(returnValue->tv_nsec > TIMESPECADD) 
+    {
+        returnValue->tv_nsec -= TIMESPECADD;
+        returnValue->tv_sec ++;
+    }
+}
+
+//setup timer
+static bool setup_timer( int clockID, timer_t timerID, unsigned int timer_period_s, struct timespec *startTime)
+{
+    bool success = false;
+
+    if ( clock_gettime(clockID, startTime) != 0 ) 
+    {
+        printf("Error %d (%s) getting clock %d time\n",errno,strerror(errno),clockID);
+    } 
+    else 
+    {
+        struct itimerspec itimerspec;
+
+        itimerspec.it_interval.tv_sec = timer_period_s;
+        itimerspec.it_interval.tv_nsec = TIMER_N_SEC;
+
+        timespec_add(&itimerspec.it_value,startTime, &itimerspec.it_interval);
+
+        if( timer_settime(timerID, TIMER_ABSTIME, &itimerspec, NULL ) != 0 ) 
+            printf("Error %d (%s) setting timer\n",errno,strerror(errno));
+        else 
+            success = true;
+    }
+    return success;
+}
+
+void timer_thread (union sigval sigval)
+{
+	struct timerthread* timtd = (struct timerthread*) sigval.sival_ptr;
+
+	time_t rawtime;
+	struct storePosition end;
+
+	struct tm *info;
+
+	char *myTime;
+
+	size_t returnValue;
+
+	time(&rawtime);
+    
+	info = localtime(&rawtime);
+
+	myTime = (char*)malloc(MAXSIZE*sizeof(char));
+
+    if(myTime == NULL)
+    {
+        syslog(LOG_ERR, "ERROR: Failed to allocate memory in timer_thread...");
+        return;
+    }
+
+	returnValue = strftime(myTime, 80, "timestamp: %Y %b %a %H %M %S%n", info);
+
+    if(returnValue == 0)
+    {
+        perror("ERROR: Failed strftime and returned 0....");
+        free(myTime);
+        return;
+    }
+
+	//timestamps go through the store like any packet, so they are locked and deduplicated alike
+	if(commitBuffer(timtd->timerStore, myTime, returnValue, &end) == FAILURE)
+    {
+		syslog(LOG_ERR, "ERROR: Timestamp error...");
+	}
+
+	free(myTime);
+}
+
+
+//append one event to the traffic trace, stdio locking keeps concurrent records whole
+static void traceEvent(uint32_t connection, uint8_t event, uint8_t flags, uint64_t size, uint64_t replay)
+{
+    struct aesd_trace_record record;
+    struct timespec now;
+
+    if(traceFile == NULL)
+        return;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    memset(&record, 0, sizeof(record));
+    record.timestamp = (now.tv_sec - traceStart.tv_sec) * TIMESPECADD + (now.tv_nsec - traceStart.tv_nsec);
+    record.size = size;
+    record.replay = replay;
+    record.connection = connection;
+    record.event = event;
+    record.flags = flags;
+
+    if(fwrite(&record, sizeof(record), 1, traceFile) != 1)
+        syslog(LOG_ERR, "ERROR: Failed to write trace record...");
+}
+
+//create the trace file and write its header
+static int openTrace(const char *tracePath)
+{
+    struct aesd_trace_header header;
+
+    traceFile = fopen(tracePath, "wb");
+    if(traceFile == NULL)
+    {
+        syslog(LOG_ERR, "ERROR: Failed to open trace file... errno:%s", strerror(errno));
+        return FAILURE;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, AESD_TRACE_MAGIC, sizeof(header.magic));
+    header.version = AESD_TRACE_VERSION;
+    header.record_size = sizeof(struct aesd_trace_record);
+    fwrite(&header, sizeof(header), 1, traceFile);
+
+    clock_gettime(CLOCK_MONOTONIC, &traceStart);
+    return 0;
+}
+
+//write all bytes to a file descriptor, retrying short writes
+static int writeAll(int writeFd, const char *data, size_t size)
+{
+    ssize_t writeReturnValue;
+
+    while(size > 0)
+    {
+        writeReturnValue = write(writeFd, data, size);
+        if(writeReturnValue == FAILURE)
+        {
+            if(errno == EINTR)
+                continue;
+            return FAILURE;
+        }
+        data += writeReturnValue;
+        size -= writeReturnValue;
+    }
+    return 0;
+}
+
+//send all bytes to a socket, retrying short sends
+static int sendAll(int sendFd, const char *data, size_t size)
+{
+    ssize_t sendReturnValue;
+
+    while(size > 0)
+    {
+        sendReturnValue = aesd_co_send(sendFd, data, size, MSG_NOSIGNAL);
+        if(sendReturnValue == FAILURE)
+        {
+            if(errno == EINTR)
+                continue;
+            return FAILURE;
+        }
+        data += sendReturnValue;
+        size -= sendReturnValue;
+    }
+    return 0;
+}
+
+//open an unlinked file used to stage a packet larger than streamThreshold
+static int openSpill(void)
+{
+    char spillPath[] = SPILL_TEMPLATE;
+    int spillFd;
+
+    spillFd = open(SPILL_DIR, O_TMPFILE | O_RDWR, 0600);
+    if(spillFd != FAILURE)
+        return spillFd;
+
+    //fall back for filesystems without O_TMPFILE support
+    spillFd = mkstemp(spillPath);
+    if(spillFd != FAILURE)
+        unlink(spillPath);
+
+    return spillFd;
+}
+
+//initialise the log over dataFd, in dedup mode the file is started empty since plain bytes can not be parsed as records
+static int storeInit(struct store *store, int dataFd, bool dedup)
+{
+    memset(store, 0, sizeof(*store));
+    store->fd = dataFd;
+    store->dedup = dedup;
+    pthread_mutex_init(&store->lock, NULL);
+
+    if(dedup)
+    {
+        if(ftruncate(dataFd, 0) == FAILURE)
+            return FAILURE;
+        store->tableSize = DEDUP_TABLE_INITIAL;
+        store->table = calloc(store->tableSize, sizeof(struct dedupEntry));
+        if(store->table == NULL)
+            return FAILURE;
+        return 0;
+    }
+
+    store->physicalEnd = lseek(dataFd, 0, SEEK_END);
+    store->logicalEnd = store->physicalEnd;
+    return store->physicalEnd == (off_t)FAILURE ? FAILURE : 0;
+}
+
+static void storeDestroy(struct store *store)
+{
+    size_t index;
+
+    for(index = 0; index * INDEX_BLOCK < store->indexCount; index++)
+        free(store->indexBlocks[index]);
+    free(store->indexBlocks);
+    free(store->table);
+    pthread_mutex_destroy(&store->lock);
+}
+
+//64 bit FNV-1a
+static uint64_t hashPacket(const char *data, size_t size)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    while(size-- > 0)
+    {
+        hash ^= (unsigned char)*data++;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+//compare a candidate's payload in the file with the packet, the hash alone is not trusted
+static bool dedupMatches(struct store *store, const struct dedupEntry *entry, const char *data, size_t size)
+{
+    char compare[STREAM_CHUNK];
+    size_t compared = 0;
+    ssize_t readReturnValue;
+
+    if(entry->length != size)
+        return false;
+
+    while(compared < size)
+    {
+        readReturnValue = pread(store->fd, compare, size - compared < sizeof(compare) ? size - compared : sizeof(compare),
+                entry->offset + compared);
+        if(readReturnValue <= 0 || memcmp(compare, &data[compared], readReturnValue) != 0)
+            return false;
+        compared += readReturnValue;
+    }
+    return true;
+}
+
+//find the first copy of a packet, called with the store locked
+static struct dedupEntry *dedupLookup(struct store *store, uint64_t hash, const char *data, size_t size)
+{
+    size_t slot = hash & (store->tableSize - 1);
+
+    while(store->table[slot].offset != 0)
+    {
+        if(store->table[slot].hash == hash && dedupMatches(store, &store->table[slot], data, size))
+            return &store->table[slot];
+        slot = (slot + 1) & (store->tableSize - 1);
+    }
+    return NULL;
+}
+
+//remember where a literal payload landed, the table doubles at 70% load up to DEDUP_MAX_ENTRIES
+static void dedupInsert(struct store *store, uint64_t hash, off_t offset, size_t length)
+{
+    struct dedupEntry *oldTable = store->table;
+    size_t oldSize = store->tableSize;
+    struct dedupEntry *newTable;
+    size_t slot;
+    size_t index;
+
+    if((store->tableCount + 1) * 10 > store->tableSize * 7)
+    {
+        //past the cap new packets are simply stored literally
+        if(store->tableSize >= DEDUP_MAX_ENTRIES)
+            return;
+        newTable = calloc(oldSize * 2, sizeof(struct dedupEntry));
+        if(newTable == NULL)
+            return;
+        store->table = newTable;
+        store->tableSize = oldSize * 2;
+        for(index = 0; index < oldSize; index++)
+        {
+            if(oldTable[index].offset == 0)
+                continue;
+            slot = oldTable[index].hash & (store->tableSize - 1);
+            while(newTable[slot].offset != 0)
+                slot = (slot + 1) & (store->tableSize - 1);
+            newTable[slot] = oldTable[index];
+        }
+        free(oldTable);
+    }
+
+    slot = hash & (store->tableSize - 1);
+    while(store->table[slot].offset != 0)
+        slot = (slot + 1) & (store->tableSize - 1);
+    store->table[slot].hash = hash;
+    store->table[slot].offset = offset;
+    store->table[slot].length = length;
+    store->tableCount++;
+}
+
+//build a record header, returns its size
+static size_t encodeRecord(char *header, char type, uint64_t length, uint64_t offset)
+{
+    header[0] = type;
+    memcpy(&header[1], &length, sizeof(length));
+    if(type == RECORD_LITERAL)
+        return RECORD_LITERAL_SIZE;
+    memcpy(&header[1 + sizeof(length)], &offset, sizeof(offset));
+    return RECORD_REFERENCE_SIZE;
+}
+
+//cut the file back to the last whole commit after a failed write, so the log never holds a torn record
+static void storeRollback(struct store *store)
+{
+    if(ftruncate(store->fd, store->physicalEnd) == FAILURE)
+        syslog(LOG_ERR, "ERROR: Failed to roll back data file... errno:%s", strerror(errno));
+}
+
+//make room for one more commit index entry before writing, so a commit never lands unindexed
+static int storeIndexReserve(struct store *store)
+{
+    struct commitIndex **tempPtr;
+    size_t block = store->indexCount / INDEX_BLOCK;
+
+    if(!mergedView || store->indexCount % INDEX_BLOCK != 0)
+        return 0;
+
+    if(block == store->indexBlockSlots)
+    {
+        tempPtr = realloc(store->indexBlocks, (block ? block * 2 : 16) * sizeof(*tempPtr));
+        if(tempPtr == NULL)
+            return FAILURE;
+        store->indexBlocks = tempPtr;
+        store->indexBlockSlots = block ? block * 2 : 16;
+    }
+    store->indexBlocks[block] = malloc(INDEX_BLOCK * sizeof(struct commitIndex));
+    return store->indexBlocks[block] == NULL ? FAILURE : 0;
+}
+
+static struct commitIndex *indexEntry(struct commitIndex **blocks, size_t index)
+{
+    return &blocks[index / INDEX_BLOCK][index % INDEX_BLOCK];
+}
+
+//account for a successful commit, called with the store locked
+static void storeAdvance(struct store *store, size_t physicalSize, size_t logicalSize, struct storePosition *end)
+{
+    struct commitIndex *entry;
+
+    store->physicalEnd += physicalSize;
+    store->logicalEnd += logicalSize;
+    end->sequence = 0;
+
+    if(store->device)
+    {
+        store->physicalEnd = lseek(store->fd, 0, SEEK_END);
+        if(store->physicalEnd == (off_t)FAILURE)
+            store->physicalEnd = 0;
+        store->logicalEnd = store->physicalEnd;
+    }
+
+    if(mergedView)
+    {
+        //taken under the store lock, so every channel's index is in sequence order
+        entry = indexEntry(store->indexBlocks, store->indexCount++);
+        entry->sequence = atomic_fetch_add(&commitSequence, 1) + 1;
+        entry->physicalEnd = store->physicalEnd;
+        entry->logicalEnd = store->logicalEnd;
+        end->sequence = entry->sequence;
+    }
+}
+
+//append a packet held in memory to the log, end is set to the log size after the commit
+static int commitBuffer(struct store *store, const char *data, size_t size, struct storePosition *end)
+{
+    char header[RECORD_REFERENCE_SIZE];
+    struct dedupEntry *entry = NULL;
+    uint64_t hash = 0;
+    size_t headerSize = 0;
+    int returnValue;
+
+    //lock mutex while writing
+    pthread_mutex_lock(&store->lock);
+    if(storeIndexReserve(store) == FAILURE)
+    {
+        pthread_mutex_unlock(&store->lock);
+        return FAILURE;
+    }
+    if(store->dedup)
+    {
+        //short packets cost less than a reference, so only longer ones are looked up
+        if(size >= DEDUP_MIN_SIZE)
+        {
+            hash = hashPacket(data, size);
+            entry = dedupLookup(store, hash, data, size);
+        }
+        if(entry != NULL)
+            headerSize = encodeRecord(header, RECORD_REFERENCE, size, entry->offset);
+        else
+            headerSize = encodeRecord(header, RECORD_LITERAL, size, 0);
+    }
+
+    returnValue = writeAll(store->fd, header, headerSize);
+    if(returnValue == 0 && entry == NULL)
+        returnValue = writeAll(store->fd, data, size);
+
+    if(returnValue == FAILURE)
+    {
+        storeRollback(store);
+    }
+    else
+    {
+        if(store->dedup && entry == NULL && size >= DEDUP_MIN_SIZE)
+            dedupInsert(store, hash, store->physicalEnd + headerSize, size);
+        storeAdvance(store, headerSize + (entry == NULL ? size : 0), size, end);
+    }
+    end->physical = store->physicalEnd;
+    end->logical = store->logicalEnd;
+    //unlock mutex after writing
+    pthread_mutex_unlock(&store->lock);
+
+    return returnValue;
+}
+
+//append a packet of size bytes staged in spillFd to the log in chunks, under one lock so it lands atomically
+//spilled packets are always stored literally, hashing them would mean reading them twice
+static int commitSpill(struct store *store, int spillFd, size_t size, char *chunk, size_t chunkSize,
+        struct storePosition *end)
+{
+    char header[RECORD_LITERAL_SIZE];
+    size_t headerSize = 0;
+    off_t readOffset = 0;
+    ssize_t readReturnValue = 0;
+    int returnValue = 0;
+
+    pthread_mutex_lock(&store->lock);
+    returnValue = storeIndexReserve(store);
+    if(returnValue == 0 && store->dedup)
+    {
+        headerSize = encodeRecord(header, RECORD_LITERAL, size, 0);
+        returnValue = writeAll(store->fd, header, headerSize);
+    }
+    while(returnValue == 0 && (size_t)readOffset < size)
+    {
+        readReturnValue = pread(spillFd, chunk, chunkSize, readOffset);
+        if(readReturnValue <= 0 || writeAll(store->fd, chunk, readReturnValue) == FAILURE)
+        {
+            returnValue = FAILURE;
+            break;
+        }
+        readOffset += readReturnValue;
+    }
+
+    if(returnValue == FAILURE)
+    {
+        storeRollback(store);
+    }
+    else
+    {
+        storeAdvance(store, headerSize + size, size, end);
+    }
+    end->physical = store->physicalEnd;
+    end->logical = store->logicalEnd;
+    pthread_mutex_unlock(&store->lock);
+
+    return returnValue;
+}
+
+//copy bytes to the replay output buffer, sending it whenever it fills; runs of a whole chunk skip the copy
+static int replayOutput(int clientFd, char *output, size_t *outputSize, const char *data, size_t size)
+{
+    size_t copySize;
+
+    if(*outputSize == 0 && size >= STREAM_CHUNK)
+        return sendAll(clientFd, data, size);
+
+    while(size > 0)
+    {
+        copySize = STREAM_CHUNK - *outputSize;
+        if(copySize > size)
+            copySize = size;
+        memcpy(&output[*outputSize], data, copySize);
+        *outputSize += copySize;
+        data += copySize;
+        size -= copySize;
+
+        if(*outputSize == STREAM_CHUNK)
+        {
+            if(sendAll(clientFd, output, *outputSize) == FAILURE)
+                return FAILURE;
+            *outputSize = 0;
+        }
+    }
+    return 0;
+}
+
+//replay the records of a deduplicated log between start and end, expanding references to the bytes they point at
+static int replayRecords(struct store *store, int clientFd, char *chunk, size_t chunkSize,
+        char *output, size_t *outputSize, off_t start, off_t end)
+{
+    off_t windowStart = start;
+    size_t windowSize = 0;
+    off_t position = start;
+    uint64_t length;
+    uint64_t offset;
+    size_t headerSize;
+    size_t copySize;
+    ssize_t readReturnValue;
+
+    while(position < end)
+    {
+        //refill the read window when the next header is not wholly inside it
+        if(position + RECORD_REFERENCE_SIZE > windowStart + (off_t)windowSize && windowStart + (off_t)windowSize < end)
+        {
+            readReturnValue = pread(store->fd, chunk, end - position < (off_t)chunkSize ? end - position : (off_t)chunkSize,
+                    position);
+            if(readReturnValue <= 0)
+                return FAILURE;
+            windowStart = position;
+            windowSize = readReturnValue;
+        }
+
+        headerSize = chunk[position - windowStart] == RECORD_LITERAL ? RECORD_LITERAL_SIZE : RECORD_REFERENCE_SIZE;
+        if(position + (off_t)headerSize > windowStart + (off_t)windowSize)
+            return FAILURE;
+        memcpy(&length, &chunk[position - windowStart + 1], sizeof(length));
+        if(headerSize == RECORD_REFERENCE_SIZE)
+            memcpy(&offset, &chunk[position - windowStart + 1 + sizeof(length)], sizeof(offset));
+        else
+            offset = position + headerSize;
+        position += headerSize;
+        if(headerSize == RECORD_LITERAL_SIZE)
+            position += length;
+
+        //payload bytes still in the window are copied from there, the rest are read in place
+        while(length > 0)
+        {
+            if((off_t)offset >= windowStart && (off_t)offset < windowStart + (off_t)windowSize)
+            {
+                copySize = windowStart + windowSize - offset;
+                if(copySize > length)
+                    copySize = length;
+                if(replayOutput(clientFd, output, outputSize, &chunk[offset - windowStart], copySize) == FAILURE)
+                    return FAILURE;
+            }
+            else
+            {
+                if(*outputSize == STREAM_CHUNK)
+                {
+                    if(sendAll(clientFd, output, *outputSize) == FAILURE)
+                        return FAILURE;
+                    *outputSize = 0;
+                }
+                copySize = STREAM_CHUNK - *outputSize;
+                if(copySize > length)
+                    copySize = length;
+                readReturnValue = pread(store->fd, &output[*outputSize], copySize, offset);
+                if(readReturnValue <= 0)
+                    return FAILURE;
+                copySize = readReturnValue;
+                *outputSize += copySize;
+            }
+            offset += copySize;
+            length -= copySize;
+        }
+    }
+    return 0;
+}
+
+//replay the part of a log between two physical offsets through the output buffer
+static int replayRange(struct store *store, int clientFd, char *chunk, size_t chunkSize,
+        char *output, size_t *outputSize, off_t start, off_t end)
+{
+    size_t toSendSize;
+    ssize_t readReturnValue;
+
+    //the file is append only, so bytes before end can be read without the mutex
+    if(store->dedup)
+        return replayRecords(store, clientFd, chunk, chunkSize, output, outputSize, start, end);
+
+    while(start < end)
+    {
+        toSendSize = chunkSize;
+        if((off_t)toSendSize > end - start)
+            toSendSize = end - start;
+
+        readReturnValue = pread(store->fd, chunk, toSendSize, start);
+        //a device that dropped old writes since its size was taken ends early; the client was told
+        //how many bytes to expect, so a short replay fails and drops the connection
+        if(readReturnValue <= 0)
+            return FAILURE;
+
+        //send data
+        if(replayOutput(clientFd, output, outputSize, chunk, readReturnValue) == FAILURE)
+            return FAILURE;
+        start += readReturnValue;
+    }
+    return 0;
+}
+
+//send a log up to end to the client
+static int replayData(struct store *store, int clientFd, char *chunk, size_t chunkSize, const struct storePosition *end)
+{
+    char output[STREAM_CHUNK];
+    size_t outputSize = 0;
+
+    if(replayRange(store, clientFd, chunk, chunkSize, output, &outputSize, 0, end->physical) == FAILURE ||
+            (outputSize > 0 && sendAll(clientFd, output, outputSize) == FAILURE))
+    {
+        syslog(LOG_ERR,"ERROR: Failed to send data...");
+        return FAILURE;
+    }
+    return 0;
+}
+
+//capture every channel's commits up to sequence; locking each store waits out commits that took an earlier number
+static int takeSnapshot(struct mergedSnapshot *snapshot, uint64_t sequence)
+{
+    struct channelSnapshot *channel;
+    struct store *store;
+    size_t blockCount;
+    size_t count;
+    size_t index;
+
+    pthread_mutex_lock(&channelLock);
+    count = channelCount;
+    pthread_mutex_unlock(&channelLock);
+
+    snapshot->channelCount = 0;
+    snapshot->logicalEnd = 0;
+    for(index = 0; index <= count; index++)
+    {
+        store = index == 0 ? &dataStore : &channels[index - 1];
+        channel = &snapshot->channel[snapshot->channelCount];
+
+        pthread_mutex_lock(&store->lock);
+        channel->store = store;
+        channel->count = store->indexCount;
+        blockCount = (channel->count + INDEX_BLOCK - 1) / INDEX_BLOCK;
+        channel->blocks = blockCount ? malloc(blockCount * sizeof(*channel->blocks)) : NULL;
+        if(channel->blocks != NULL)
+            memcpy(channel->blocks, store->indexBlocks, blockCount * sizeof(*channel->blocks));
+        pthread_mutex_unlock(&store->lock);
+
+        if(blockCount != 0 && channel->blocks == NULL)
+            return FAILURE;
+        snapshot->channelCount++;
+
+        //commits after ours are left out
+        while(channel->count > 0 && indexEntry(channel->blocks, channel->count - 1)->sequence > sequence)
+            channel->count--;
+        if(channel->count > 0)
+            snapshot->logicalEnd += indexEntry(channel->blocks, channel->count - 1)->logicalEnd;
+    }
+    return 0;
+}
+
+static void releaseSnapshot(struct mergedSnapshot *snapshot)
+{
+    size_t index;
+
+    for(index = 0; index < snapshot->channelCount; index++)
+        free(snapshot->channel[index].blocks);
+    snapshot->channelCount = 0;
+}
+
+//send every channel's packets in the snapshot, interleaved in commit order
+static int replayMerged(struct mergedSnapshot *snapshot, int clientFd, char *chunk, size_t chunkSize)
+{
+    char output[STREAM_CHUNK];
+    size_t outputSize = 0;
+    size_t next[CHANNEL_MAX + 1] = {0};
+    off_t start[CHANNEL_MAX + 1] = {0};
+    struct commitIndex *entry;
+    struct commitIndex *earliest;
+    size_t earliestChannel;
+    size_t index;
+
+    for(;;)
+    {
+        earliest = NULL;
+        earliestChannel = 0;
+        for(index = 0; index < snapshot->channelCount; index++)
+        {
+            if(next[index] == snapshot->channel[index].count)
+                continue;
+            entry = indexEntry(snapshot->channel[index].blocks, next[index]);
+            if(earliest == NULL || entry->sequence < earliest->sequence)
+            {
+                earliest = entry;
+                earliestChannel = index;
+            }
+        }
+        if(earliest == NULL)
+            break;
+
+        if(replayRange(snapshot->channel[earliestChannel].store, clientFd, chunk, chunkSize, output, &outputSize,
+                start[earliestChannel], earliest->physicalEnd) == FAILURE)
+        {
+            syslog(LOG_ERR,"ERROR: Failed to send data...");
+            return FAILURE;
+        }
+        start[earliestChannel] = earliest->physicalEnd;
+        next[earliestChannel]++;
+    }
+
+    if(outputSize > 0 && sendAll(clientFd, output, outputSize) == FAILURE)
+        return FAILURE;
+    return 0;
+}
+
+//ack and/or replay after a commit: a channel connection sees its own log, a default one with -M every channel merged
+static int respondToCommit(struct connection *conn, char *chunk, size_t chunkSize, const struct storePosition *end,
+        bool ack, bool replay)
+{
+    struct mergedSnapshot snapshot;
+    bool merged = mergedView && conn->store == &dataStore;
+    off_t logicalEnd = end->logical;
+    char ackBuffer[ACK_SIZE];
+    int returnValue = 0;
+
+    if(merged)
+    {
+        if(takeSnapshot(&snapshot, end->sequence) == FAILURE)
+        {
+            releaseSnapshot(&snapshot);
+            return FAILURE;
+        }
+        logicalEnd = snapshot.logicalEnd;
+    }
+
+    if(ack)
+    {
+        snprintf(ackBuffer, sizeof(ackBuffer), "%lld\n", (long long)logicalEnd);
+        returnValue = sendAll(conn->clientFd, ackBuffer, strlen(ackBuffer));
+    }
+
+    if(returnValue == 0 && replay)
+    {
+        if(merged)
+            returnValue = replayMerged(&snapshot, conn->clientFd, chunk, chunkSize);
+        else
+            returnValue = replayData(conn->store, conn->clientFd, chunk, chunkSize, end);
+    }
+
+    if(merged)
+        releaseSnapshot(&snapshot);
+    return returnValue;
+}
+
+static void channelPath(char *path, const char *name)
+{
+    snprintf(path, CHANNEL_PATH_SIZE, "%s.%s", FILE_OUT_PATH, name);
+}
+
+//find the log for a channel key, creating its file on first use; only this lookup takes the global lock
+static struct store *openChannel(const char *name)
+{
+    char path[CHANNEL_PATH_SIZE];
+    struct store *store = NULL;
+    size_t index;
+    int dataFd;
+
+    pthread_mutex_lock(&channelLock);
+    for(index = 0; index < channelCount; index++)
+    {
+        if(strcmp(channels[index].name, name) == 0)
+        {
+            store = &channels[index];
+            break;
+        }
+    }
+
+    if(store == NULL && channelCount < CHANNEL_MAX)
+    {
+        channelPath(path, name);
+        dataFd = open(path, O_CREAT | O_APPEND | O_RDWR, 0666);
+        if(dataFd == FAILURE || storeInit(&channels[channelCount], dataFd, dedup) == FAILURE)
+        {
+            syslog(LOG_ERR, "ERROR: Failed to open channel %s... errno:%s", name, strerror(errno));
+            if(dataFd != FAILURE)
+                close(dataFd);
+        }
+        else
+        {
+            store = &channels[channelCount++];
+            strcpy(store->name, name);
+        }
+    }
+    pthread_mutex_unlock(&channelLock);
+
+    if(store == NULL)
+        syslog(LOG_ERR, "ERROR: No channel available for %s...", name);
+    return store;
+}
+
+//deadline expiry, runs on the timer wheel's ticker: shutting the socket down wakes the connection's thread
+static void connectionTimeout(struct aesd_timer *timer)
+{
+    struct connection *conn = (struct connection *)((char *)timer - offsetof(struct connection, deadline));
+
+    atomic_store(&conn->timedOut, true);
+    shutdown(conn->clientFd, SHUT_RDWR);
+}
+
+//switch the connection to a new deadline; re-arming the same kind keeps the original deadline
+static void setDeadline(struct connection *conn, int kind)
+{
+    unsigned int timeout = 0;
+
+    if(conn->deadlineKind == kind)
+        return;
+    conn->deadlineKind = kind;
+
+    if(kind == DEADLINE_IDLE)
+        timeout = idleTimeout;
+    else if(kind == DEADLINE_READ)
+        timeout = readTimeout;
+    else if(kind == DEADLINE_REPLAY)
+        timeout = replayTimeout;
+
+    if(timeout != 0)
+        aesd_timer_arm(&timerWheel, &conn->deadline, timeout);
+    else
+        aesd_timer_cancel(&timerWheel, &conn->deadline);
+}
+
+//add bytes to the packet under assembly, spilling to disk once it outgrows streamThreshold
+static int appendPacket(struct connection *conn, const char *data, size_t size)
+{
+    char* tempPtr = NULL;
+
+    conn->packetSize += size;
+
+    //once the packet outgrows the threshold, stream it to a spill file instead of the heap
+    if(conn->spillFd == FAILURE && conn->bufferSize + size > streamThreshold)
+    {
+        conn->spillFd = openSpill();
+        if(conn->spillFd == FAILURE || writeAll(conn->spillFd, conn->bufferAppend, conn->bufferSize) == FAILURE)
+        {
+            syslog(LOG_ERR, "ERROR: Failed to stage large packet... errno:%s", strerror(errno));
+            return FAILURE;
+        }
+        conn->bufferSize = 0;
+    }
+
+    if(conn->spillFd != FAILURE)
+    {
+        if(writeAll(conn->spillFd, data, size) == FAILURE)
+        {
+            syslog(LOG_ERR, "ERROR: Failed to stage large packet... errno:%s", strerror(errno));
+            return FAILURE;
+        }
+        return 0;
+    }
+
+    if((conn->memAllocSize - conn->bufferSize) < size)
+    {
+        //grow geometrically, never past the streaming threshold
+        while((conn->memAllocSize - conn->bufferSize) < size)
+            conn->memAllocSize *= 2;
+        if(conn->memAllocSize > streamThreshold)
+            conn->memAllocSize = streamThreshold;
+
+        tempPtr = (char*)realloc(conn->bufferAppend, conn->memAllocSize * sizeof(char));
+        if(tempPtr == NULL)
+        {
+            syslog(LOG_ERR,"ERROR: Failed to realloc appending buffer...");
+            return FAILURE;
+        }
+        conn->bufferAppend = tempPtr;
+    }
+
+    //load into buffer
+    memcpy(&conn->bufferAppend[conn->bufferSize], data, size);
+    conn->bufferSize += size;
+    return 0;
+}
+
+//assemble the next newline terminated packet, returns 1 when one is ready and 0 at end of stream
+static int receivePacket(struct connection *conn)
+{
+    char* newlinePosition = NULL;
+    size_t length;
+    ssize_t receiveReturnValue;
+
+    do
+    {
+        if(conn->receiveStart == conn->receiveEnd)
+        {
+            //idle until a packet starts, then the read deadline covers the whole packet
+            setDeadline(conn, conn->packetSize == 0 ? DEADLINE_IDLE : DEADLINE_READ);
+
+            //receive data
+            receiveReturnValue = aesd_co_recv(conn->clientFd, conn->receiveBuffer, sizeof(conn->receiveBuffer), 0);
+
+            //check for error
+            if(receiveReturnValue == FAILURE)
+            {
+                if(errno == EINTR)
+                    continue;
+                syslog(LOG_ERR, "ERROR: Failed to receive thread param values...");
+                return FAILURE;
+            }
+
+            //peer closed, a partial packet is dropped
+            if(receiveReturnValue == 0)
+                return 0;
+
+            conn->receiveStart = 0;
+            conn->receiveEnd = receiveReturnValue;
+        }
+
+        newlinePosition = memchr(&conn->receiveBuffer[conn->receiveStart], '\n', conn->receiveEnd - conn->receiveStart);
+        if(newlinePosition != NULL)
+            length = newlinePosition - &conn->receiveBuffer[conn->receiveStart] + 1;
+        else
+            length = conn->receiveEnd - conn->receiveStart;
+
+        if(appendPacket(conn, &conn->receiveBuffer[conn->receiveStart], length) == FAILURE)
+            return FAILURE;
+        conn->receiveStart += length;
+
+    //keep going until new line found
+    }while(newlinePosition == NULL);
+
+    return 1;
 }
 
-//setup timer
-static bool setup_timer( int clockID, timer_t timerID, unsigned int timer_period_s, struct timespec *startTime)
+//commit the assembled packet to the data file and reset the assembly state
+static int commitPacket(struct connection *conn, char *chunk, size_t chunkSize, struct storePosition *endPosition)
 {
-    bool success = false;
+    int returnValue;
 
-    if ( clock_gettime(clockID, startTime) != 0 ) 
+    if(conn->spillFd != FAILURE)
     {
-        printf("Error %d (%s) getting clock %d time\n",errno,strerror(errno),clockID);
-    } 
-    else 
+        returnValue = commitSpill(conn->store, conn->spillFd, conn->packetSize, chunk, chunkSize, endPosition);
+        close(conn->spillFd);
+        conn->spillFd = FAILURE;
+    }
+    else
     {
-        struct itimerspec itimerspec;
-
-        itimerspec.it_interval.tv_sec = timer_period_s;
-        itimerspec.it_interval.tv_nsec = TIMER_N_SEC;
-
-        timespec_add(&itimerspec.it_value,startTime, &itimerspec.it_interval);
+        returnValue = commitBuffer(conn->store, conn->bufferAppend, conn->bufferSize, endPosition);
+    }
+    conn->bufferSize = 0;
+    conn->packetSize = 0;
 
-        if( timer_settime(timerID, TIMER_ABSTIME, &itimerspec, NULL ) != 0 ) 
-            printf("Error %d (%s) setting timer\n",errno,strerror(errno));
-        else 
-            success = true;
+    if(returnValue == FAILURE)
+    {
+        syslog(LOG_ERR, "ERROR: Failed to write to file...");
+        return FAILURE;
     }
-    return success;
+    return 0;
 }
 
-void timer_thread (union sigval sigval)
+//check for the in-band pipeline command, sets replay from its argument
+static bool isPipelineCommand(struct connection *conn, bool *replay)
 {
-	struct timerthread* timtd = (struct timerthread*) sigval.sival_ptr;
+    size_t commandLength = strlen(PIPELINE_COMMAND);
 
-	time_t rawtime;
-
-	struct tm *info;
-
-	char *myTime;
-
-	size_t returnValue;
-
-	time(&rawtime);
-    
-	info = localtime(&rawtime);
+    if(conn->spillFd != FAILURE || conn->bufferSize != commandLength + 2)
+        return false;
+    if(strncmp(conn->bufferAppend, PIPELINE_COMMAND, commandLength) != 0)
+        return false;
+    if(conn->bufferAppend[commandLength] != '0' && conn->bufferAppend[commandLength] != '1')
+        return false;
 
-	myTime = (char*)malloc(MAXSIZE*sizeof(char));
+    *replay = (conn->bufferAppend[commandLength] == '1');
+    return true;
+}
 
-    if(myTime == NULL)
+//check for the in-band channel command, copies its key to name
+static bool isChannelCommand(struct connection *conn, char *name)
+{
+    size_t commandLength = strlen(CHANNEL_COMMAND);
+    size_t nameLength;
+    size_t index;
+
+    if(conn->spillFd != FAILURE || conn->bufferSize < commandLength + 2 ||
+            conn->bufferSize > commandLength + CHANNEL_NAME_MAX + 1)
+        return false;
+    if(strncmp(conn->bufferAppend, CHANNEL_COMMAND, commandLength) != 0)
+        return false;
+
+    //keys become part of a file name, so only letters, digits, '-' and '_' are accepted
+    nameLength = conn->bufferSize - commandLength - 1;
+    for(index = 0; index < nameLength; index++)
     {
-        syslog(LOG_ERR, "ERROR: Failed to allocate memory in timer_thread...");
-        return;
+        name[index] = conn->bufferAppend[commandLength + index];
+        if(!isalnum((unsigned char)name[index]) && name[index] != '-' && name[index] != '_')
+            return false;
     }
+    name[nameLength] = '\0';
+    return true;
+}
 
-	returnValue = strftime(myTime, 80, "timestamp: %Y %b %a %H %M %S%n", info);
+//check for the in-band seek command, sets seekto from its arguments
+static bool isSeekCommand(struct connection *conn, struct aesd_seekto *seekto)
+{
+    char line[SEEKTO_COMMAND_MAX];
+    size_t commandLength = strlen(SEEKTO_COMMAND);
+    char terminator;
+
+    if(conn->spillFd != FAILURE || conn->bufferSize <= commandLength || conn->bufferSize >= sizeof(line))
+        return false;
+    if(strncmp(conn->bufferAppend, SEEKTO_COMMAND, commandLength) != 0)
+        return false;
+
+    memcpy(line, conn->bufferAppend, conn->bufferSize);
+    line[conn->bufferSize] = '\0';
+    if(sscanf(&line[commandLength], "%u,%u%c", &seekto->write_cmd, &seekto->write_cmd_offset, &terminator) != 3)
+        return false;
+    return terminator == '\n';
+}
 
-    if(returnValue == 0)
+//send the device contents from the seek position on, read through a descriptor of its own so the
+//position is not shared, and nothing before it is copied; sendfile keeps the bytes in the kernel,
+//read and send are the fallback for a driver without splice_read, and for coroutines since sendfile
+//would block their worker
+static int replaySeek(struct connection *conn, char *chunk, size_t chunkSize, const struct aesd_seekto *seekto)
+{
+    ssize_t readReturnValue;
+    bool useSendfile = !aesd_co_active();
+    int deviceFd;
+    int returnValue = 0;
+
+    deviceFd = open(devicePath, O_RDONLY);
+    if(deviceFd == FAILURE)
     {
-        perror("ERROR: Failed strftime and returned 0....");
-        free(myTime);
+        syslog(LOG_ERR, "ERROR: Failed to open %s... errno:%s", devicePath, strerror(errno));
+        return FAILURE;
     }
 
-	if(pthread_mutex_lock(&mutex)!=0)
+    if(ioctl(deviceFd, AESDCHAR_IOCSEEKTO, seekto) == FAILURE)
     {
-		perror("ERROR: Failed to lock mutex...");
-		free(myTime);
-	}
-
-	int writeReturnValue = write(timtd->timerParams, myTime, returnValue);
+        syslog(LOG_ERR, "ERROR: Failed to seek to write %u offset %u... errno:%s", seekto->write_cmd,
+                seekto->write_cmd_offset, strerror(errno));
+        close(deviceFd);
+        return FAILURE;
+    }
 
-	if(writeReturnValue != returnValue)
+    for(;;)
     {
-		syslog(LOG_ERR, "ERROR: Timestamp error...");
-		free(myTime);
-	}
+        if(useSendfile)
+        {
+            readReturnValue = sendfile(conn->clientFd, deviceFd, NULL, SENDFILE_CHUNK);
+            if(readReturnValue == FAILURE && (errno == EINVAL || errno == ENOSYS))
+            {
+                useSendfile = false;
+                continue;
+            }
+        }
+        else
+            readReturnValue = read(deviceFd, chunk, chunkSize);
 
-	if(pthread_mutex_unlock(&mutex)!=0)
-    {
-		perror("ERROR: Failed to unlock mutex...");
-		free(myTime);
-	}	
+        if(readReturnValue == 0)
+            break;
+        if(readReturnValue == FAILURE)
+        {
+            if(errno == EINTR)
+                continue;
+            returnValue = FAILURE;
+            break;
+        }
+        if(!useSendfile && sendAll(conn->clientFd, chunk, readReturnValue) == FAILURE)
+        {
+            returnValue = FAILURE;
+            break;
+        }
+    }
+    if(returnValue == FAILURE)
+        syslog(LOG_ERR,"ERROR: Failed to send data...");
 
-	free(myTime);
+    close(deviceFd);
+    return returnValue;
 }
 
-
 void* threadHandler(void* thread_param)
 {
 
 	struct params* threadParamValues = (struct params*) thread_param;
 	
-    int memAllocSize = MAXSIZE;
-    int sendIndex = 0; 
-    int position = 0;
-    int endPosition = 0; 
-    int nextLineSize = 0;
-    int toSendSize = 0;
-	char buffer[MAXSIZE];				
-    char* bufferAppend = (char*)malloc(MAXSIZE*sizeof(char));										   
-	size_t bufferSize = 0;									
-	off_t retVal;
-	
-    //clear buffer
-    memset(buffer, '\0', sizeof(buffer));
-
-    int receiveReturnValue = 0;
-    int writeReturnValue = 0;
-    int readReturnValue = 0;
-    char* newlinePosition = NULL; 
-    char* newlinePosition2 =NULL;
-	char* tempPtr = NULL; 
-    char* tempPtr2 = NULL;
+    struct connection conn;
+    char chunk[STREAM_CHUNK];
+    char name[CHANNEL_NAME_MAX + 1];
+    struct storePosition endPosition;
+    struct aesd_seekto seekto;
+    bool replay = true;
+    size_t packetSize;
+    int status;
+
+    memset(&conn, 0, sizeof(conn));
+    conn.clientFd = threadParamValues->threadFd;
+    conn.store = &dataStore;
+    conn.spillFd = FAILURE;
+    conn.memAllocSize = MAXSIZE;
+    conn.bufferAppend = (char*)malloc(MAXSIZE*sizeof(char));
+    conn.traceId = atomic_fetch_add(&traceConnectionId, 1);
+    aesd_timer_init(&conn.deadline, connectionTimeout);
+    atomic_init(&conn.timedOut, false);
 
     char *IP = inet_ntoa(connection_addr.sin_addr);
     syslog(LOG_DEBUG, "Connection Accepted: %s\n", IP);
-		
-    do
+    traceEvent(conn.traceId, AESD_TRACE_CONNECT, 0, 0, 0);
+
+    if(conn.bufferAppend == NULL)
     {
-        //receive data
-        receiveReturnValue = recv(threadParamValues->threadFd, buffer, sizeof(buffer), 0);
+        syslog(LOG_ERR,"ERROR: Failed to malloc appending buffer...");
+        goto cleanup;
+    }
 
-        //check for error
-        if(receiveReturnValue == FAILURE)
-        {
-            syslog(LOG_ERR, "ERROR: Failed to receive thread param values...");
-            return NULL;
-        }
-        else
-        {
-            if((memAllocSize-bufferSize) < receiveReturnValue)
-            {
-                memAllocSize += receiveReturnValue;
+    if(receivePacket(&conn) != 1)
+        goto cleanup;
 
-                tempPtr = (char*)realloc(bufferAppend, memAllocSize* sizeof(char));
+    //a leading channel command moves the connection to that channel's log
+    if(isChannelCommand(&conn, name))
+    {
+        conn.store = openChannel(name);
+        conn.bufferSize = 0;
+        conn.packetSize = 0;
+        if(conn.store == NULL || receivePacket(&conn) != 1)
+            goto cleanup;
+    }
 
-                if(tempPtr!= NULL)
-                    bufferAppend=tempPtr;
+    //with -c a seek command is answered from the device and never stored
+    if(devicePath != NULL && conn.store == &dataStore && isSeekCommand(&conn, &seekto))
+    {
+        setDeadline(&conn, DEADLINE_REPLAY);
+        replaySeek(&conn, chunk, sizeof(chunk), &seekto);
+        goto cleanup;
+    }
 
-            }
-            //load into buffer
-            memcpy(&bufferAppend[bufferSize], buffer, receiveReturnValue);				
-        }
+    if(!isPipelineCommand(&conn, &replay))
+    {
+        //legacy client: one packet, which includes anything received along with its newline
+        if(appendPacket(&conn, &conn.receiveBuffer[conn.receiveStart], conn.receiveEnd - conn.receiveStart) == FAILURE)
+            goto cleanup;
+        packetSize = conn.packetSize;
+        if(commitPacket(&conn, chunk, sizeof(chunk), &endPosition) == FAILURE)
+            goto cleanup;
+        traceEvent(conn.traceId, AESD_TRACE_PACKET, AESD_TRACE_FLAG_REPLAY, packetSize, endPosition.logical);
+
+        setDeadline(&conn, DEADLINE_REPLAY);
+        respondToCommit(&conn, chunk, sizeof(chunk), &endPosition, false, true);
+        goto cleanup;
+    }
+
+    //pipelined client: every packet is acked with the end offset, optionally followed by that many bytes of replay
+    conn.bufferSize = 0;
+    conn.packetSize = 0;
+    traceEvent(conn.traceId, AESD_TRACE_PIPELINE, replay ? AESD_TRACE_FLAG_REPLAY : 0, 0, 0);
+    while((status = receivePacket(&conn)) == 1)
+    {
+        packetSize = conn.packetSize;
+        if(commitPacket(&conn, chunk, sizeof(chunk), &endPosition) == FAILURE)
+            break;
+        traceEvent(conn.traceId, AESD_TRACE_PACKET, replay ? AESD_TRACE_FLAG_REPLAY : 0,
+                packetSize, replay ? endPosition.logical : 0);
 
-        bufferSize+=receiveReturnValue;
+        setDeadline(&conn, DEADLINE_REPLAY);
+        if(respondToCommit(&conn, chunk, sizeof(chunk), &endPosition, true, replay) == FAILURE)
+            break;
+        setDeadline(&conn, DEADLINE_NONE);
+    }
 
-        newlinePosition = strchr(buffer, '\n');	
+cleanup:
+    //the deadline has to be gone before the fd can be reused
+    aesd_timer_cancel(&timerWheel, &conn.deadline);
+    free(conn.bufferAppend);
+    if(conn.spillFd != FAILURE)
+        close(conn.spillFd);
 
-    //keep going until new line found
-    }while(newlinePosition == NULL); 
+    //close fd
+    close(conn.clientFd);	
+    if(atomic_load(&conn.timedOut))
+        syslog(LOG_INFO,"Connection Timed Out: %s",IP);
+    syslog(LOG_INFO,"Connection Closed: %s",IP);	   
+    traceEvent(conn.traceId, AESD_TRACE_CLOSE, 0, 0, 0);
 
+    //set thread flag
+    threadParamValues->threadFlag = true;
 
-    //lock mutex while writing
-    pthread_mutex_lock(&mutex);
-    writeReturnValue = write(fd[FD_DATA], bufferAppend, bufferSize);
-    if(writeReturnValue == -1)
+    return NULL;
+}
+
+//coroutine entry, the handler is unchanged since its socket calls yield instead of blocking
+static void connectionCoroutine(void *arg)
+{
+    threadHandler(arg);
+    free(arg);
+}
+
+//run a new connection as a coroutine on one of the workers
+static int spawnConnection(int clientFd)
+{
+    struct params *coParamValues;
+
+    coParamValues = calloc(1, sizeof(struct params));
+    if(coParamValues == NULL)
+        return FAILURE;
+    coParamValues->threadFd = clientFd;
+
+    if(aesd_co_spawn(coScheduler, connectionCoroutine, coParamValues) != 0)
     {
-        syslog(LOG_ERR, "ERROR: Failed to write to file...");
-        return NULL;
+        free(coParamValues);
+        return FAILURE;
     }
-    //unlock mutex after writing
-    pthread_mutex_unlock(&mutex);	
+    return 0;
+}
 
+//hand a local client its ring memfd and eventfds over the UNIX socket
+static int sendRingFds(int clientFd, const int *ringFd, uint32_t capacity)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    char cmsgBuffer[CMSG_SPACE(sizeof(int) * AESD_SHM_RING_FDS)];
+
+    memset(&msg, 0, sizeof(msg));
+    memset(cmsgBuffer, 0, sizeof(cmsgBuffer));
+    iov.iov_base = &capacity;
+    iov.iov_len = sizeof(capacity);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cmsgBuffer;
+    msg.msg_controllen = sizeof(cmsgBuffer);
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * AESD_SHM_RING_FDS);
+    memcpy(CMSG_DATA(cmsg), ringFd, sizeof(int) * AESD_SHM_RING_FDS);
+
+    return sendmsg(clientFd, &msg, MSG_NOSIGNAL) == sizeof(capacity) ? 0 : FAILURE;
+}
 
-    endPosition = lseek(fd[FD_DATA], 0, SEEK_END);
+//sleep until the producer publishes or hangs up, returns false on hang up
+static bool waitRing(struct aesd_shm_ring_header *header, uint64_t tail, int dataFd, int clientFd)
+{
+    struct pollfd pollFds[2];
+    eventfd_t value;
+    int spin;
 
-    retVal = lseek(fd[FD_DATA], 0, SEEK_SET);
-    if(retVal == (off_t)FAILURE)
+    for(spin = 0; spin < aesd_shm_ring_spin_limit(); spin++)
     {
-        syslog(LOG_ERR, "ERROR: Failed lseek for end of file position");
-        return NULL;
+        if(atomic_load_explicit(&header->head, memory_order_acquire) != tail)
+            return true;
     }
 
-    //while not at the end of file
-    while(sendIndex != endPosition)
+    //publish that we sleep before the final check, the producer checks the flag after publishing
+    atomic_store(&header->consumer_waiting, 1);
+    if(atomic_load(&header->head) == tail)
     {
-        toSendSize=0;
-        
-        char* bufferAppend2 = (char*)malloc(MAXSIZE*sizeof(char));
-        if(bufferAppend2 == NULL)
-        {
-            syslog(LOG_ERR,"ERROR: Failed to malloc appending buffer...");
-            break;
-        }
+        pollFds[0].fd = dataFd;
+        pollFds[0].events = POLLIN;
+        pollFds[1].fd = clientFd;
+        pollFds[1].events = POLLIN;
+        if(poll(pollFds, 2, -1) == FAILURE && errno != EINTR)
+            return false;
+        if(pollFds[1].revents != 0)
+            return false;
+        if(pollFds[0].revents & POLLIN)
+            eventfd_read(dataFd, &value);
+    }
+    atomic_store(&header->consumer_waiting, 0);
+    return true;
+}
 
-        //clear buffer
-        memset(bufferAppend2, '\0', MAXSIZE);
+//serve one local client: hand it a ring and append every record it publishes, like a TCP packet.
+//The client can write anything to the header, so records are checked against the capacity
+//chosen here, never the one in the header.
+void* ringHandler(void* thread_param)
+{
+    struct params* threadParamValues = (struct params*) thread_param;
+    struct aesd_shm_ring_header *header = MAP_FAILED;
+    const uint32_t capacity = AESD_SHM_RING_DEFAULT_CAPACITY;
+    size_t mapSize = AESD_SHM_RING_HEADER_SIZE + capacity;
+    int ringFd[AESD_SHM_RING_FDS] = {FAILURE, FAILURE, FAILURE};
+    uint32_t traceId = atomic_fetch_add(&traceConnectionId, 1);
+    uint64_t tail = 0;
+    uint64_t head;
+    uint64_t committed = 0;
+    uint32_t length;
+    size_t position;
+    char *data;
+    struct storePosition endPosition;
+    int index;
+
+    ringFd[AESD_SHM_RING_FD_MEM] = memfd_create("aesdsocket-ring", MFD_CLOEXEC);
+    ringFd[AESD_SHM_RING_FD_DATA] = eventfd(0, EFD_CLOEXEC);
+    ringFd[AESD_SHM_RING_FD_ACK] = eventfd(0, EFD_CLOEXEC);
+    if(ringFd[AESD_SHM_RING_FD_MEM] == FAILURE || ringFd[AESD_SHM_RING_FD_DATA] == FAILURE ||
+            ringFd[AESD_SHM_RING_FD_ACK] == FAILURE || ftruncate(ringFd[AESD_SHM_RING_FD_MEM], mapSize) == FAILURE)
+    {
+        syslog(LOG_ERR, "ERROR: Failed to create local ring... errno:%s", strerror(errno));
+        goto cleanup;
+    }
+
+    header = mmap(NULL, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, ringFd[AESD_SHM_RING_FD_MEM], 0);
+    if(header == MAP_FAILED)
+    {
+        syslog(LOG_ERR, "ERROR: Failed to map local ring... errno:%s", strerror(errno));
+        goto cleanup;
+    }
+    header->magic = AESD_SHM_RING_MAGIC;
+    header->capacity = capacity;
+    data = aesd_shm_ring_data(header);
 
-        //get size of next line
-        nextLineSize = endPosition - position;
+    if(sendRingFds(threadParamValues->threadFd, ringFd, capacity) == FAILURE)
+    {
+        syslog(LOG_ERR, "ERROR: Failed to send local ring... errno:%s", strerror(errno));
+        goto cleanup;
+    }
+    syslog(LOG_DEBUG, "Local Connection Accepted");
+    traceEvent(traceId, AESD_TRACE_CONNECT, AESD_TRACE_FLAG_LOCAL, 0, 0);
 
-        do
+    while(!sigFlag && waitRing(header, tail, ringFd[AESD_SHM_RING_FD_DATA], threadParamValues->threadFd))
+    {
+        head = atomic_load_explicit(&header->head, memory_order_acquire);
+        while(tail != head)
         {
-            //lock mutex while reading
-            pthread_mutex_lock(&mutex);										
-            readReturnValue = read(fd[FD_DATA], bufferAppend2+toSendSize, sizeof(char));
+            //tail only moves by whole records, so position is 8 byte aligned and the length fits
+            position = tail & (capacity - 1);
+            memcpy(&length, &data[position], sizeof(length));
 
-            if(readReturnValue == FAILURE)
+            if(length == AESD_SHM_RING_PAD)
             {
-                    syslog(LOG_ERR,"ERROR: Failed to read...");
-                    return NULL;
-            }       
-
-            //unlock mutex after reading
-            pthread_mutex_unlock(&mutex);        							
-
-            //
-            if(memAllocSize - toSendSize < endPosition)
+                if(capacity - position > head - tail)
+                {
+                    syslog(LOG_ERR, "ERROR: Corrupt local ring record...");
+                    goto cleanup;
+                }
+                tail += capacity - position;
+                continue;
+            }
+            if(length > capacity / 2 || aesd_shm_ring_record_size(length) > head - tail ||
+                    position + aesd_shm_ring_record_size(length) > capacity)
             {
-                //add next line size to the current malloc size
-                memAllocSize += nextLineSize;
-                tempPtr2 = (char*)realloc(bufferAppend2, memAllocSize*sizeof(char)); 	
-                if(tempPtr2 != NULL)
-                    bufferAppend2 = tempPtr2;
-
+                syslog(LOG_ERR, "ERROR: Corrupt local ring record...");
+                goto cleanup;
             }
 
-            toSendSize += readReturnValue;
-
-            if(toSendSize>1)
+            if(commitBuffer(&dataStore, &data[position + sizeof(length)], length, &endPosition) == FAILURE)
             {
-                newlinePosition2 = strchr(bufferAppend2, '\n');    
+                syslog(LOG_ERR, "ERROR: Failed to write to file...");
+                goto cleanup;
             }
-        }while(newlinePosition2 == NULL);
+            tail += aesd_shm_ring_record_size(length);
+            committed++;
+            traceEvent(traceId, AESD_TRACE_PACKET, AESD_TRACE_FLAG_LOCAL, length, 0);
 
-        position = lseek(fd[FD_DATA], 0, SEEK_CUR);
-        sendIndex+=toSendSize;
-        
-        //send data
-        int sendReturn = send(threadParamValues->threadFd, bufferAppend2, toSendSize, 0);
-        if(sendReturn == FAILURE)
-        {
-                syslog(LOG_ERR,"ERROR: Failed to send data...");
-                return NULL;
+            atomic_store(&header->commit_offset, endPosition.logical);
+            atomic_store(&header->committed, committed);
+            atomic_store(&header->tail, tail);
         }
-	
-        free(bufferAppend2);
-	}
 
-    free(bufferAppend);
+        //wake a producer waiting for space or for its commit
+        if(atomic_load(&header->producer_waiting))
+            eventfd_write(ringFd[AESD_SHM_RING_FD_ACK], 1);
+    }
 
-    //close fd
-    close(fd[FD_CLIENT]);	
-    syslog(LOG_INFO,"Connection Closed: %s",IP);	   
+cleanup:
+    if(header != MAP_FAILED)
+        munmap(header, mapSize);
+    for(index = 0; index < AESD_SHM_RING_FDS; index++)
+    {
+        if(ringFd[index] != FAILURE)
+            close(ringFd[index]);
+    }
+    syslog(LOG_INFO, "Local Connection Closed");
+    traceEvent(traceId, AESD_TRACE_CLOSE, AESD_TRACE_FLAG_LOCAL, 0, 0);
 
-    //set thread flag
+    //the client sees the hang up now, the listener closes the fd once it has joined this thread
+    shutdown(threadParamValues->threadFd, SHUT_RDWR);
     threadParamValues->threadFlag = true;
+    return NULL;
+}
+
+//join the ring threads that finished, or every one with all set after disconnecting their clients
+static void joinRingThreads(struct slisthead *ringHead, bool all)
+{
+    slist_data_t *ringEntry;
+    slist_data_t *nextEntry;
+
+    ringEntry = SLIST_FIRST(ringHead);
+    while(ringEntry != NULL)
+    {
+        nextEntry = SLIST_NEXT(ringEntry, entries);
+        if(all || (ringEntry->value).threadFlag == true)
+        {
+            //a ring thread sleeping on its client wakes up to the hang up
+            if(all)
+                shutdown((ringEntry->value).threadFd, SHUT_RDWR);
+            pthread_join((ringEntry->value).thread, NULL);
+            close((ringEntry->value).threadFd);
+            SLIST_REMOVE(ringHead, ringEntry, slist_data_s, entries);
+            free(ringEntry);
+        }
+        ringEntry = nextEntry;
+    }
+}
+
+//accept local clients on the UNIX socket until shutdown, each gets a ring thread; they are
+//all joined before this returns, so none still appends once the store is torn down
+void* localListener(void* thread_param)
+{
+    struct slisthead ringHead;
+    slist_data_t *ringEntry;
+    int clientFd;
+
+    SLIST_INIT(&ringHead);
+    while(!sigFlag)
+    {
+        clientFd = accept(fd[FD_LOCAL], NULL, NULL);
+        if(clientFd == FAILURE)
+        {
+            if(errno == EINTR || errno == ECONNABORTED)
+                continue;
+            break;
+        }
+
+        ringEntry = calloc(1, sizeof(slist_data_t));
+        if(ringEntry == NULL)
+        {
+            close(clientFd);
+            continue;
+        }
+        (ringEntry->value).threadFd = clientFd;
+
+        if(pthread_create(&(ringEntry->value).thread, NULL, ringHandler, &ringEntry->value) != 0)
+        {
+            syslog(LOG_ERR, "ERROR: Failed to create local ring thread...");
+            close(clientFd);
+            free(ringEntry);
+            continue;
+        }
+        SLIST_INSERT_HEAD(&ringHead, ringEntry, entries);
+        joinRingThreads(&ringHead, false);
+    }
 
+    joinRingThreads(&ringHead, true);
     return NULL;
 }
 
+//bind and listen on the local transport socket
+static int setupLocal(void)
+{
+    struct sockaddr_un localAddr;
+
+    if(strlen(localPath) >= sizeof(localAddr.sun_path))
+    {
+        syslog(LOG_ERR, "ERROR: Local socket path too long...");
+        return FAILURE;
+    }
+
+    fd[FD_LOCAL] = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(fd[FD_LOCAL] == FAILURE)
+    {
+        syslog(LOG_ERR, "ERROR: Failed to get fd for FD_LOCAL...");
+        return FAILURE;
+    }
+
+    memset(&localAddr, 0, sizeof(localAddr));
+    localAddr.sun_family = AF_UNIX;
+    strcpy(localAddr.sun_path, localPath);
+    unlink(localPath);
+
+    if(bind(fd[FD_LOCAL], (struct sockaddr*)&localAddr, sizeof(localAddr)) == FAILURE ||
+            listen(fd[FD_LOCAL], BACKLOG) == FAILURE)
+    {
+        syslog(LOG_ERR, "ERROR: Failed to listen on local socket... errno:%s", strerror(errno));
+        return FAILURE;
+    }
+    return 0;
+}
+
 //signal handler
 void signalHandler(int signalNumber)
 {
@@ -344,6 +1765,9 @@ void signalHandler(int signalNumber)
         if(shutdown(fd[FD_SOCKET], SHUT_RDWR) == FAILURE)
             perror("ERROR: Failed to shut down socket...");
 
+        if(fd[FD_LOCAL] != FAILURE)
+            shutdown(fd[FD_LOCAL], SHUT_RDWR);
+
         sigFlag=1;
     }
 }
@@ -353,12 +1777,19 @@ int main(int argc, char *argv[])
 {
 
     int options = 1;	
+    int opt;
     int index = 0; 		
     int clockID = CLOCK_MONOTONIC;	
 													
     bool daemon = false;	
 	pid_t pid; 																												
     timer_t timerID;			
+    pthread_t localThread;
+    const char *tracePath = NULL;
+    char path[CHANNEL_PATH_SIZE];
+    size_t channelIndex;
+    const char *profilePath = NULL;
+    unsigned int profileHz = AESD_PROFILER_DEFAULT_HZ;
 
     struct addrinfo hints;													
 	struct addrinfo *res;	
@@ -368,11 +1799,11 @@ int main(int argc, char *argv[])
 											
 	//init linked list
 	slist_data_t *linkedListPtr = NULL;
-	SLIST_HEAD(slisthead, slist_data_s) head;
+	slist_data_t *nextListPtr = NULL;
+	struct slisthead head;
 	SLIST_INIT(&head);
 
-	//init mutex
-	pthread_mutex_init(&mutex, NULL);
+    fd[FD_LOCAL] = FAILURE;
 
 	//open log
 	openlog(NULL,0,LOG_USER);
@@ -381,22 +1812,80 @@ int main(int argc, char *argv[])
             syslog(LOG_ERR,"Failed SIGINT");
     else if (signal(SIGTERM, signalHandler) == SIG_ERR)
             syslog(LOG_ERR,"Failed SIGTERM");
-	
-	if(argc == 1)
-		daemon = false;
 
-	else if(argc > 2)
+    //sendfile has no MSG_NOSIGNAL, a client that goes away mid replay must not end the server
+    if (signal(SIGPIPE, SIG_IGN) == SIG_ERR)
+            syslog(LOG_ERR,"Failed SIGPIPE");
+	
+    //parse options: -d runs as a daemon, -s sets the streaming threshold in bytes,
+    //-u enables the shared memory transport on a UNIX socket path, -t records a traffic trace,
+    //-D stores repeated packets once, -M merges every channel into the replay of default connections,
+    //-T sets idle,read,replay connection deadlines in milliseconds, -w runs connections on worker threads,
+    //-P writes a sampling profile to a path on SIGUSR1 and at exit, sampling at -F hertz,
+    //-c keeps the default log on an aesdchar device
+    while((opt = getopt(argc, argv, "ds:u:t:DMT:w:P:F:c:")) != FAILURE)
     {
-		syslog(LOG_ERR,"ERROR: Too many arguements...");	
-		return FAILURE;
-	}
+        switch(opt)
+        {
+            case 'd':
+                daemon = true;
+                break;
+            case 's':
+                streamThreshold = strtoul(optarg, NULL, 10);
+                if(streamThreshold < MAXSIZE)
+                {
+                    syslog(LOG_ERR,"ERROR: Streaming threshold must be at least %d bytes...", MAXSIZE);
+                    return FAILURE;
+                }
+                break;
+            case 'u':
+                localPath = optarg;
+                break;
+            case 't':
+                tracePath = optarg;
+                break;
+            case 'D':
+                dedup = true;
+                break;
+            case 'M':
+                mergedView = true;
+                break;
+            case 'T':
+                if(sscanf(optarg, "%u,%u,%u", &idleTimeout, &readTimeout, &replayTimeout) < 1)
+                {
+                    syslog(LOG_ERR,"ERROR: Deadlines must be given as idle[,read[,replay]] milliseconds...");
+                    return FAILURE;
+                }
+                break;
+            case 'w':
+                coWorkers = strtoul(optarg, NULL, 10);
+                break;
+            case 'P':
+                profilePath = optarg;
+                break;
+            case 'F':
+                profileHz = strtoul(optarg, NULL, 10);
+                if(profileHz < 1 || profileHz > AESD_PROFILER_MAX_HZ)
+                {
+                    syslog(LOG_ERR,"ERROR: Sampling rate must be 1 to %d hertz...", AESD_PROFILER_MAX_HZ);
+                    return FAILURE;
+                }
+                break;
+            case 'c':
+                devicePath = optarg;
+                break;
+            default:
+                syslog(LOG_ERR,"ERROR: Invalid arguements...");
+                return FAILURE;
+        }
+    }
 
-	else if(argc == 2)
+    //the device holds plain writes and drops old ones, so neither records nor a commit index fit it
+    if(devicePath != NULL && (dedup || mergedView))
     {
-        //compare string for -d argument for daemon flag
-		if(strcmp(argv[1], "-d") == 0)
-			daemon = true;
-	}
+        syslog(LOG_ERR,"ERROR: -c can not be combined with -D or -M...");
+        return FAILURE;
+    }
 
     //clear memory
 	memset(&hints, 0, sizeof(hints)); 
@@ -455,8 +1944,11 @@ int main(int argc, char *argv[])
 	    return FAILURE;
 	}
 
-        //open file
-        fd[FD_DATA] = open(FILE_OUT_PATH, O_CREAT | O_APPEND | O_RDWR, 0666);
+        //open file, or the device with -c
+        if(devicePath != NULL)
+            fd[FD_DATA] = open(devicePath, O_RDWR);
+        else
+            fd[FD_DATA] = open(FILE_OUT_PATH, O_CREAT | O_APPEND | O_RDWR, 0666);
 
         //check for successful file open
         if(fd[FD_DATA] == FAILURE)
@@ -464,6 +1956,19 @@ int main(int argc, char *argv[])
                syslog(LOG_ERR, "ERROR: Failed to open file...");
                return FAILURE;
          }
+
+        if(storeInit(&dataStore, fd[FD_DATA], dedup) == FAILURE)
+        {
+               syslog(LOG_ERR, "ERROR: Failed to set up data store... errno:%s", strerror(errno));
+               return FAILURE;
+        }
+        dataStore.device = (devicePath != NULL);
+
+        //listen on the local transport socket when enabled
+        if(localPath != NULL && setupLocal() == FAILURE)
+        {
+               return FAILURE;
+        }
          	
         if(daemon)
         {
@@ -492,20 +1997,56 @@ int main(int argc, char *argv[])
         * Setup a call to timer_thread passing in the td structure as the sigev_value
         * argument
         */
-		td.timerParams = fd[FD_DATA];
+		td.timerStore = &dataStore;
         sev.sigev_notify = SIGEV_THREAD;
         sev.sigev_value.sival_ptr = &td;
         sev.sigev_notify_function = timer_thread;
 
-        if ( timer_create(clockID,&sev,&timerID) != 0 ) 
+        //the device keeps only the latest writes, timestamps would crowd out the clients' ones
+        if(devicePath == NULL)
+        {
+            if ( timer_create(clockID,&sev,&timerID) != 0 ) 
+            {
+                printf("Error %d (%s) creating timer!\n",errno,strerror(errno));
+            }
+
+            if(!(setup_timer(clockID, timerID, 10, &startTime)))
+            {
+                printf("Timer setup error!!");
+            }
+        }
+
+        //the profiler's timer and dump thread do not survive the fork either
+        if(profilePath != NULL && aesd_profiler_start(profilePath, profileHz) != 0)
+        {
+            syslog(LOG_ERR, "ERROR: Failed to start profiler...");
+            return FAILURE;
+        }
+
+        //open the trace after the fork so its timestamps start with the server
+        if(tracePath != NULL && openTrace(tracePath) == FAILURE)
+            return FAILURE;
+
+        //one ticker thread expires every connection deadline
+        if(aesd_timer_wheel_init(&timerWheel, AESD_TIMER_WHEEL_DEFAULT_TICK_MS) != 0 ||
+                ((idleTimeout || readTimeout || replayTimeout) && aesd_timer_wheel_start(&timerWheel) != 0))
+        {
+            syslog(LOG_ERR, "ERROR: Failed to start deadline timer...");
+            return FAILURE;
+        }
+
+        if(coWorkers != 0 && (coScheduler = aesd_co_scheduler_create(coWorkers, AESD_CO_DEFAULT_STACK_SIZE)) == NULL)
         {
-            printf("Error %d (%s) creating timer!\n",errno,strerror(errno));
+            syslog(LOG_ERR, "ERROR: Failed to start connection workers...");
+            return FAILURE;
         }
 
-		if(!(setup_timer(clockID, timerID, 10, &startTime)))
+        //threads do not survive the fork, so the local listener starts here
+        if(localPath != NULL && pthread_create(&localThread, NULL, localListener, NULL) != 0)
         {
-			printf("Timer setup error!!");
-		}
+            syslog(LOG_ERR, "ERROR: Failed to create local listener thread...");
+            return FAILURE;
+        }
 	}
 
     socklen_t addr_size = sizeof connection_addr;
@@ -526,6 +2067,17 @@ int main(int argc, char *argv[])
                     syslog(LOG_ERR, "ERROR: Failed to accept connection... errno:%s", strerror(errno));
                     return FAILURE;
                 }
+
+                //with -w the connection becomes a coroutine instead of a thread of its own
+                if(coScheduler != NULL)
+                {
+                    if(spawnConnection(fd[FD_CLIENT]) == FAILURE)
+                    {
+                        syslog(LOG_ERR, "ERROR: Failed to start connection coroutine...");
+                        close(fd[FD_CLIENT]);
+                    }
+                    continue;
+                }
                 
 				//setup the values in linked list for each entry
 				linkedListPtr = malloc(sizeof(slist_data_t));
@@ -550,14 +2102,19 @@ int main(int argc, char *argv[])
 			}
 				
 			//check through linked list
-			SLIST_FOREACH(linkedListPtr, &head, entries) 
+			linkedListPtr = SLIST_FIRST(&head);
+			while(linkedListPtr != NULL)
             {
-                //if flag is set
+                nextListPtr = SLIST_NEXT(linkedListPtr, entries);
+
+                //if flag is set, join the thread and drop its entry so it is joined only once
     	    	if((linkedListPtr->value).threadFlag == true)
                 {
-                    //join threads together
 					pthread_join((linkedListPtr->value).thread, NULL);
+                    SLIST_REMOVE(&head, linkedListPtr, slist_data_s, entries);
+                    free(linkedListPtr);
 				}
+                linkedListPtr = nextListPtr;
     		}
 	}
 	
@@ -580,7 +2137,48 @@ int main(int argc, char *argv[])
         linkedListPtr = NULL;
     }
 
+    //waits for the remaining coroutine connections, which may still rely on their deadlines
+    if(coScheduler != NULL)
+        aesd_co_scheduler_destroy(coScheduler);
+
+    if(idleTimeout || readTimeout || replayTimeout)
+        aesd_timer_wheel_stop(&timerWheel);
+    aesd_timer_wheel_destroy(&timerWheel);
+
+    if(localPath != NULL)
+    {
+        pthread_join(localThread, NULL);
+        close(fd[FD_LOCAL]);
+        unlink(localPath);
+    }
+
+    //write the final profile
+    if(profilePath != NULL)
+        aesd_profiler_stop();
+
+    //flush the trace
+    if(traceFile != NULL)
+    {
+        fclose(traceFile);
+    }
+
+    //stop the timestamps before the store they are written to goes away
+    if(devicePath == NULL)
+    {
+        timer_delete(timerID);
+    }
+
+	//close and remove channel logs
+	for(channelIndex = 0; channelIndex < channelCount; channelIndex++)
+    {
+        storeDestroy(&channels[channelIndex]);
+        close(channels[channelIndex].fd);
+        channelPath(path, channels[channelIndex].name);
+        remove(path);
+    }
+
 	//close files
+	storeDestroy(&dataStore);
 	close(fd[FD_DATA]);
 	close(fd[FD_SOCKET]);
 	close(fd[FD_CLIENT]);
@@ -588,11 +2186,11 @@ int main(int argc, char *argv[])
     //close log
 	closelog();
 
-    //delete timer
-	timer_delete(timerID);
-
-    //remove file
-    remove(FILE_OUT_PATH);
+    //remove file, a device is left as it is
+    if(devicePath == NULL)
+    {
+        remove(FILE_OUT_PATH);
+    }
 
 	return 0;
 }